@@ -0,0 +1,275 @@
+#include "cache.h"
+#include "config.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>	/* PATH_MAX */
+#include <string.h>
+#include <unistd.h>
+#include "libks/arena.h"
+#include "environment.h"
+#include "log.h"
+#include "util.h"
+
+/* Bump the last byte whenever the layout of the cache changes. */
+#define CACHE_MAGIC	0x6d64736f72740001ULL
+
+#define CACHE_NAME	"verdicts"
+#define CACHE_NSLOTS	(1u << 16)
+/* Upper bound of number of slots to probe before evicting. */
+#define CACHE_PROBE	8u
+
+struct cache_header {
+	uint64_t	magic;
+	uint64_t	nslots;
+};
+
+struct cache_slot {
+	uint64_t	key;	/* hash of path, zero if empty */
+	uint64_t	expr;	/* hash of expression */
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+};
+
+struct cache {
+	char			 c_path[PATH_MAX];
+	struct cache_header	*c_header;
+	struct cache_slot	*c_slots;
+	size_t			 c_siz;
+	int			 c_fd;
+
+	struct {
+		unsigned long	hit;
+		unsigned long	miss;
+		unsigned long	insert;
+	} c_stats;
+};
+
+static struct cache_slot	*cache_find(struct cache *, uint64_t,
+    uint64_t);
+static int			 cache_map(struct cache *);
+
+static uint64_t	cachekey(const char *, const char *);
+static int	cachemkdir(const char *);
+
+/*
+ * Open the verdict cache, used to remember messages that did not match any
+ * rule. The cache is a hash table backed by a memory mapped file located in
+ * the cache directory. Returns NULL if the cache is unavailable, either due to
+ * an error or since it's already in use by another process.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * cache_close().
+ */
+struct cache *
+cache_open(const struct environment *env, struct arena_scope *s)
+{
+	struct cache *c;
+
+	c = arena_calloc(s, 1, sizeof(*c));
+	c->c_fd = -1;
+
+	if (cachemkdir(env->ev_cachedir))
+		goto err;
+	if (pathjoin(c->c_path, sizeof(c->c_path), env->ev_cachedir,
+	    CACHE_NAME) == NULL) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		goto err;
+	}
+	c->c_fd = open(c->c_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (c->c_fd == -1) {
+		warn("open: %s", c->c_path);
+		goto err;
+	}
+	if (flock(c->c_fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK)
+			log_debug("%s: %s: locked\n", __func__, c->c_path);
+		else
+			warn("flock: %s", c->c_path);
+		goto err;
+	}
+	if (cache_map(c))
+		goto err;
+
+	log_debug("%s: %s\n", __func__, c->c_path);
+	return c;
+
+err:
+	cache_close(c);
+	return NULL;
+}
+
+void
+cache_close(struct cache *c)
+{
+	if (c == NULL)
+		return;
+
+	if (c->c_header != NULL) {
+		log_debug("%s: hit=%lu, miss=%lu, insert=%lu\n", __func__,
+		    c->c_stats.hit, c->c_stats.miss, c->c_stats.insert);
+		(void)munmap(c->c_header, c->c_siz);
+	}
+	if (c->c_fd != -1)
+		close(c->c_fd);
+}
+
+/*
+ * Returns non-zero if the given file is known to not match the expression
+ * associated with the given hash.
+ */
+int
+cache_lookup(struct cache *c, const char *dir, const char *name,
+    uint64_t expr, const struct stat *st)
+{
+	const struct cache_slot *cs;
+
+	cs = cache_find(c, cachekey(dir, name), expr);
+	if (cs == NULL || cs->ino != (uint64_t)st->st_ino ||
+	    cs->size != (int64_t)st->st_size ||
+	    cs->mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+	    cs->mtime_nsec != (int64_t)st->st_mtim.tv_nsec) {
+		c->c_stats.miss++;
+		return 0;
+	}
+
+	log_debug("%s: %s/%s\n", __func__, dir, name);
+	c->c_stats.hit++;
+	return 1;
+}
+
+/*
+ * Remember that the given file does not match the expression associated with
+ * the given hash.
+ */
+void
+cache_insert(struct cache *c, const char *dir, const char *name,
+    uint64_t expr, const struct stat *st)
+{
+	struct cache_slot *cs;
+	uint64_t key;
+
+	key = cachekey(dir, name);
+	cs = cache_find(c, key, expr);
+	if (cs == NULL) {
+		size_t i, idx;
+
+		/* Favor an empty slot, otherwise evict the first one. */
+		idx = (size_t)((key ^ expr) % c->c_header->nslots);
+		cs = &c->c_slots[idx];
+		for (i = 0; i < CACHE_PROBE; i++) {
+			struct cache_slot *tmp;
+
+			tmp = &c->c_slots[(idx + i) % c->c_header->nslots];
+			if (tmp->key == 0) {
+				cs = tmp;
+				break;
+			}
+		}
+	}
+
+	/* Invalidate the slot while being updated. */
+	cs->key = 0;
+	cs->expr = expr;
+	cs->ino = (uint64_t)st->st_ino;
+	cs->size = (int64_t)st->st_size;
+	cs->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+	cs->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+	cs->key = key;
+	c->c_stats.insert++;
+}
+
+static struct cache_slot *
+cache_find(struct cache *c, uint64_t key, uint64_t expr)
+{
+	size_t i, idx;
+
+	idx = (size_t)((key ^ expr) % c->c_header->nslots);
+	for (i = 0; i < CACHE_PROBE; i++) {
+		struct cache_slot *cs;
+
+		cs = &c->c_slots[(idx + i) % c->c_header->nslots];
+		if (cs->key == key && cs->expr == expr)
+			return cs;
+	}
+	return NULL;
+}
+
+static int
+cache_map(struct cache *c)
+{
+	struct stat st;
+	void *ptr;
+
+	c->c_siz = sizeof(struct cache_header) +
+	    CACHE_NSLOTS * sizeof(struct cache_slot);
+
+	if (fstat(c->c_fd, &st) == -1) {
+		warn("fstat: %s", c->c_path);
+		return 1;
+	}
+	if ((size_t)st.st_size != c->c_siz) {
+		/* Start over, discarding any stale contents. */
+		if (ftruncate(c->c_fd, 0) == -1 ||
+		    ftruncate(c->c_fd, (off_t)c->c_siz) == -1) {
+			warn("ftruncate: %s", c->c_path);
+			return 1;
+		}
+	}
+
+	ptr = mmap(NULL, c->c_siz, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    c->c_fd, 0);
+	if (ptr == MAP_FAILED) {
+		warn("mmap: %s", c->c_path);
+		return 1;
+	}
+	c->c_header = ptr;
+	c->c_slots = (struct cache_slot *)&c->c_header[1];
+
+	if (c->c_header->magic != CACHE_MAGIC ||
+	    c->c_header->nslots != CACHE_NSLOTS) {
+		log_debug("%s: %s: reset\n", __func__, c->c_path);
+		memset(ptr, 0, c->c_siz);
+		c->c_header->magic = CACHE_MAGIC;
+		c->c_header->nslots = CACHE_NSLOTS;
+	}
+
+	return 0;
+}
+
+static uint64_t
+cachekey(const char *dir, const char *name)
+{
+	uint64_t h;
+
+	h = fnv1a(FNV1A_INIT, dir, strlen(dir));
+	h = fnv1a(h, "/", 1);
+	h = fnv1a(h, name, strlen(name));
+	/* Zero denotes an empty slot. */
+	return h == 0 ? 1 : h;
+}
+
+/*
+ * Create the given directory, including its parent.
+ */
+static int
+cachemkdir(const char *path)
+{
+	char parent[PATH_MAX];
+
+	if (pathslice(path, parent, sizeof(parent), 0, -1) != NULL &&
+	    mkdir(parent, 0700) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", parent);
+		return 1;
+	}
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", path);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,13 @@
+#include <stdint.h>
+
+struct arena_scope;
+struct environment;
+struct stat;
+
+struct cache	*cache_open(const struct environment *, struct arena_scope *);
+void		 cache_close(struct cache *);
+
+int	cache_lookup(struct cache *, const char *, const char *, uint64_t,
+    const struct stat *);
+void	cache_insert(struct cache *, const char *, const char *, uint64_t,
+    const struct stat *);
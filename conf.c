@@ -2,12 +2,14 @@
 #include "config.h"
 #include "libks/arena-vector.h"
 #include "macro.h"
+#include "sync.h"
 
 void
 config_list_init(struct config_list *cl, struct arena_scope *s)
 {
 	cl->cl_macros = macros_alloc(MACRO_CTX_DEFAULT, s);
 	ARENA_VECTOR_INIT(s, cl->cl_list, 8);
+	cl->cl_sync = SYNC_ALWAYS;
 }
 
 struct config *
@@ -10,6 +10,7 @@ struct config {
 struct config_list {
 	struct macro_list	*cl_macros;
 	struct config		*cl_list;	/* VECTOR(struct config) */
+	int			 cl_sync;	/* enum sync_policy */
 };
 
 void		 config_list_init(struct config_list *, struct arena_scope *);
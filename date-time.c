@@ -2,6 +2,7 @@
 #include "config.h"
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -22,16 +23,29 @@ static const char	*formats[] = {
 	NULL,
 };
 
+/*
+ * Serializes all usage of the TZ environment variable as it's temporarily
+ * modified while parsing timezone abbreviations.
+ */
+static pthread_mutex_t	tzlock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Format the given timestamp into a human readable representation.
  */
 char *
 time_format(long long int tim, char *buf, size_t bufsiz)
 {
-	const struct tm *tm;
+	struct tm tm;
+	time_t t = (time_t)tim;
 
-	tm = localtime((time_t *)&tim);
-	if (strftime(buf, bufsiz, formats[0], tm) == 0) {
+	pthread_mutex_lock(&tzlock);
+	if (localtime_r(&t, &tm) == NULL) {
+		pthread_mutex_unlock(&tzlock);
+		warn("localtime");
+		return NULL;
+	}
+	pthread_mutex_unlock(&tzlock);
+	if (strftime(buf, bufsiz, formats[0], &tm) == 0) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		return NULL;
 	}
@@ -56,7 +70,9 @@ time_parse(const char *str, long long int *res, const struct environment *env)
 		return 1;
 	/* Let mktime(3) figure out if DST is in effect. */
 	tm.tm_isdst = -1;
+	pthread_mutex_lock(&tzlock);
 	tim = mktime(&tm);
+	pthread_mutex_unlock(&tzlock);
 	if (tim == -1) {
 		warnc(EINVAL, "mktime: %s", str);
 		return 1;
@@ -106,9 +122,12 @@ tzabbr(const char *str, time_t *tz, const struct environment *env)
 	if (strlen(str) == 0)
 		return 1;
 
+	pthread_mutex_lock(&tzlock);
+
 	if (setenv("TZ", str, 1) == -1) {
 		warn("setenv: TZ");
-		return 1;
+		error = 1;
+		goto out;
 	}
 	tzset();
 	tm = localtime((const time_t *)&env->ev_now);
@@ -124,19 +143,23 @@ tzabbr(const char *str, time_t *tz, const struct environment *env)
 	case TZ_STATE_LOCAL:
 		if (unsetenv("TZ") == -1) {
 			warn("unsetenv: TZ");
-			return 1;
+			error = 1;
+			goto out;
 		}
 		break;
 	case TZ_STATE_UTC:
 	case TZ_STATE_SET:
 		if (setenv("TZ", env->ev_tz.t_buf, 1) == -1) {
 			warn("setenv: TZ");
-			return 1;
+			error = 1;
+			goto out;
 		}
 		break;
 	}
 	tzset();
 
+out:
+	pthread_mutex_unlock(&tzlock);
 	return error;
 }
 
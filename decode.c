@@ -9,31 +9,37 @@
 #include "libks/buffer.h"
 #include "libks/compiler.h"
 
-static ssize_t	b64_pton(const char *, unsigned char *, size_t);
+static ssize_t	b64_pton(const char *, size_t, unsigned char *, size_t);
+static int	b64_getc(const char **, const char *);
 static void	quoted_printable_decode_buffer(struct buffer *, const char *,
     size_t, int);
 
 static int	htoa(char, char *);
 
+/*
+ * Decode the given base64 string of the given length, which is not required to
+ * be NUL-terminated.
+ */
 const char *
-base64_decode(const char *str, struct arena_scope *s)
+base64_decode(const char *str, size_t len, struct arena_scope *s)
 {
-	size_t len = strlen(str);
 	uint8_t *dec = arena_malloc(s, len + 1);
-	ssize_t n = b64_pton(str, dec, len + 1);
+	ssize_t n = b64_pton(str, len, dec, len + 1);
 	if (n == -1)
 		return NULL;
 	dec[n] = '\0';
 	return (char *)dec;
 }
 
+/*
+ * Decode the given quoted printable string of the given length, which is not
+ * required to be NUL-terminated.
+ */
 const char *
-quoted_printable_decode(const char *str, struct arena_scope *s)
+quoted_printable_decode(const char *str, size_t len, struct arena_scope *s)
 {
 	struct buffer *bf;
-	size_t len;
 
-	len = strlen(str);
 	bf = arena_buffer_alloc(s, len);
 	quoted_printable_decode_buffer(bf, str, len, 0);
 	return buffer_str(bf);
@@ -77,11 +83,9 @@ rfc2047_decode(const char *str, struct arena_scope *s)
 			len = (size_t)(ee - es);
 			switch (toupper((unsigned char)enc)) {
 			case 'B': {
-				const char *dst, *src;
+				const char *dst;
 
-				/* b64decode() requires a NUL-terminator. */
-				src = arena_strndup(s, es, len);
-				dst = base64_decode(src, s);
+				dst = base64_decode(es, len, s);
 				if (dst == NULL)
 					goto err;
 				buffer_printf(bf, "%s", dst);
@@ -169,7 +173,8 @@ quoted_printable_decode_buffer(struct buffer *bf, const char *str, size_t len,
 }
 
 static ssize_t
-b64_pton(const char *src, unsigned char *target, size_t targsize)
+b64_pton(const char *src, size_t srclen, unsigned char *target,
+    size_t targsize)
 {
 	static const char Base64[] =
 	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -177,12 +182,13 @@ b64_pton(const char *src, unsigned char *target, size_t targsize)
 	size_t tarindex;
 	int ch, state;
 	unsigned char nextbyte;
+	const char *end = &src[srclen];
 	const char *pos;
 
 	state = 0;
 	tarindex = 0;
 
-	while ((ch = (unsigned char)*src++) != '\0') {
+	while ((ch = b64_getc(&src, end)) != '\0') {
 		if (isspace(ch))	/* Skip whitespace anywhere. */
 			continue;
 
@@ -251,7 +257,7 @@ b64_pton(const char *src, unsigned char *target, size_t targsize)
 	 */
 
 	if (ch == Pad64) {			/* We got a pad char. */
-		ch = (unsigned char)*src++;	/* Skip it, get next. */
+		ch = b64_getc(&src, end);	/* Skip it, get next. */
 		switch (state) {
 		case 0:		/* Invalid = in first position */
 		case 1:		/* Invalid = in second position */
@@ -259,14 +265,14 @@ b64_pton(const char *src, unsigned char *target, size_t targsize)
 
 		case 2:		/* Valid, means one byte of info */
 			/* Skip any number of spaces. */
-			for (; ch != '\0'; ch = (unsigned char)*src++) {
+			for (; ch != '\0'; ch = b64_getc(&src, end)) {
 				if (!isspace(ch))
 					break;
 			}
 			/* Make sure there is another trailing = sign. */
 			if (ch != Pad64)
 				return -1;
-			ch = (unsigned char)*src++;		/* Skip the = */
+			ch = b64_getc(&src, end);		/* Skip the = */
 			/* Fall through to "single trailing =" case. */
 			FALLTHROUGH;
 
@@ -275,7 +281,7 @@ b64_pton(const char *src, unsigned char *target, size_t targsize)
 			 * We know this char is an =.  Is there anything but
 			 * whitespace after it?
 			 */
-			for (; ch != '\0'; ch = (unsigned char)*src++) {
+			for (; ch != '\0'; ch = b64_getc(&src, end)) {
 				if (!isspace(ch))
 					return -1;
 			}
@@ -302,6 +308,17 @@ b64_pton(const char *src, unsigned char *target, size_t targsize)
 	return (ssize_t)tarindex;
 }
 
+/*
+ * Get the next character from src, bounded by end. Returns NUL once exhausted.
+ */
+static int
+b64_getc(const char **src, const char *end)
+{
+	if (*src >= end)
+		return '\0';
+	return (unsigned char)*(*src)++;
+}
+
 /*
  * Hexadecimal to ASCII.
  */
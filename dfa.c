@@ -0,0 +1,861 @@
+#include "dfa.h"
+#include "config.h"
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libks/arena-vector.h"
+#include "libks/arena.h"
+#include "libks/vector.h"
+#include "util.h"
+
+/*
+ * Matcher for extended regular expressions, restricted to the subset of the
+ * syntax in which the outcome is equal to regexec(3) using REG_EXTENDED and
+ * REG_NEWLINE. The expression is first compiled into a NFA, which is in turn
+ * lazily converted into a DFA while matching. Only ASCII is supported, bytes
+ * outside of ASCII are left for regexec(3) to handle as their interpretation
+ * depends on the locale.
+ */
+
+#define DFA_MAX_NODES	4096
+#define DFA_MAX_REPEAT	255
+#define DFA_MAX_STATES	512
+#define DFA_TABLE_SIZE	(DFA_MAX_STATES * 2)
+
+/*
+ * Transition values, any greater value denotes the index of the destination
+ * state offset by DFA_TRANS_STATE.
+ */
+#define DFA_TRANS_NONE	0u	/* not yet computed */
+#define DFA_TRANS_BAIL	1u	/* unable to determine outcome */
+#define DFA_TRANS_STATE	2u
+
+struct dfa_set {
+	uint32_t	bits[8];
+};
+
+struct ast {
+	enum {
+		AST_SET,
+		AST_BOL,
+		AST_EOL,
+		AST_CAT,
+		AST_ALT,
+		AST_REPEAT,
+	} an_type;
+	int		 an_min;
+	int		 an_max;	/* -1 if unbounded */
+	struct ast	*an_lhs;
+	struct ast	*an_rhs;
+	struct dfa_set	 an_set;
+};
+
+struct nfa_node {
+	enum {
+		NFA_CHAR,
+		NFA_SPLIT,
+		NFA_BOL,
+		NFA_EOL,
+		NFA_MATCH,
+	} nn_op;
+	int		nn_out;
+	int		nn_out1;	/* only used by split */
+	struct dfa_set	nn_set;		/* only used by char */
+};
+
+struct dfa_state {
+	unsigned int	*ds_trans;	/* indexed by byte class */
+	int		*ds_nodes;	/* sorted NFA nodes */
+	size_t		 ds_nnodes;
+	uint64_t	 ds_hash;
+	unsigned int	 ds_flags;
+/* Entered at the beginning of a line. */
+#define DFA_STATE_BOL		0x00000001u
+/* Matches, no need to continue. */
+#define DFA_STATE_MATCH		0x00000002u
+/* Matches at the end of a line. */
+#define DFA_STATE_MATCH_EOL	0x00000004u
+};
+
+struct dfa {
+	VECTOR(struct nfa_node)	 df_nodes;
+	int			 df_start;
+
+	unsigned char		 df_classes[256];
+	unsigned char		 df_reps[256];	/* representative per class */
+	size_t			 df_nclasses;
+
+	/*
+	 * Lazily constructed states. Once published, a state and its
+	 * transitions can be read without holding the lock.
+	 */
+	pthread_mutex_t		 df_lock;
+	struct dfa_state	*df_states[DFA_MAX_STATES];
+	size_t			 df_nstates;
+	unsigned int		 df_table[DFA_TABLE_SIZE];
+	unsigned int		 df_matched;	/* index of match state */
+
+	/* Scratch space used while constructing states. */
+	unsigned int		*df_marks;
+	unsigned int		 df_gen;
+	int			*df_stack;
+	int			*df_list;
+	int			*df_seeds;
+};
+
+struct parser {
+	const char		*pr_str;
+	int			 pr_icase;
+	int			 pr_error;
+	struct arena_scope	*pr_scope;
+};
+
+static struct ast	*parse_alt(struct parser *);
+static struct ast	*parse_cat(struct parser *);
+static struct ast	*parse_piece(struct parser *);
+static struct ast	*parse_atom(struct parser *);
+static struct ast	*parse_bracket(struct parser *);
+static int		 parse_class(struct parser *, struct dfa_set *);
+static struct ast	*ast_alloc(struct parser *, int, struct ast *,
+    struct ast *);
+
+static int	nfa_emit(struct dfa *, const struct ast *, int);
+static int	nfa_node(struct dfa *, int, int, int);
+
+static void		 dfa_free(void *);
+static void		 dfa_init_classes(struct dfa *);
+static size_t		 dfa_closure(struct dfa *, const int *, size_t, int,
+    int);
+static unsigned int	 dfa_state(struct dfa *, const int *, size_t,
+    unsigned int);
+static unsigned int	 dfa_transition(struct dfa *, const struct dfa_state *,
+    unsigned int);
+
+static void	set_add(struct dfa_set *, unsigned char);
+static void	set_add_icase(struct dfa_set *, unsigned char);
+static int	set_has(const struct dfa_set *, unsigned char);
+static void	set_negate(struct dfa_set *);
+
+static int	intcmp(const void *, const void *);
+
+/*
+ * Compile the given extended regular expression, which must already be
+ * accepted by regcomp(3). Returns NULL if the expression uses any construct
+ * not supported.
+ */
+struct dfa *
+dfa_compile(const char *pattern, int icase, struct arena_scope *s)
+{
+	struct parser pr = {
+		.pr_str		= pattern,
+		.pr_icase	= icase,
+		.pr_scope	= s,
+	};
+	struct dfa *df;
+	struct ast *root;
+	size_t nnodes, nseeds;
+	int error;
+
+	root = parse_alt(&pr);
+	if (pr.pr_error || *pr.pr_str != '\0')
+		return NULL;
+
+	df = arena_calloc(s, 1, sizeof(*df));
+	ARENA_VECTOR_INIT(s, df->df_nodes, 64);
+	df->df_start = nfa_emit(df, root, nfa_node(df, NFA_MATCH, -1, -1));
+	if (df->df_start == -1)
+		return NULL;
+	dfa_init_classes(df);
+
+	nnodes = VECTOR_LENGTH(df->df_nodes);
+	df->df_marks = arena_calloc(s, nnodes, sizeof(*df->df_marks));
+	df->df_stack = arena_calloc(s, nnodes * 3 + 1, sizeof(*df->df_stack));
+	df->df_list = arena_calloc(s, nnodes, sizeof(*df->df_list));
+	df->df_seeds = arena_calloc(s, nnodes + 1, sizeof(*df->df_seeds));
+
+	if ((error = pthread_mutex_init(&df->df_lock, NULL)) != 0)
+		errc(1, error, "pthread_mutex_init");
+	arena_cleanup(s, dfa_free, df);
+
+	/* Sentinel state entered as soon as a match is found. */
+	df->df_matched = dfa_state(df, NULL, 0, DFA_STATE_MATCH);
+	df->df_seeds[0] = df->df_start;
+	nseeds = dfa_closure(df, df->df_seeds, 1, 1, 0);
+	(void)dfa_state(df, df->df_list, nseeds, DFA_STATE_BOL);
+
+	return df;
+}
+
+/*
+ * Returns DFA_MATCH if the expression matches the given string and
+ * DFA_NOMATCH if not. Otherwise, DFA_UNKNOWN is returned if the outcome could
+ * not be determined in which regexec(3) must be consulted. Safe to call
+ * concurrently.
+ */
+int
+dfa_match(struct dfa *df, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	const struct dfa_state *st = df->df_states[1];
+
+	if (st->ds_flags & DFA_STATE_MATCH)
+		return DFA_MATCH;
+
+	for (; *p != '\0'; p++) {
+		unsigned int cls = df->df_classes[*p];
+		unsigned int t;
+
+		t = __atomic_load_n(&st->ds_trans[cls], __ATOMIC_ACQUIRE);
+		if (t == DFA_TRANS_NONE)
+			t = dfa_transition(df, st, cls);
+		if (t == DFA_TRANS_BAIL)
+			return DFA_UNKNOWN;
+		st = df->df_states[t - DFA_TRANS_STATE];
+		if (st->ds_flags & DFA_STATE_MATCH)
+			return DFA_MATCH;
+	}
+
+	return (st->ds_flags & DFA_STATE_MATCH_EOL) ? DFA_MATCH : DFA_NOMATCH;
+}
+
+static struct ast *
+parse_alt(struct parser *pr)
+{
+	struct ast *lhs;
+
+	lhs = parse_cat(pr);
+	while (!pr->pr_error && *pr->pr_str == '|') {
+		pr->pr_str++;
+		lhs = ast_alloc(pr, AST_ALT, lhs, parse_cat(pr));
+	}
+	return lhs;
+}
+
+static struct ast *
+parse_cat(struct parser *pr)
+{
+	struct ast *lhs = NULL;
+
+	for (;;) {
+		char c = *pr->pr_str;
+
+		if (pr->pr_error || c == '\0' || c == '|' || c == ')')
+			break;
+		lhs = lhs == NULL ? parse_piece(pr) :
+		    ast_alloc(pr, AST_CAT, lhs, parse_piece(pr));
+	}
+	/* Empty branches are left for regexec(3). */
+	if (lhs == NULL)
+		pr->pr_error = 1;
+	return lhs;
+}
+
+static struct ast *
+parse_piece(struct parser *pr)
+{
+	struct ast *atom;
+
+	atom = parse_atom(pr);
+	if (pr->pr_error)
+		return NULL;
+
+	for (;;) {
+		struct ast *an;
+		char *end;
+		long min, max;
+
+		switch (*pr->pr_str) {
+		case '*':
+			min = 0;
+			max = -1;
+			pr->pr_str++;
+			break;
+		case '+':
+			min = 1;
+			max = -1;
+			pr->pr_str++;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			pr->pr_str++;
+			break;
+		case '{':
+			if (!isdigit((unsigned char)pr->pr_str[1]))
+				goto err;
+			min = max = strtol(&pr->pr_str[1], &end, 10);
+			if (*end == ',') {
+				end++;
+				if (isdigit((unsigned char)*end))
+					max = strtol(end, &end, 10);
+				else
+					max = -1;
+			}
+			if (*end != '}' || min > DFA_MAX_REPEAT ||
+			    max > DFA_MAX_REPEAT || (max != -1 && min > max))
+				goto err;
+			pr->pr_str = end + 1;
+			break;
+		default:
+			return atom;
+		}
+
+		/* Quantified anchors are left for regexec(3). */
+		if (atom->an_type == AST_BOL || atom->an_type == AST_EOL)
+			goto err;
+		an = ast_alloc(pr, AST_REPEAT, atom, NULL);
+		an->an_min = (int)min;
+		an->an_max = (int)max;
+		atom = an;
+	}
+
+err:
+	pr->pr_error = 1;
+	return NULL;
+}
+
+static struct ast *
+parse_atom(struct parser *pr)
+{
+	struct ast *an;
+	unsigned char c = (unsigned char)*pr->pr_str;
+
+	switch (c) {
+	case '(':
+		pr->pr_str++;
+		an = parse_alt(pr);
+		if (pr->pr_error || *pr->pr_str != ')')
+			break;
+		pr->pr_str++;
+		return an;
+
+	case '[':
+		return parse_bracket(pr);
+
+	case '.':
+		pr->pr_str++;
+		an = ast_alloc(pr, AST_SET, NULL, NULL);
+		set_add(&an->an_set, '\n');
+		set_negate(&an->an_set);
+		return an;
+
+	case '^':
+		pr->pr_str++;
+		return ast_alloc(pr, AST_BOL, NULL, NULL);
+
+	case '$':
+		pr->pr_str++;
+		return ast_alloc(pr, AST_EOL, NULL, NULL);
+
+	case '\\':
+		c = (unsigned char)pr->pr_str[1];
+		/* Back references and GNU extensions. */
+		if (c == '\0' || c >= 0x80 || isalnum(c))
+			break;
+		pr->pr_str += 2;
+		an = ast_alloc(pr, AST_SET, NULL, NULL);
+		set_add_icase(&an->an_set, c);
+		return an;
+
+	case ')':
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		break;
+
+	default:
+		if (c >= 0x80)
+			break;
+		pr->pr_str++;
+		an = ast_alloc(pr, AST_SET, NULL, NULL);
+		if (pr->pr_icase)
+			set_add_icase(&an->an_set, c);
+		else
+			set_add(&an->an_set, c);
+		return an;
+	}
+
+	pr->pr_error = 1;
+	return NULL;
+}
+
+static struct ast *
+parse_bracket(struct parser *pr)
+{
+	struct ast *an;
+	const char *p = pr->pr_str + 1;
+	int negate = 0;
+	int first = 1;
+
+	an = ast_alloc(pr, AST_SET, NULL, NULL);
+
+	if (*p == '^') {
+		negate = 1;
+		p++;
+	}
+	for (;;) {
+		unsigned char lo = (unsigned char)*p;
+		unsigned char hi, i;
+
+		if (lo == '\0' || lo >= 0x80)
+			goto err;
+		if (lo == ']' && !first)
+			break;
+		first = 0;
+
+		if (lo == '[' && p[1] == ':') {
+			pr->pr_str = p;
+			if (parse_class(pr, &an->an_set))
+				goto err;
+			p = pr->pr_str;
+			continue;
+		}
+		/* Equivalence classes and collating symbols. */
+		if (lo == '[' && (p[1] == '=' || p[1] == '.'))
+			goto err;
+
+		if (p[1] != '-' || p[2] == ']') {
+			set_add(&an->an_set, lo);
+			p++;
+			continue;
+		}
+
+		/*
+		 * Only allow ranges in which the collation order is
+		 * unambiguous.
+		 */
+		hi = (unsigned char)p[2];
+		if (hi < lo ||
+		    !((isdigit(lo) && isdigit(hi)) ||
+		    (islower(lo) && islower(hi)) ||
+		    (isupper(lo) && isupper(hi))))
+			goto err;
+		for (i = lo; i <= hi; i++)
+			set_add(&an->an_set, i);
+		p += 3;
+	}
+	pr->pr_str = p + 1;
+
+	if (pr->pr_icase) {
+		unsigned int c;
+
+		for (c = 0; c < 0x80; c++) {
+			if (set_has(&an->an_set, (unsigned char)c))
+				set_add_icase(&an->an_set, (unsigned char)c);
+		}
+	}
+	if (negate) {
+		set_add(&an->an_set, '\n');
+		set_negate(&an->an_set);
+	}
+	return an;
+
+err:
+	pr->pr_error = 1;
+	return NULL;
+}
+
+/*
+ * Parse character class, such as [:alpha:].
+ */
+static int
+parse_class(struct parser *pr, struct dfa_set *set)
+{
+	static const struct {
+		const char	*name;
+		int		(*fun)(int);
+	} classes[] = {
+		{ "alnum",	isalnum },
+		{ "alpha",	isalpha },
+		{ "blank",	isblank },
+		{ "cntrl",	iscntrl },
+		{ "digit",	isdigit },
+		{ "graph",	isgraph },
+		{ "lower",	islower },
+		{ "print",	isprint },
+		{ "punct",	ispunct },
+		{ "space",	isspace },
+		{ "upper",	isupper },
+		{ "xdigit",	isxdigit },
+	};
+	const char *beg, *end;
+	size_t i, len;
+
+	beg = pr->pr_str + 2;
+	end = strstr(beg, ":]");
+	if (end == NULL)
+		return 1;
+	len = (size_t)(end - beg);
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		unsigned int c;
+
+		if (strlen(classes[i].name) != len ||
+		    strncmp(classes[i].name, beg, len) != 0)
+			continue;
+
+		for (c = 1; c < 0x80; c++) {
+			if (classes[i].fun((int)c))
+				set_add(set, (unsigned char)c);
+		}
+		pr->pr_str = end + 2;
+		return 0;
+	}
+	return 1;
+}
+
+static struct ast *
+ast_alloc(struct parser *pr, int type, struct ast *lhs, struct ast *rhs)
+{
+	struct ast *an;
+
+	an = arena_calloc(pr->pr_scope, 1, sizeof(*an));
+	an->an_type = type;
+	an->an_lhs = lhs;
+	an->an_rhs = rhs;
+	return an;
+}
+
+/*
+ * Emit the NFA nodes for the given expression continuing to the given node.
+ * Returns the entry node or -1 if the NFA is too large.
+ */
+static int
+nfa_emit(struct dfa *df, const struct ast *an, int out)
+{
+	int i, n, split;
+
+	if (out == -1)
+		return -1;
+
+	switch (an->an_type) {
+	case AST_SET:
+		n = nfa_node(df, NFA_CHAR, out, -1);
+		if (n != -1)
+			df->df_nodes[n].nn_set = an->an_set;
+		return n;
+
+	case AST_BOL:
+		return nfa_node(df, NFA_BOL, out, -1);
+
+	case AST_EOL:
+		return nfa_node(df, NFA_EOL, out, -1);
+
+	case AST_CAT:
+		return nfa_emit(df, an->an_lhs, nfa_emit(df, an->an_rhs, out));
+
+	case AST_ALT:
+		i = nfa_emit(df, an->an_lhs, out);
+		n = nfa_emit(df, an->an_rhs, out);
+		if (i == -1 || n == -1)
+			return -1;
+		return nfa_node(df, NFA_SPLIT, i, n);
+
+	case AST_REPEAT:
+		if (an->an_max == -1) {
+			/* Loop back to the split node. */
+			split = nfa_node(df, NFA_SPLIT, -1, out);
+			if (split == -1)
+				return -1;
+			n = nfa_emit(df, an->an_lhs, split);
+			if (n == -1)
+				return -1;
+			df->df_nodes[split].nn_out = n;
+			out = split;
+		} else {
+			for (i = an->an_min; i < an->an_max; i++) {
+				n = nfa_emit(df, an->an_lhs, out);
+				if (n == -1)
+					return -1;
+				out = nfa_node(df, NFA_SPLIT, n, out);
+			}
+		}
+		for (i = 0; i < an->an_min; i++)
+			out = nfa_emit(df, an->an_lhs, out);
+		return out;
+	}
+
+	return -1;
+}
+
+static int
+nfa_node(struct dfa *df, int op, int out, int out1)
+{
+	struct nfa_node *nn;
+
+	if (VECTOR_LENGTH(df->df_nodes) >= DFA_MAX_NODES)
+		return -1;
+	nn = ARENA_VECTOR_CALLOC(df->df_nodes);
+	nn->nn_op = op;
+	nn->nn_out = out;
+	nn->nn_out1 = out1;
+	return (int)VECTOR_LENGTH(df->df_nodes) - 1;
+}
+
+static void
+dfa_free(void *arg)
+{
+	struct dfa *df = arg;
+	size_t i;
+
+	for (i = 0; i < df->df_nstates; i++) {
+		free(df->df_states[i]->ds_trans);
+		free(df->df_states[i]->ds_nodes);
+		free(df->df_states[i]);
+	}
+	pthread_mutex_destroy(&df->df_lock);
+}
+
+/*
+ * Partition all bytes into classes, all bytes within the same class are
+ * members of the same character sets. Newline and non-ASCII bytes always
+ * have their own classes.
+ */
+static void
+dfa_init_classes(struct dfa *df)
+{
+	unsigned char *classes = df->df_classes;
+	size_t i;
+	unsigned int c;
+
+	memset(classes, 0, sizeof(df->df_classes));
+	classes['\n'] = 1;
+	for (c = 0x80; c <= 0xff; c++)
+		classes[c] = 2;
+	df->df_nclasses = 3;
+
+	for (i = 0; i < VECTOR_LENGTH(df->df_nodes); i++) {
+		const struct nfa_node *nn = &df->df_nodes[i];
+		int remap[256 * 2];
+		unsigned int n = 0;
+
+		if (nn->nn_op != NFA_CHAR)
+			continue;
+
+		memset(remap, -1, sizeof(remap));
+		for (c = 0; c <= 0xff; c++) {
+			unsigned int key;
+
+			key = classes[c] * 2u +
+			    (unsigned int)set_has(&nn->nn_set, (unsigned char)c);
+			if (remap[key] == -1)
+				remap[key] = (int)n++;
+			classes[c] = (unsigned char)remap[key];
+		}
+		df->df_nclasses = n;
+	}
+
+	for (c = 0xff + 1; c-- > 0;)
+		df->df_reps[classes[c]] = (unsigned char)c;
+}
+
+/*
+ * Compute the set of NFA nodes reachable from the given seeds without
+ * consuming any input, stored in df_list. Beginning of line assertions are
+ * followed if bol is non-zero. End of line assertions are followed if eol is
+ * non-zero, otherwise kept in the set.
+ */
+static size_t
+dfa_closure(struct dfa *df, const int *seeds, size_t nseeds, int bol, int eol)
+{
+	size_t depth = 0;
+	size_t len = 0;
+	size_t i;
+
+	if (++df->df_gen == 0) {
+		memset(df->df_marks, 0,
+		    VECTOR_LENGTH(df->df_nodes) * sizeof(*df->df_marks));
+		df->df_gen = 1;
+	}
+
+	for (i = 0; i < nseeds; i++)
+		df->df_stack[depth++] = seeds[i];
+	while (depth > 0) {
+		const struct nfa_node *nn;
+		int n = df->df_stack[--depth];
+
+		if (df->df_marks[n] == df->df_gen)
+			continue;
+		df->df_marks[n] = df->df_gen;
+
+		nn = &df->df_nodes[n];
+		switch (nn->nn_op) {
+		case NFA_CHAR:
+		case NFA_MATCH:
+			df->df_list[len++] = n;
+			break;
+		case NFA_SPLIT:
+			df->df_stack[depth++] = nn->nn_out1;
+			df->df_stack[depth++] = nn->nn_out;
+			break;
+		case NFA_BOL:
+			if (bol)
+				df->df_stack[depth++] = nn->nn_out;
+			break;
+		case NFA_EOL:
+			if (eol)
+				df->df_stack[depth++] = nn->nn_out;
+			else
+				df->df_list[len++] = n;
+			break;
+		}
+	}
+
+	qsort(df->df_list, len, sizeof(*df->df_list), intcmp);
+	return len;
+}
+
+/*
+ * Returns the index of the state represented by the given NFA nodes, creating
+ * it if absent. Returns DFA_MAX_STATES if the maximum number of states is
+ * reached. Must be called while holding the lock. The match sentinel state is
+ * never subject to lookup.
+ */
+static unsigned int
+dfa_state(struct dfa *df, const int *nodes, size_t nnodes, unsigned int flags)
+{
+	struct dfa_state *st;
+	uint64_t hash;
+	size_t i, len, slot;
+
+	hash = fnv1a(FNV1A_INIT, &flags, sizeof(flags));
+	hash = fnv1a(hash, nodes, nnodes * sizeof(*nodes));
+
+	for (slot = hash % DFA_TABLE_SIZE; df->df_table[slot] != 0;
+	    slot = (slot + 1) % DFA_TABLE_SIZE) {
+		st = df->df_states[df->df_table[slot] - 1];
+		if (st->ds_hash == hash && st->ds_nnodes == nnodes &&
+		    (st->ds_flags & DFA_STATE_BOL) == flags &&
+		    memcmp(st->ds_nodes, nodes,
+		    nnodes * sizeof(*nodes)) == 0)
+			return df->df_table[slot] - 1;
+	}
+	if (df->df_nstates == DFA_MAX_STATES)
+		return DFA_MAX_STATES;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		err(1, NULL);
+	st->ds_trans = calloc(df->df_nclasses, sizeof(*st->ds_trans));
+	st->ds_nodes = calloc(nnodes + 1, sizeof(*st->ds_nodes));
+	if (st->ds_trans == NULL || st->ds_nodes == NULL)
+		err(1, NULL);
+	if (nnodes > 0)
+		memcpy(st->ds_nodes, nodes, nnodes * sizeof(*nodes));
+	st->ds_nnodes = nnodes;
+	st->ds_hash = hash;
+	st->ds_flags = flags;
+	st->ds_trans[df->df_classes[0x80]] = DFA_TRANS_BAIL;
+
+	for (i = 0; i < nnodes; i++) {
+		if (df->df_nodes[nodes[i]].nn_op == NFA_MATCH)
+			st->ds_flags |= DFA_STATE_MATCH;
+	}
+	len = dfa_closure(df, st->ds_nodes, nnodes, flags & DFA_STATE_BOL, 1);
+	for (i = 0; i < len; i++) {
+		if (df->df_nodes[df->df_list[i]].nn_op == NFA_MATCH)
+			st->ds_flags |= DFA_STATE_MATCH_EOL;
+	}
+
+	df->df_states[df->df_nstates] = st;
+	if ((flags & DFA_STATE_MATCH) == 0)
+		df->df_table[slot] = (unsigned int)df->df_nstates + 1;
+	return (unsigned int)df->df_nstates++;
+}
+
+/*
+ * Compute and publish the transition from the given state for the given byte
+ * class.
+ */
+static unsigned int
+dfa_transition(struct dfa *df, const struct dfa_state *st, unsigned int cls)
+{
+	const int *nodes = st->ds_nodes;
+	size_t i, nnodes, nseeds;
+	unsigned int flags = 0;
+	unsigned int idx, t;
+	unsigned char c = df->df_reps[cls];
+
+	pthread_mutex_lock(&df->df_lock);
+
+	/* Might have been computed while waiting for the lock. */
+	t = __atomic_load_n(&st->ds_trans[cls], __ATOMIC_ACQUIRE);
+	if (t != DFA_TRANS_NONE)
+		goto out;
+
+	nnodes = st->ds_nnodes;
+	if (c == '\n') {
+		/* End of line assertions are satisfied before newline. */
+		nnodes = dfa_closure(df, nodes, nnodes,
+		    st->ds_flags & DFA_STATE_BOL, 1);
+		nodes = df->df_list;
+		flags = DFA_STATE_BOL;
+	}
+
+	nseeds = 0;
+	for (i = 0; i < nnodes; i++) {
+		const struct nfa_node *nn = &df->df_nodes[nodes[i]];
+
+		if (nn->nn_op == NFA_MATCH)
+			break;
+		if (nn->nn_op == NFA_CHAR && set_has(&nn->nn_set, c))
+			df->df_seeds[nseeds++] = nn->nn_out;
+	}
+	if (i < nnodes) {
+		idx = df->df_matched;
+	} else {
+		/* Allow a match to start at any position. */
+		df->df_seeds[nseeds++] = df->df_start;
+		nnodes = dfa_closure(df, df->df_seeds, nseeds,
+		    flags & DFA_STATE_BOL, 0);
+		idx = dfa_state(df, df->df_list, nnodes, flags);
+	}
+	t = idx == DFA_MAX_STATES ? DFA_TRANS_BAIL : idx + DFA_TRANS_STATE;
+	__atomic_store_n(&st->ds_trans[cls], t, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&df->df_lock);
+	return t;
+}
+
+static void
+set_add(struct dfa_set *set, unsigned char c)
+{
+	set->bits[c / 32] |= 1u << (c % 32);
+}
+
+static void
+set_add_icase(struct dfa_set *set, unsigned char c)
+{
+	set_add(set, (unsigned char)tolower(c));
+	set_add(set, (unsigned char)toupper(c));
+}
+
+static int
+set_has(const struct dfa_set *set, unsigned char c)
+{
+	return (set->bits[c / 32] & (1u << (c % 32))) != 0;
+}
+
+static void
+set_negate(struct dfa_set *set)
+{
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		set->bits[i] = ~set->bits[i];
+	set->bits[0] &= ~1u;	/* never match NUL */
+}
+
+static int
+intcmp(const void *p1, const void *p2)
+{
+	int a = *(const int *)p1;
+	int b = *(const int *)p2;
+
+	return a < b ? -1 : a > b;
+}
@@ -0,0 +1,9 @@
+struct arena_scope;
+
+/* Return values for dfa_match(). */
+#define DFA_MATCH	(1)
+#define DFA_NOMATCH	(0)
+#define DFA_UNKNOWN	(-1)
+
+struct dfa	*dfa_compile(const char *, int, struct arena_scope *);
+int		 dfa_match(struct dfa *, const char *);
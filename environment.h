@@ -4,6 +4,7 @@
 struct environment {
 	char		 ev_home[PATH_MAX];
 	char		 ev_tmpdir[PATH_MAX];
+	char		 ev_cachedir[PATH_MAX];
 	char		 ev_hostname[256];
 	const char	*ev_confpath;
 
@@ -24,6 +25,8 @@ struct environment {
 #define OPTION_DRYRUN	0x00000001u
 #define OPTION_SYNTAX	0x00000002u
 #define OPTION_STDIN	0x00000004u
+#define OPTION_CACHE	0x00000008u
+#define OPTION_WATCH	0x00000010u
 };
 
 void	environment_init(struct environment *);
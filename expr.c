@@ -6,6 +6,7 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>	/* NAME_MAX */
+#include <pthread.h>
 #include <regex.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <string.h>
 #include <wchar.h>
 #include "libks/arena-buffer.h"
+#include "libks/arena-vector.h"
 #include "libks/arena.h"
 #include "libks/buffer.h"
 #include "libks/compiler.h"
@@ -20,17 +22,117 @@
 #include "libks/list.h"
 #include "libks/vector.h"
 #include "date-time.h"
+#include "dfa.h"
 #include "environment.h"
+#include "literal.h"
+#include "log.h"
 #include "match.h"
 #include "message.h"
 #include "string-list.h"
 #include "util.h"
 
+/*
+ * Compiled expression, a flat sequence of instructions evaluated by
+ * expr_exec(). The outcome of the last evaluated instruction is kept in a
+ * single register.
+ */
+struct expr_program {
+	VECTOR(struct expr_insn)	pr_insns;
+	size_t				pr_depth;	/* max nested negations */
+};
+
+struct expr_insn {
+	enum {
+		/* Evaluate matcher or action. */
+		EXPR_OP_EVAL,
+		/* Load constant outcome. */
+		EXPR_OP_CONST,
+		/* Jump unless the outcome is a match. */
+		EXPR_OP_AND,
+		/* Jump unless the outcome is a no match. */
+		EXPR_OP_OR,
+		/* Add match sentinel, jump on error. */
+		EXPR_OP_MATCH,
+		/* Save end of match list, see EXPR_OP_NEG_END. */
+		EXPR_OP_NEG_BEGIN,
+		/* Invert outcome, discarding matches on a match. */
+		EXPR_OP_NEG_END,
+		/* Handle break and pass actions. */
+		EXPR_OP_BLOCK_END,
+	} in_op;
+	int		 in_val;	/* constant outcome or jump target */
+	struct expr	*in_ex;
+};
+
+struct expr_compile {
+	struct expr_program	*ec_pr;
+	size_t			 ec_depth;
+	VECTOR(struct expr *)	 ec_headers;	/* header matchers with literal */
+};
+
+/*
+ * Header matchers sharing the same header names. The literals required by
+ * each pattern are searched for at once in all header values, allowing
+ * regexec() to be omitted for values lacking the literal.
+ */
+struct expr_group {
+	const struct string_list	*eg_names;
+	const unsigned int		*eg_keys;	/* interned names */
+	struct literal_set		*eg_literals;
+	size_t				 eg_nwords;	/* bitset words per value */
+};
+
+/* Outcome of searching for the literals of a group in a message. */
+struct expr_scan {
+	const struct expr_group	*es_group;
+	const struct message	*es_msg;
+	uint64_t		*es_bits;	/* bitset per header value */
+	size_t			*es_offsets;	/* first value per header name */
+};
+
+/* Number of memoized results per pattern. */
+#define EXPR_MEMO_SIZE		64
+/*
+ * Longest value subject to memoization, bounded as the values are copied to
+ * preallocated slots.
+ */
+#define EXPR_MEMO_MAXLEN	128
+
+/* Memoized outcome of matching a pattern against a value. */
+struct expr_memo {
+	uint64_t	 hash;
+	size_t		 len;
+	int		 ev;		/* EXPR_ERROR if unused */
+	char		 val[EXPR_MEMO_MAXLEN];
+};
+
 struct expr_regex {
 	regex_t		 pattern;
-	regmatch_t	*matches;
+	struct dfa	*dfa;		/* NULL if unsupported */
+	const char	*source;
+	const char	*literal;	/* required literal, NULL if absent */
 	size_t		 nmatches;
 	unsigned int	 flags;
+	int		 rflags;
+	int		 backrefs;	/* subexpressions are back-referenced */
+
+	struct {
+		unsigned long	hit;	/* literal present */
+		unsigned long	miss;	/* literal absent */
+		unsigned long	regexec;
+	} stats;
+
+	/*
+	 * Values tend to repeat across messages, such as the same sender or
+	 * mailing list. Shared by concurrent evaluations.
+	 */
+	struct {
+		pthread_mutex_t		lock;
+		struct expr_memo	entries[EXPR_MEMO_SIZE];
+		regmatch_t		*matches;	/* subexpressions per entry */
+		unsigned long		hit;
+		unsigned long		miss;
+	} memo;
 };
 
 static int	expr_eval_add_header(struct expr *, struct expr_eval_arg *);
@@ -79,14 +181,37 @@ static const char	*expr_inspect_pass(const struct expr *,
 static const char	*expr_inspect_reject(const struct expr *,
     const struct match *, const struct message *, struct arena_scope *);
 
+static int	expr_block(struct expr_eval_arg *, int);
+static int	expr_dispatch(struct expr *, struct expr_eval_arg *);
+static int	expr_exec(const struct expr_program *, struct expr_eval_arg *);
 static size_t	expr_inspect_prefix(const struct expr *,
     const struct environment *);
 static int	expr_match(struct expr *, struct expr_eval_arg *);
+static int	expr_memo_get(struct expr_regex *, uint64_t, const char *,
+    size_t, regmatch_t *);
+static void	expr_memo_put(struct expr_regex *, uint64_t, const char *,
+    size_t, const regmatch_t *);
 static int	expr_regexec(struct expr *, struct expr_eval_arg *,
-    const char *, const char *);
-static void	expr_regcopy(const struct expr *, struct match *, const char *,
-    struct arena_scope *);
+    const char *, const char *, int);
+static void	expr_regcopy(const struct expr *, struct match *,
+    const regmatch_t *, const char *, struct arena_scope *);
 
+static void	exprcompile(struct expr_compile *, struct expr *,
+    struct arena_scope *);
+static int	exprconst(const struct expr *);
+static void	exprgroup(struct expr_compile *, struct arena_scope *);
+static int	exprbackrefs(const struct expr *);
+static void	exprbackrefs_mark(struct expr *, int);
+static int	exprnameseq(const struct string_list *,
+    const struct string_list *);
+static const struct expr_scan	*exprscan(const struct expr_group *,
+    struct expr_eval_arg *);
+static int	exprscanned(const struct expr_scan *, struct expr *, size_t);
+static int	exprmatches(const struct expr *);
+static size_t	exprinsn(struct expr_compile *, int, int, struct expr *);
+static uint64_t	exprhash(const struct expr *, uint64_t);
+static int	filetime(const char *, long long int *);
+static int	hasbackref(const char *);
 static size_t	strnwidth(const char *, size_t);
 
 struct expr *
@@ -121,10 +246,12 @@ expr_alloc(enum expr_type type, unsigned int lno, struct expr *lhs,
 		break;
 	case EXPR_TYPE_ATTACHMENT:
 		ex->ex_eval = &expr_eval_attachment;
+		ex->ex_flags = EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_BODY:
 		ex->ex_eval = &expr_eval_body;
-		ex->ex_flags = EXPR_FLAG_INSPECT | EXPR_FLAG_INTERPOLATE;
+		ex->ex_flags = EXPR_FLAG_INSPECT | EXPR_FLAG_INTERPOLATE |
+		    EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_DATE:
 		ex->ex_eval = &expr_eval_date;
@@ -132,7 +259,8 @@ expr_alloc(enum expr_type type, unsigned int lno, struct expr *lhs,
 		break;
 	case EXPR_TYPE_HEADER:
 		ex->ex_eval = &expr_eval_header;
-		ex->ex_flags = EXPR_FLAG_INSPECT | EXPR_FLAG_INTERPOLATE;
+		ex->ex_flags = EXPR_FLAG_INSPECT | EXPR_FLAG_INTERPOLATE |
+		    EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_NEW:
 		ex->ex_eval = &expr_eval_new;
@@ -145,6 +273,8 @@ expr_alloc(enum expr_type type, unsigned int lno, struct expr *lhs,
 		break;
 	case EXPR_TYPE_COMMAND:
 		ex->ex_eval = &expr_eval_command;
+		/* Not repeated if the evaluation is deferred. */
+		ex->ex_flags = EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_MOVE:
 		ex->ex_eval = &expr_eval_move;
@@ -174,7 +304,8 @@ expr_alloc(enum expr_type type, unsigned int lno, struct expr *lhs,
 	case EXPR_TYPE_LABEL:
 		ex->ex_eval = &expr_eval_label;
 		ex->ex_inspect = &expr_inspect_label;
-		ex->ex_flags = EXPR_FLAG_ACTION | EXPR_FLAG_PATH;
+		ex->ex_flags = EXPR_FLAG_ACTION | EXPR_FLAG_PATH |
+		    EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_PASS:
 		ex->ex_eval = &expr_eval_pass;
@@ -194,12 +325,13 @@ expr_alloc(enum expr_type type, unsigned int lno, struct expr *lhs,
 	case EXPR_TYPE_ATTACHMENT_BLOCK:
 		ex->ex_eval = &expr_eval_attachment_block;
 		ex->ex_inspect = &expr_inspect_attachment_block;
-		ex->ex_flags = EXPR_FLAG_ACTION;
+		ex->ex_flags = EXPR_FLAG_ACTION | EXPR_FLAG_CONTENT;
 		break;
 	case EXPR_TYPE_ADD_HEADER:
 		ex->ex_eval = &expr_eval_add_header;
 		ex->ex_inspect = &expr_inspect_add_header;
-		ex->ex_flags = EXPR_FLAG_ACTION | EXPR_FLAG_PATH;
+		ex->ex_flags = EXPR_FLAG_ACTION | EXPR_FLAG_PATH |
+		    EXPR_FLAG_CONTENT;
 		break;
 	}
 
@@ -224,6 +356,8 @@ expr_set_date(struct expr *ex, enum expr_date_field field,
 	ex->ex_date.field = field;
 	ex->ex_date.cmp = cmp;
 	ex->ex_date.age = age;
+	if (field == EXPR_DATE_FIELD_HEADER)
+		ex->ex_flags |= EXPR_FLAG_CONTENT;
 
 	/* Cheat a bit by adding a match all pattern used during dry run. */
 	(void)expr_set_pattern(ex, ".*", 0, NULL, s);
@@ -254,6 +388,20 @@ expr_set_exec(struct expr *ex, struct string_list *cmd, unsigned int flags)
 	return 0;
 }
 
+void
+expr_set_header(struct expr *ex, struct string_list *names,
+    struct arena_scope *s)
+{
+	const struct string *str;
+	unsigned int *keys;
+
+	expr_set_strings(ex, names);
+	keys = arena_calloc(s, strings_len(names), sizeof(*keys));
+	ex->ex_header.keys = keys;
+	LIST_FOREACH(str, names)
+		*keys++ = message_header_intern(str->val);
+}
+
 void
 expr_set_strings(struct expr *ex, struct string_list *strings)
 {
@@ -266,6 +414,7 @@ regex_free(void *arg)
 	struct expr_regex *re = arg;
 
 	regfree(&re->pattern);
+	pthread_mutex_destroy(&re->memo.lock);
 }
 
 /*
@@ -302,10 +451,13 @@ expr_set_pattern(struct expr *ex, const char *pattern, unsigned int flags,
 	};
 	int rflags = REG_EXTENDED | REG_NEWLINE;
 	int error, i;
+	size_t j;
 
 	assert(ex->ex_re == NULL);
 
 	ex->ex_re = arena_calloc(s, 1, sizeof(*ex->ex_re));
+	if ((error = pthread_mutex_init(&ex->ex_re->memo.lock, NULL)) != 0)
+		errc(1, error, "pthread_mutex_init");
 	arena_cleanup(s, regex_free, ex->ex_re);
 
 	for (i = 0; fflags[i].eflag != 0; i++) {
@@ -320,6 +472,9 @@ expr_set_pattern(struct expr *ex, const char *pattern, unsigned int flags,
 	}
 	assert(flags == 0);
 
+	ex->ex_re->source = arena_strdup(s, pattern);
+	ex->ex_re->literal = literal_required(pattern, rflags & REG_ICASE, s);
+	ex->ex_re->rflags = rflags;
 	if ((error = regcomp(&ex->ex_re->pattern, pattern, rflags)) != 0) {
 		if (errstr != NULL) {
 			static char buf[1024];
@@ -330,8 +485,12 @@ expr_set_pattern(struct expr *ex, const char *pattern, unsigned int flags,
 		return 1;
 	}
 	ex->ex_re->nmatches = ex->ex_re->pattern.re_nsub + 1;
-	ex->ex_re->matches = arena_calloc(s, ex->ex_re->nmatches,
-	    sizeof(*ex->ex_re->matches));
+	ex->ex_re->dfa = dfa_compile(pattern, rflags & REG_ICASE, s);
+	ex->ex_re->memo.matches = arena_calloc(s,
+	    EXPR_MEMO_SIZE * ex->ex_re->nmatches,
+	    sizeof(*ex->ex_re->memo.matches));
+	for (j = 0; j < EXPR_MEMO_SIZE; j++)
+		ex->ex_re->memo.entries[j].ev = EXPR_ERROR;
 
 	return 0;
 }
@@ -339,12 +498,45 @@ expr_set_pattern(struct expr *ex, const char *pattern, unsigned int flags,
 /*
  * Returns 0 if the expression matches the given message. The given match list
  * will be populated with the matching expressions.
- * Otherwise, non-zero is returned.
+ * Otherwise, non-zero is returned. If EXPR_EVAL_LAZY is present in the flags
+ * and the outcome cannot be determined without the message content,
+ * EXPR_DEFER is returned in which the match list must be discarded.
  */
 int
 expr_eval(struct expr *ex, struct expr_eval_arg *ea)
 {
-	return ex->ex_eval(ex, ea);
+	if (ex->ex_prog != NULL)
+		return expr_exec(ex->ex_prog, ea);
+	return expr_dispatch(ex, ea);
+}
+
+/*
+ * Log statistics for all patterns with a required literal.
+ */
+void
+expr_log_stats(const struct expr *ex)
+{
+	const struct expr_regex *re;
+
+	if (ex == NULL)
+		return;
+
+	re = ex->ex_re;
+	if (re != NULL && re->literal != NULL) {
+		log_debug("%s: line %u: literal \"%s\": hit=%lu, miss=%lu\n",
+		    __func__, ex->ex_lno, re->literal, re->stats.hit,
+		    re->stats.miss);
+	}
+	if (re != NULL && re->memo.hit + re->memo.miss > 0) {
+		log_debug("%s: line %u: memo: hit=%lu, miss=%lu\n",
+		    __func__, ex->ex_lno, re->memo.hit, re->memo.miss);
+	}
+	if (re != NULL && re->stats.regexec > 0) {
+		log_debug("%s: line %u: regexec=%lu\n",
+		    __func__, ex->ex_lno, re->stats.regexec);
+	}
+	expr_log_stats(ex->ex_lhs);
+	expr_log_stats(ex->ex_rhs);
 }
 
 /*
@@ -380,6 +572,71 @@ expr_count_actions(const struct expr *ex)
 	    expr_count_actions(ex->ex_rhs);
 }
 
+/*
+ * Returns non-zero if evaluating the given expression, including carrying out
+ * its actions, requires the message body.
+ */
+int
+expr_needs_body(const struct expr *ex)
+{
+	if (ex == NULL)
+		return 0;
+
+	switch (ex->ex_type) {
+	case EXPR_TYPE_ATTACHMENT:
+	case EXPR_TYPE_ATTACHMENT_BLOCK:
+	case EXPR_TYPE_BODY:
+		return 1;
+	case EXPR_TYPE_EXEC:
+		if (ex->ex_exec.flags & EXPR_EXEC_BODY)
+			return 1;
+		break;
+	default:
+		break;
+	}
+	return expr_needs_body(ex->ex_lhs) || expr_needs_body(ex->ex_rhs);
+}
+
+/*
+ * Returns a hash of the given expression including all its descendants. Any
+ * change to the expression in the configuration, except for line numbers,
+ * yields a different hash.
+ */
+unsigned long long
+expr_hash(const struct expr *ex)
+{
+	return exprhash(ex, FNV1A_INIT);
+}
+
+/*
+ * Compile the given expression into a flat sequence of instructions, favored by
+ * expr_eval() over walking the expression. The outcome is identical, except
+ * for constant expressions being folded and expressions never reached due to
+ * a preceding expression always matching being omitted.
+ */
+void
+expr_compile(struct expr *ex, struct arena_scope *s)
+{
+	struct expr_compile ec = {0};
+	struct expr_program *pr;
+
+	exprbackrefs_mark(ex, 0);
+
+#ifdef DIAGNOSTIC
+	/* Allow the tests to exercise evaluation of the expression as is. */
+	if (getenv("EXPR_TREE") != NULL)
+		return;
+#endif
+
+	pr = arena_calloc(s, 1, sizeof(*pr));
+	ARENA_VECTOR_INIT(s, pr->pr_insns, 16);
+	ARENA_VECTOR_INIT(s, ec.ec_headers, 0);
+	ec.ec_pr = pr;
+	exprcompile(&ec, ex, s);
+	exprgroup(&ec, s);
+	ex->ex_prog = pr;
+}
+
 const char *
 expr_inspect(const struct expr *ex, const struct match *mh,
     const struct message *msg, struct arena_scope *s)
@@ -532,29 +789,7 @@ expr_eval_attachment_block(struct expr *ex, struct expr_eval_arg *ea)
 static int
 expr_eval_block(struct expr *ex, struct expr_eval_arg *ea)
 {
-	int ev;
-
-	ev = expr_eval(ex->ex_lhs, ea);
-	if (ev == EXPR_ERROR)
-		return EXPR_ERROR;
-
-	if (matches_find(ea->ea_ml, EXPR_TYPE_BREAK) != NULL) {
-		matches_remove_by_type(ea->ea_ml, EXPR_TYPE_BREAK);
-		return EXPR_NOMATCH; /* break, continue evaluation */
-	}
-
-	if (matches_find(ea->ea_ml, EXPR_TYPE_PASS) != NULL) {
-		/*
-		 * If removing the pass action results in a match list without
-		 * any actions left, we got a pass followed by no effective
-		 * action. Therefore treat it as a no match.
-		 */
-		if (matches_remove_by_type(ea->ea_ml, EXPR_TYPE_PASS) == 0)
-			return EXPR_NOMATCH;
-		return EXPR_MATCH;
-	}
-
-	return ev;
+	return expr_block(ea, expr_eval(ex->ex_lhs, ea));
 }
 
 static int
@@ -565,7 +800,7 @@ expr_eval_body(struct expr *ex, struct expr_eval_arg *ea)
 	body = message_get_body(ea->ea_msg);
 	if (body == NULL)
 		return EXPR_ERROR;
-	return expr_regexec(ex, ea, "Body", body);
+	return expr_regexec(ex, ea, "Body", body, 0);
 }
 
 static int
@@ -595,7 +830,7 @@ expr_eval_command(struct expr *ex, struct expr_eval_arg *ea)
 	if (matches_append(ea->ea_ml, mh))
 		return EXPR_ERROR;
 
-	if (match_interpolate(mh, NULL, ea->ea_arena.eternal_scope,
+	if (match_interpolate(ea->ea_ml, mh, NULL, ea->ea_arena.eternal_scope,
 	    ea->ea_arena.scratch)) {
 		ev = EXPR_ERROR;
 	} else if ((error = exec(mh->mh_exec, -1)) != 0) {
@@ -624,6 +859,12 @@ expr_eval_date(struct expr *ex, struct expr_eval_arg *ea)
 			return EXPR_NOMATCH;
 		if (time_parse(date, &tim, ea->ea_env))
 			return EXPR_ERROR;
+	} else if (ex->ex_date.field == EXPR_DATE_FIELD_FILENAME) {
+		if (filetime(message_get_name(ea->ea_msg), &tim))
+			return EXPR_NOMATCH;
+		date = time_format(tim, buf, sizeof(buf));
+		if (date == NULL)
+			return EXPR_ERROR;
 	} else {
 		struct stat st;
 		/*
@@ -631,10 +872,10 @@ expr_eval_date(struct expr *ex, struct expr_eval_arg *ea)
 		 * complain about it might being used uninitialized.
 		 */
 		const struct timespec *ts = NULL;
-		const char *path;
 
 		switch (ex->ex_date.field) {
 		case EXPR_DATE_FIELD_HEADER:
+		case EXPR_DATE_FIELD_FILENAME:
 			return EXPR_ERROR; /* UNREACHABLE */
 		case EXPR_DATE_FIELD_ACCESS:
 			ts = &st.st_atim;
@@ -646,11 +887,8 @@ expr_eval_date(struct expr *ex, struct expr_eval_arg *ea)
 			ts = &st.st_ctim;
 			break;
 		}
-		path = message_get_path(ea->ea_msg);
-		if (stat(path, &st) == -1) {
-			warn("stat: %s", path);
+		if (message_stat(ea->ea_msg, &st))
 			return EXPR_ERROR;
-		}
 		tim = ts->tv_sec;
 		date = time_format(tim, buf, sizeof(buf));
 		if (date == NULL)
@@ -670,7 +908,7 @@ expr_eval_date(struct expr *ex, struct expr_eval_arg *ea)
 	}
 
 	/* Populate matches, only used during dry run. */
-	return expr_regexec(ex, ea, "Date", date);
+	return expr_regexec(ex, ea, "Date", date, 0);
 }
 
 static int
@@ -690,15 +928,14 @@ expr_eval_flag(struct expr *ex, struct expr_eval_arg *ea)
 {
 	struct match *mh;
 	const char *subdir;
-	size_t siz;
 
-	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
 	subdir = LIST_FIRST(ex->ex_strings)->val;
-	siz = sizeof(mh->mh_subdir);
-	if (strlcpy(mh->mh_subdir, subdir, siz) >= siz) {
+	if (strlen(subdir) > NAME_MAX) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		return EXPR_ERROR;
 	}
+	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
+	mh->mh_subdir = arena_strdup(ea->ea_arena.eternal_scope, subdir);
 
 	if (matches_append(ea->ea_ml, mh))
 		return EXPR_ERROR;
@@ -730,20 +967,34 @@ expr_eval_flags(struct expr *ex, struct expr_eval_arg *ea)
 static int
 expr_eval_header(struct expr *ex, struct expr_eval_arg *ea)
 {
+	const struct expr_scan *es = NULL;
 	const struct string *key;
+	size_t k = 0;
+
+	if (ex->ex_header.group != NULL)
+		es = exprscan(ex->ex_header.group, ea);
 
 	LIST_FOREACH(key, ex->ex_strings) {
 		VECTOR(const char *const) values;
+		size_t off = 0;
 		size_t j;
 
-		values = message_get_header(ea->ea_msg, key->val);
+		if (es != NULL)
+			off = es->es_offsets[k];
+		values = message_get_header_id(ea->ea_msg,
+		    ex->ex_header.keys[k++]);
 		if (values == NULL)
 			continue;
 
 		for (j = 0; j < VECTOR_LENGTH(values); j++) {
 			int ev;
 
-			ev = expr_regexec(ex, ea, key->val, values[j]);
+			/* Required literal absent, cannot match. */
+			if (es != NULL && !exprscanned(es, ex, off + j))
+				continue;
+
+			ev = expr_regexec(ex, ea, key->val, values[j],
+			    es != NULL);
 			if (ev == EXPR_NOMATCH)
 				continue;
 			return ev;	/* match or error, return */
@@ -780,15 +1031,14 @@ expr_eval_move(struct expr *ex, struct expr_eval_arg *ea)
 {
 	struct match *mh;
 	const char *maildir;
-	size_t siz;
 
 	maildir = LIST_FIRST(ex->ex_strings)->val;
-	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
-	siz = sizeof(mh->mh_maildir);
-	if (strlcpy(mh->mh_maildir, maildir, siz) >= siz) {
+	if (strlen(maildir) >= PATH_MAX) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		return EXPR_ERROR;
 	}
+	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
+	mh->mh_maildir = arena_strdup(ea->ea_arena.eternal_scope, maildir);
 
 	if (matches_append(ea->ea_ml, mh))
 		return EXPR_ERROR;
@@ -810,6 +1060,9 @@ expr_eval_neg(struct expr *ex, struct expr_eval_arg *ea)
 	case EXPR_ERROR:
 		return EXPR_ERROR;
 
+	case EXPR_DEFER:
+		return EXPR_DEFER;
+
 	case EXPR_NOMATCH:
 		matches_remove(ea->ea_ml, mh);
 		return EXPR_MATCH;
@@ -890,7 +1143,6 @@ expr_eval_stat(struct expr *ex, struct expr_eval_arg *ea)
 	struct stat st;
 	struct match *mh;
 	const char *str;
-	size_t siz;
 	int ev = EXPR_NOMATCH;
 
 	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
@@ -900,12 +1152,12 @@ expr_eval_stat(struct expr *ex, struct expr_eval_arg *ea)
 	}
 
 	str = LIST_FIRST(ex->ex_strings)->val;
-	siz = sizeof(mh->mh_path);
-	if (strlcpy(mh->mh_path, str, siz) >= siz) {
+	mh->mh_path = arena_strdup(ea->ea_arena.eternal_scope, str);
+	if (strlen(str) >= PATH_MAX) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		ev = EXPR_ERROR;
-	} else if (match_interpolate(mh, NULL, ea->ea_arena.eternal_scope,
-	    ea->ea_arena.scratch)) {
+	} else if (match_interpolate(ea->ea_ml, mh, NULL,
+	    ea->ea_arena.eternal_scope, ea->ea_arena.scratch)) {
 		ev = EXPR_ERROR;
 	} else if (stat(mh->mh_path, &st) == 0) {
 		switch (ex->ex_stat.stat) {
@@ -1002,6 +1254,121 @@ expr_inspect_reject(const struct expr *UNUSED(ex),
 	return "<reject>";
 }
 
+/*
+ * Carry out break and pass actions once a block is evaluated, returning the
+ * outcome of the block.
+ */
+static int
+expr_block(struct expr_eval_arg *ea, int ev)
+{
+	if (ev == EXPR_ERROR || ev == EXPR_DEFER)
+		return ev;
+
+	if (matches_find(ea->ea_ml, EXPR_TYPE_BREAK) != NULL) {
+		matches_remove_by_type(ea->ea_ml, EXPR_TYPE_BREAK);
+		return EXPR_NOMATCH; /* break, continue evaluation */
+	}
+
+	if (matches_find(ea->ea_ml, EXPR_TYPE_PASS) != NULL) {
+		/*
+		 * If removing the pass action results in a match list without
+		 * any actions left, we got a pass followed by no effective
+		 * action. Therefore treat it as a no match.
+		 */
+		if (matches_remove_by_type(ea->ea_ml, EXPR_TYPE_PASS) == 0)
+			return EXPR_NOMATCH;
+		return EXPR_MATCH;
+	}
+
+	return ev;
+}
+
+static int
+expr_dispatch(struct expr *ex, struct expr_eval_arg *ea)
+{
+	if ((ea->ea_flags & EXPR_EVAL_LAZY) &&
+	    (ex->ex_flags & EXPR_FLAG_CONTENT))
+		return EXPR_DEFER;
+	return ex->ex_eval(ex, ea);
+}
+
+static int
+expr_exec(const struct expr_program *pr, struct expr_eval_arg *ea)
+{
+	struct match **negs = NULL;
+	size_t i = 0;
+	size_t depth = 0;
+	int ev = EXPR_NOMATCH;
+
+	arena_scope(ea->ea_arena.scratch, s);
+
+	if (pr->pr_depth > 0)
+		negs = arena_calloc(&s, pr->pr_depth, sizeof(*negs));
+
+	while (i < VECTOR_LENGTH(pr->pr_insns)) {
+		const struct expr_insn *in = &pr->pr_insns[i++];
+
+		switch (in->in_op) {
+		case EXPR_OP_EVAL:
+			ev = expr_dispatch(in->in_ex, ea);
+			break;
+
+		case EXPR_OP_CONST:
+			ev = in->in_val;
+			break;
+
+		case EXPR_OP_AND:
+			if (ev != EXPR_MATCH)
+				i = (size_t)in->in_val;
+			break;
+
+		case EXPR_OP_OR:
+			if (ev != EXPR_NOMATCH)
+				i = (size_t)in->in_val;
+			break;
+
+		case EXPR_OP_MATCH: {
+			struct match *mh;
+
+			mh = match_alloc(in->in_ex, ea->ea_msg,
+			    ea->ea_arena.eternal_scope);
+			if (matches_append(ea->ea_ml, mh)) {
+				ev = EXPR_ERROR;
+				i = (size_t)in->in_val;
+			}
+			break;
+		}
+
+		case EXPR_OP_NEG_BEGIN:
+			/*
+			 * As opposed to expr_eval_neg(), remember the end of
+			 * the match list instead of adding a sentinel.
+			 */
+			negs[depth++] = matches_last(ea->ea_ml);
+			break;
+
+		case EXPR_OP_NEG_END: {
+			const struct match *stop = negs[--depth];
+
+			if (ev == EXPR_MATCH) {
+				/* Invalidate match below current expression. */
+				matches_remove_until(ea->ea_ml, stop);
+				ev = EXPR_NOMATCH;
+			} else if (ev == EXPR_NOMATCH) {
+				ev = EXPR_MATCH;
+			}
+			break;
+		}
+
+		case EXPR_OP_BLOCK_END:
+			ev = expr_block(ea, ev);
+			break;
+		}
+	}
+
+	return ev;
+}
+
 static size_t
 expr_inspect_prefix(const struct expr *ex, const struct environment *env)
 {
@@ -1035,24 +1402,91 @@ expr_match(struct expr *ex, struct expr_eval_arg *ea)
 	return EXPR_MATCH;
 }
 
+/*
+ * Evaluate the pattern on the given value. If scanned is non-zero, the value
+ * is already known to contain the required literal.
+ */
 static int
 expr_regexec(struct expr *ex, struct expr_eval_arg *ea, const char *key,
-    const char *val)
+    const char *val, int scanned)
 {
+	regmatch_t *matches;
 	struct match *mh;
-	int error;
+	uint64_t hash = 0;
+	size_t len;
+	int error, positions;
+
+	/*
+	 * Favor rejecting values lacking the required literal as regexec() is
+	 * comparatively slow, even for obvious misses. The statistics are
+	 * updated by concurrent evaluations.
+	 */
+	if (ex->ex_re->literal != NULL && !scanned) {
+		if (!literal_find(val, ex->ex_re->literal,
+		    ex->ex_re->rflags & REG_ICASE)) {
+			__atomic_fetch_add(&ex->ex_re->stats.miss, 1,
+			    __ATOMIC_RELAXED);
+			return EXPR_NOMATCH;
+		}
+		__atomic_fetch_add(&ex->ex_re->stats.hit, 1, __ATOMIC_RELAXED);
+	}
 
-	error = regexec(&ex->ex_re->pattern, val, ex->ex_re->nmatches,
-	    ex->ex_re->matches, 0);
+	arena_scope(ea->ea_arena.scratch, s);
+
+	/*
+	 * The expression is shared between all evaluations, possibly running
+	 * concurrently, therefore the output buffer must not be stored in the
+	 * expression.
+	 */
+	matches = arena_calloc(&s, ex->ex_re->nmatches, sizeof(*matches));
+	/*
+	 * The positions of the subexpressions are only needed by
+	 * back-references and dry run.
+	 */
+	positions = ex->ex_re->backrefs ||
+	    (ea->ea_env->ev_options & OPTION_DRYRUN);
+
+	len = strlen(val);
+	if (len <= EXPR_MEMO_MAXLEN) {
+		hash = fnv1a(FNV1A_INIT, val, len);
+		switch (expr_memo_get(ex->ex_re, hash, val, len, matches)) {
+		case EXPR_MATCH:
+			goto match;
+		case EXPR_NOMATCH:
+			return EXPR_NOMATCH;
+		}
+	}
+
+	/*
+	 * Favor the DFA in order to determine if the pattern matches. If so,
+	 * regexec() is only needed in order to extract the subexpressions.
+	 */
+	if (ex->ex_re->dfa != NULL &&
+	    dfa_match(ex->ex_re->dfa, val) == DFA_NOMATCH) {
+		error = REG_NOMATCH;
+	} else if (ex->ex_re->dfa != NULL && !positions) {
+		error = 0;
+	} else {
+		__atomic_fetch_add(&ex->ex_re->stats.regexec, 1,
+		    __ATOMIC_RELAXED);
+		error = regexec(&ex->ex_re->pattern, val,
+		    positions ? ex->ex_re->nmatches : 0, matches, 0);
+	}
+	if (error != 0 && error != REG_NOMATCH)
+		return EXPR_ERROR;
+	if (len <= EXPR_MEMO_MAXLEN) {
+		expr_memo_put(ex->ex_re, hash, val, len,
+		    error == 0 ? matches : NULL);
+	}
 	if (error == REG_NOMATCH)
 		return EXPR_NOMATCH;
-	if (error != 0)
-		return EXPR_ERROR;
 
+match:
 	mh = match_alloc(ex, ea->ea_msg, ea->ea_arena.eternal_scope);
 	if (matches_append(ea->ea_ml, mh))
 		return EXPR_ERROR;
-	expr_regcopy(ex, mh, val, ea->ea_arena.eternal_scope);
+	if (positions)
+		expr_regcopy(ex, mh, matches, val, ea->ea_arena.eternal_scope);
 
 	if (ea->ea_env->ev_options & OPTION_DRYRUN) {
 		mh->mh_key = arena_strdup(ea->ea_arena.eternal_scope, key);
@@ -1062,11 +1496,69 @@ expr_regexec(struct expr *ex, struct expr_eval_arg *ea, const char *key,
 	return EXPR_MATCH;
 }
 
+/*
+ * Returns EXPR_MATCH or EXPR_NOMATCH if the outcome of matching the given
+ * value is memoized, populating the subexpressions on match. Otherwise,
+ * returns EXPR_ERROR.
+ */
+static int
+expr_memo_get(struct expr_regex *re, uint64_t hash, const char *val,
+    size_t len, regmatch_t *matches)
+{
+	const struct expr_memo *em;
+	size_t slot = hash % EXPR_MEMO_SIZE;
+	int ev = EXPR_ERROR;
+
+	pthread_mutex_lock(&re->memo.lock);
+	em = &re->memo.entries[slot];
+	if (em->ev != EXPR_ERROR && em->hash == hash && em->len == len &&
+	    memcmp(em->val, val, len) == 0) {
+		ev = em->ev;
+		if (ev == EXPR_MATCH) {
+			memcpy(matches, &re->memo.matches[slot * re->nmatches],
+			    re->nmatches * sizeof(*matches));
+		}
+		re->memo.hit++;
+	} else {
+		re->memo.miss++;
+	}
+	pthread_mutex_unlock(&re->memo.lock);
+	return ev;
+}
+
+/*
+ * Memoize the outcome of matching the given value, evicting any previous
+ * value in the same slot. The subexpressions are NULL on no match. Memoization
+ * is best effort and skipped while a concurrent evaluation holds the lock,
+ * limiting a miss to only wait for the lock once.
+ */
 static void
-expr_regcopy(const struct expr *ex, struct match *mh, const char *str,
-    struct arena_scope *s)
+expr_memo_put(struct expr_regex *re, uint64_t hash, const char *val,
+    size_t len, const regmatch_t *matches)
+{
+	struct expr_memo *em;
+	size_t slot = hash % EXPR_MEMO_SIZE;
+
+	if (pthread_mutex_trylock(&re->memo.lock) != 0)
+		return;
+	em = &re->memo.entries[slot];
+	em->hash = hash;
+	em->len = len;
+	memcpy(em->val, val, len);
+	if (matches != NULL) {
+		memcpy(&re->memo.matches[slot * re->nmatches], matches,
+		    re->nmatches * sizeof(*matches));
+		em->ev = EXPR_MATCH;
+	} else {
+		em->ev = EXPR_NOMATCH;
+	}
+	pthread_mutex_unlock(&re->memo.lock);
+}
+
+static void
+expr_regcopy(const struct expr *ex, struct match *mh, const regmatch_t *off,
+    const char *str, struct arena_scope *s)
 {
-	const regmatch_t *off = ex->ex_re->matches;
 	size_t nmemb = ex->ex_re->nmatches;
 	size_t i;
 
@@ -1094,6 +1586,457 @@ expr_regcopy(const struct expr *ex, struct match *mh, const char *str,
 	}
 }
 
+static void
+exprcompile(struct expr_compile *ec, struct expr *ex, struct arena_scope *s)
+{
+	size_t j;
+	int c;
+
+	if ((c = exprconst(ex)) != EXPR_ERROR) {
+		exprinsn(ec, EXPR_OP_CONST, c, NULL);
+		return;
+	}
+
+	switch (ex->ex_type) {
+	case EXPR_TYPE_BLOCK:
+		exprcompile(ec, ex->ex_lhs, s);
+		exprinsn(ec, EXPR_OP_BLOCK_END, 0, NULL);
+		break;
+
+	case EXPR_TYPE_MATCH:
+		j = exprinsn(ec, EXPR_OP_MATCH, 0, ex);
+		if (exprconst(ex->ex_lhs) == EXPR_MATCH) {
+			exprcompile(ec, ex->ex_rhs, s);
+		} else {
+			size_t k;
+
+			exprcompile(ec, ex->ex_lhs, s);
+			k = exprinsn(ec, EXPR_OP_AND, 0, NULL);
+			exprcompile(ec, ex->ex_rhs, s);
+			ec->ec_pr->pr_insns[k].in_val =
+			    (int)VECTOR_LENGTH(ec->ec_pr->pr_insns);
+		}
+		ec->ec_pr->pr_insns[j].in_val =
+		    (int)VECTOR_LENGTH(ec->ec_pr->pr_insns);
+		break;
+
+	case EXPR_TYPE_AND:
+		if (exprconst(ex->ex_lhs) == EXPR_MATCH) {
+			exprcompile(ec, ex->ex_rhs, s);
+		} else if (exprconst(ex->ex_rhs) == EXPR_MATCH) {
+			exprcompile(ec, ex->ex_lhs, s);
+		} else {
+			exprcompile(ec, ex->ex_lhs, s);
+			j = exprinsn(ec, EXPR_OP_AND, 0, NULL);
+			exprcompile(ec, ex->ex_rhs, s);
+			ec->ec_pr->pr_insns[j].in_val =
+			    (int)VECTOR_LENGTH(ec->ec_pr->pr_insns);
+		}
+		break;
+
+	case EXPR_TYPE_OR:
+		if (exprconst(ex->ex_lhs) == EXPR_NOMATCH) {
+			exprcompile(ec, ex->ex_rhs, s);
+		} else if (exprconst(ex->ex_rhs) == EXPR_NOMATCH ||
+		    exprmatches(ex->ex_lhs)) {
+			/* Right-hand side is either redundant or unreachable. */
+			exprcompile(ec, ex->ex_lhs, s);
+		} else {
+			exprcompile(ec, ex->ex_lhs, s);
+			j = exprinsn(ec, EXPR_OP_OR, 0, NULL);
+			exprcompile(ec, ex->ex_rhs, s);
+			ec->ec_pr->pr_insns[j].in_val =
+			    (int)VECTOR_LENGTH(ec->ec_pr->pr_insns);
+		}
+		break;
+
+	case EXPR_TYPE_NEG:
+		exprinsn(ec, EXPR_OP_NEG_BEGIN, 0, NULL);
+		if (++ec->ec_depth > ec->ec_pr->pr_depth)
+			ec->ec_pr->pr_depth = ec->ec_depth;
+		exprcompile(ec, ex->ex_lhs, s);
+		ec->ec_depth--;
+		exprinsn(ec, EXPR_OP_NEG_END, 0, NULL);
+		break;
+
+	case EXPR_TYPE_ATTACHMENT:
+	case EXPR_TYPE_ATTACHMENT_BLOCK:
+		/* Evaluated once per attachment, given its own program. */
+		expr_compile(ex->ex_lhs, s);
+		exprinsn(ec, EXPR_OP_EVAL, 0, ex);
+		break;
+
+	case EXPR_TYPE_HEADER:
+		if (ex->ex_re->literal != NULL)
+			*ARENA_VECTOR_ALLOC(ec->ec_headers) = ex;
+		exprinsn(ec, EXPR_OP_EVAL, 0, ex);
+		break;
+
+	default:
+		exprinsn(ec, EXPR_OP_EVAL, 0, ex);
+		break;
+	}
+}
+
+/*
+ * Returns the outcome of the given expression if constant, EXPR_ERROR
+ * otherwise. Only expressions without any side effects are considered
+ * constant.
+ */
+static int
+exprconst(const struct expr *ex)
+{
+	int c;
+
+	switch (ex->ex_type) {
+	case EXPR_TYPE_ALL:
+		return EXPR_MATCH;
+
+	case EXPR_TYPE_NEG:
+		switch (exprconst(ex->ex_lhs)) {
+		case EXPR_MATCH:
+			return EXPR_NOMATCH;
+		case EXPR_NOMATCH:
+			return EXPR_MATCH;
+		}
+		break;
+
+	case EXPR_TYPE_AND:
+		c = exprconst(ex->ex_lhs);
+		if (c == EXPR_NOMATCH)
+			return EXPR_NOMATCH;
+		if (c == EXPR_MATCH)
+			return exprconst(ex->ex_rhs);
+		break;
+
+	case EXPR_TYPE_OR:
+		c = exprconst(ex->ex_lhs);
+		if (c == EXPR_MATCH)
+			return EXPR_MATCH;
+		if (c == EXPR_NOMATCH)
+			return exprconst(ex->ex_rhs);
+		break;
+
+	default:
+		break;
+	}
+
+	return EXPR_ERROR;
+}
+
+/*
+ * Group the header matchers collected during compilation by header names. A
+ * group is only worthwhile if it consists of more than one matcher.
+ */
+static void
+exprgroup(struct expr_compile *ec, struct arena_scope *s)
+{
+	size_t i, j;
+
+	for (i = 0; i < VECTOR_LENGTH(ec->ec_headers); i++) {
+		VECTOR(const char *) literals;
+		struct expr_group *eg;
+		struct expr *ex = ec->ec_headers[i];
+		size_t id = 0;
+
+		if (ex->ex_header.group != NULL)
+			continue;
+
+		ARENA_VECTOR_INIT(s, literals, 0);
+		for (j = i; j < VECTOR_LENGTH(ec->ec_headers); j++) {
+			struct expr *cmp = ec->ec_headers[j];
+
+			if (cmp->ex_header.group == NULL &&
+			    exprnameseq(ex->ex_strings, cmp->ex_strings))
+				*ARENA_VECTOR_ALLOC(literals) = cmp->ex_re->literal;
+		}
+		if (VECTOR_LENGTH(literals) < 2)
+			continue;
+
+		eg = arena_calloc(s, 1, sizeof(*eg));
+		eg->eg_names = ex->ex_strings;
+		eg->eg_keys = ex->ex_header.keys;
+		eg->eg_literals = literal_set_alloc(literals,
+		    VECTOR_LENGTH(literals), s);
+		eg->eg_nwords = (VECTOR_LENGTH(literals) + 63) / 64;
+		for (j = i; j < VECTOR_LENGTH(ec->ec_headers); j++) {
+			struct expr *cmp = ec->ec_headers[j];
+
+			if (cmp->ex_header.group != NULL ||
+			    !exprnameseq(ex->ex_strings, cmp->ex_strings))
+				continue;
+			cmp->ex_header.group = eg;
+			cmp->ex_header.id = id++;
+		}
+	}
+}
+
+/*
+ * Returns non-zero if the given header names are equal, including order.
+ */
+/*
+ * Returns non-zero if the given expression or any of its descendants, except
+ * for nested rules, interpolates back-references.
+ */
+static int
+exprbackrefs(const struct expr *ex)
+{
+	const struct string *str;
+
+	if (ex == NULL)
+		return 0;
+
+	switch (ex->ex_type) {
+	case EXPR_TYPE_COMMAND:
+	case EXPR_TYPE_EXEC:
+	case EXPR_TYPE_LABEL:
+	case EXPR_TYPE_MOVE:
+	case EXPR_TYPE_STAT:
+		LIST_FOREACH(str, ex->ex_strings) {
+			if (hasbackref(str->val))
+				return 1;
+		}
+		break;
+	case EXPR_TYPE_ADD_HEADER:
+		if (hasbackref(ex->ex_add_header.val))
+			return 1;
+		break;
+	default:
+		break;
+	}
+
+	return (ex->ex_lhs != NULL && ex->ex_lhs->ex_type != EXPR_TYPE_MATCH &&
+	    exprbackrefs(ex->ex_lhs)) ||
+	    (ex->ex_rhs != NULL && ex->ex_rhs->ex_type != EXPR_TYPE_MATCH &&
+	    exprbackrefs(ex->ex_rhs));
+}
+
+/*
+ * Mark the patterns whose subexpressions could be back-referenced, which is
+ * limited to the patterns within the same rule as the back-reference. Other
+ * patterns are only subject to matching.
+ */
+static void
+exprbackrefs_mark(struct expr *ex, int backrefs)
+{
+	if (ex == NULL)
+		return;
+
+	if (ex->ex_type == EXPR_TYPE_MATCH)
+		backrefs = exprbackrefs(ex);
+	if (ex->ex_re != NULL)
+		ex->ex_re->backrefs = backrefs;
+	exprbackrefs_mark(ex->ex_lhs, backrefs);
+	exprbackrefs_mark(ex->ex_rhs, backrefs);
+}
+
+static int
+exprnameseq(const struct string_list *a, const struct string_list *b)
+{
+	const struct string *sa, *sb;
+
+	sa = LIST_FIRST(a);
+	sb = LIST_FIRST(b);
+	for (; sa != NULL && sb != NULL;
+	    sa = LIST_NEXT(sa), sb = LIST_NEXT(sb)) {
+		if (strcasecmp(sa->val, sb->val) != 0)
+			return 0;
+	}
+	return sa == NULL && sb == NULL;
+}
+
+/*
+ * Search for the literals of the given group in all header values of the
+ * message, only carried out once per message.
+ */
+static const struct expr_scan *
+exprscan(const struct expr_group *eg, struct expr_eval_arg *ea)
+{
+	struct expr_scan *es;
+	size_t i, k, nnames, nvalues;
+
+	if (ea->ea_scans == NULL)
+		ARENA_VECTOR_INIT(ea->ea_arena.eternal_scope, ea->ea_scans, 1);
+	for (i = 0; i < VECTOR_LENGTH(ea->ea_scans); i++) {
+		es = &ea->ea_scans[i];
+		if (es->es_group == eg && es->es_msg == ea->ea_msg)
+			return es;
+	}
+
+	nnames = strings_len(eg->eg_names);
+	es = ARENA_VECTOR_CALLOC(ea->ea_scans);
+	es->es_group = eg;
+	es->es_msg = ea->ea_msg;
+	es->es_offsets = arena_calloc(ea->ea_arena.eternal_scope, nnames,
+	    sizeof(*es->es_offsets));
+	nvalues = 0;
+	for (k = 0; k < nnames; k++) {
+		VECTOR(const char *const) values;
+
+		es->es_offsets[k] = nvalues;
+		values = message_get_header_id(ea->ea_msg, eg->eg_keys[k]);
+		if (values != NULL)
+			nvalues += VECTOR_LENGTH(values);
+	}
+	es->es_bits = arena_calloc(ea->ea_arena.eternal_scope,
+	    nvalues * eg->eg_nwords, sizeof(*es->es_bits));
+	for (k = 0; k < nnames; k++) {
+		VECTOR(const char *const) values;
+		size_t j;
+
+		values = message_get_header_id(ea->ea_msg, eg->eg_keys[k]);
+		for (j = 0; values != NULL && j < VECTOR_LENGTH(values); j++) {
+			literal_set_search(eg->eg_literals, values[j],
+			    &es->es_bits[(es->es_offsets[k] + j) *
+			    eg->eg_nwords]);
+		}
+	}
+	return es;
+}
+
+/*
+ * Returns non-zero if the literal required by the given header matcher is
+ * present in the header value with the given index.
+ */
+static int
+exprscanned(const struct expr_scan *es, struct expr *ex, size_t idx)
+{
+	const uint64_t *bits;
+	size_t id = ex->ex_header.id;
+
+	bits = &es->es_bits[idx * es->es_group->eg_nwords];
+	if (bits[id / 64] & (1ULL << (id % 64))) {
+		__atomic_fetch_add(&ex->ex_re->stats.hit, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	__atomic_fetch_add(&ex->ex_re->stats.miss, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Returns non-zero if the given expression never evaluates to no match, any
+ * subsequent expression within the same block is therefore unreachable.
+ */
+static int
+exprmatches(const struct expr *ex)
+{
+	switch (ex->ex_type) {
+	case EXPR_TYPE_ALL:
+		return 1;
+
+	case EXPR_TYPE_AND:
+	case EXPR_TYPE_MATCH:
+		return exprmatches(ex->ex_lhs) && exprmatches(ex->ex_rhs);
+
+	case EXPR_TYPE_OR:
+		return exprmatches(ex->ex_lhs) || exprmatches(ex->ex_rhs);
+
+	case EXPR_TYPE_NEG:
+		return exprconst(ex) == EXPR_MATCH;
+
+	case EXPR_TYPE_ATTACHMENT_BLOCK:
+	case EXPR_TYPE_PASS:
+		return 0;
+
+	default:
+		break;
+	}
+
+	return (ex->ex_flags & EXPR_FLAG_ACTION) ? 1 : 0;
+}
+
+static size_t
+exprinsn(struct expr_compile *ec, int op, int val, struct expr *ex)
+{
+	struct expr_insn *in;
+
+	in = ARENA_VECTOR_CALLOC(ec->ec_pr->pr_insns);
+	in->in_op = op;
+	in->in_val = val;
+	in->in_ex = ex;
+	return VECTOR_LENGTH(ec->ec_pr->pr_insns) - 1;
+}
+
+static uint64_t
+exprhash(const struct expr *ex, uint64_t h)
+{
+	const struct string *str;
+
+	if (ex == NULL)
+		return fnv1a(h, "", 1);
+
+	h = fnv1a(h, &ex->ex_type, sizeof(ex->ex_type));
+	if (ex->ex_strings != NULL) {
+		LIST_FOREACH(str, ex->ex_strings)
+			h = fnv1a(h, str->val, strlen(str->val) + 1);
+	}
+	if (ex->ex_re != NULL) {
+		h = fnv1a(h, ex->ex_re->source, strlen(ex->ex_re->source) + 1);
+		h = fnv1a(h, &ex->ex_re->flags, sizeof(ex->ex_re->flags));
+		h = fnv1a(h, &ex->ex_re->rflags, sizeof(ex->ex_re->rflags));
+	}
+
+	switch (ex->ex_type) {
+	case EXPR_TYPE_DATE:
+		h = fnv1a(h, &ex->ex_date.cmp, sizeof(ex->ex_date.cmp));
+		h = fnv1a(h, &ex->ex_date.field, sizeof(ex->ex_date.field));
+		h = fnv1a(h, &ex->ex_date.age, sizeof(ex->ex_date.age));
+		break;
+	case EXPR_TYPE_EXEC:
+		h = fnv1a(h, &ex->ex_exec.flags, sizeof(ex->ex_exec.flags));
+		break;
+	case EXPR_TYPE_STAT:
+		h = fnv1a(h, &ex->ex_stat.stat, sizeof(ex->ex_stat.stat));
+		break;
+	case EXPR_TYPE_ADD_HEADER:
+		h = fnv1a(h, ex->ex_add_header.key,
+		    strlen(ex->ex_add_header.key) + 1);
+		h = fnv1a(h, ex->ex_add_header.val,
+		    strlen(ex->ex_add_header.val) + 1);
+		break;
+	default:
+		break;
+	}
+
+	h = exprhash(ex->ex_lhs, h);
+	return exprhash(ex->ex_rhs, h);
+}
+
+/*
+ * Extract the delivery timestamp from the given maildir file name, expected to
+ * be the leading seconds since epoch followed by a period.
+ */
+static int
+filetime(const char *name, long long int *tim)
+{
+	long long int t = 0;
+	const char *p;
+
+	for (p = name; isdigit((unsigned char)*p); p++) {
+		if (t > (LLONG_MAX - (*p - '0')) / 10)
+			return 1;
+		t = t * 10 + (*p - '0');
+	}
+	if (p == name || *p != '.')
+		return 1;
+	*tim = t;
+	return 0;
+}
+
+/*
+ * Returns non-zero if the given string contains a back-reference, see
+ * match_interpolate().
+ */
+static int
+hasbackref(const char *str)
+{
+	for (; (str = strchr(str, '\\')) != NULL; str++) {
+		if (isdigit((unsigned char)str[1]))
+			return 1;
+	}
+	return 0;
+}
+
 static size_t
 strnwidth(const char *str, size_t len)
 {
@@ -1,10 +1,17 @@
+#include <stddef.h>	/* size_t */
+
 struct arena_scope;
+struct expr_group;
+struct expr_program;
+struct expr_scan;
 struct match;
 
 /* Return values for expr_eval(). */
 #define EXPR_MATCH	(0)
 #define EXPR_NOMATCH	(1)
 #define EXPR_ERROR	(-1)
+/* Outcome depends on the message content, see EXPR_EVAL_LAZY. */
+#define EXPR_DEFER	(2)
 
 /* expr_set_pattern() flags */
 #define EXPR_PATTERN_ICASE	0x00000001u
@@ -56,6 +63,7 @@ enum expr_date_field {
 	EXPR_DATE_FIELD_ACCESS,
 	EXPR_DATE_FIELD_MODIFIED,
 	EXPR_DATE_FIELD_CREATED,
+	EXPR_DATE_FIELD_FILENAME,
 };
 
 enum expr_stat {
@@ -66,11 +74,20 @@ struct expr_eval_arg {
 	struct match_list		*ea_ml;
 	struct message			*ea_msg;
 	const struct environment	*ea_env;
+	unsigned int			 ea_flags;
+/*
+ * The message content is not loaded, expressions requiring it evaluate to
+ * EXPR_DEFER.
+ */
+#define EXPR_EVAL_LAZY	0x00000001u
 
 	struct {
 		struct arena_scope	*eternal_scope;
 		struct arena		*scratch;
 	} ea_arena;
+
+	/* Header literal searches, NULL if not yet initialized. */
+	struct expr_scan		*ea_scans;	/* VECTOR(struct expr_scan) */
 };
 
 struct expr {
@@ -85,6 +102,8 @@ struct expr {
 #define EXPR_FLAG_INTERPOLATE	0x00000004u
 /* Associated with a match that requires a maildir destination path. */
 #define EXPR_FLAG_PATH		0x00000008u
+/* Requires the message content, as opposed to only its path. */
+#define EXPR_FLAG_CONTENT	0x00000010u
 
 	int			 (*ex_eval)(struct expr *,
 	    struct expr_eval_arg *);
@@ -116,10 +135,19 @@ struct expr {
 			const char *key;
 			const char *val;
 		} ex_add_header;
+
+		struct {
+			const unsigned int	*keys;	/* interned names */
+			const struct expr_group	*group;	/* NULL if not grouped */
+			size_t			 id;
+		} ex_header;
 	};
 
 	struct expr		*ex_lhs;
 	struct expr		*ex_rhs;
+
+	/* Compiled representation, NULL if not compiled. */
+	const struct expr_program	*ex_prog;
 };
 
 struct expr	*expr_alloc(enum expr_type, unsigned int, struct expr *,
@@ -129,6 +157,8 @@ void	expr_set_add_header(struct expr *, const char *, const char *);
 void	expr_set_date(struct expr *, enum expr_date_field, enum expr_date_cmp,
     long long int, struct arena_scope *);
 int	expr_set_exec(struct expr *, struct string_list *, unsigned int);
+void	expr_set_header(struct expr *, struct string_list *,
+    struct arena_scope *);
 void	expr_set_stat(struct expr *, const char *, enum expr_stat,
     struct arena_scope *);
 void	expr_set_strings(struct expr *, struct string_list *);
@@ -137,6 +167,12 @@ int	expr_set_pattern(struct expr *, const char *, unsigned int,
 
 int	expr_count(const struct expr *, enum expr_type);
 int	expr_count_actions(const struct expr *);
+int	expr_needs_body(const struct expr *);
+void	expr_log_stats(const struct expr *);
+
+unsigned long long	expr_hash(const struct expr *);
+
+void	expr_compile(struct expr *, struct arena_scope *);
 
 int	expr_eval(struct expr *, struct expr_eval_arg *);
 
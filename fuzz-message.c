@@ -30,7 +30,8 @@ target(const char *path, void *userdata)
 
 	arena_scope(c->arena.eternal, eternal_scope);
 
-	msg = message_parse("/dev", -1, path, &eternal_scope, c->arena.scratch);
+	msg = message_parse("/dev", -1, path, 0, &eternal_scope,
+	    c->arena.scratch);
 	if (msg != NULL)
 		message_get_body(msg);
 }
@@ -0,0 +1,86 @@
+#include "config.h"
+#include <locale.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libks/arena.h"
+#include "libks/buffer.h"
+#include "libks/compiler.h"
+#include "libks/fuzzer.h"
+#include "dfa.h"
+
+/*
+ * Differential fuzzer comparing dfa_match() against regexec(3). The first line
+ * of the input is the pattern, prefixed with "i" for case insensitive or any
+ * other character otherwise, and the remaining input the string to match.
+ */
+
+struct test_context {
+	struct arena	*scratch;
+};
+
+static void *
+init(int UNUSED(argc), char **UNUSED(argv))
+{
+	static struct test_context c;
+
+	setlocale(LC_CTYPE, "");
+	c.scratch = arena_alloc("scratch");
+	return &c;
+}
+FUZZER_INIT(init);
+
+static void
+target(const struct buffer *bf, void *userdata)
+{
+	regex_t re;
+	struct test_context *c = userdata;
+	struct dfa *df;
+	const char *buf, *nl;
+	char *pattern, *str;
+	size_t len;
+	int icase, rflags, want;
+
+	arena_scope(c->scratch, s);
+
+	buf = buffer_get_ptr(bf);
+	len = buffer_get_len(bf);
+	if (len == 0 || memchr(buf, '\0', len) != NULL)
+		return;
+	nl = memchr(buf, '\n', len);
+	if (nl == NULL)
+		return;
+	icase = buf[0] == 'i';
+	pattern = arena_strndup(&s, &buf[1], (size_t)(nl - buf) - 1);
+	str = arena_strndup(&s, nl + 1, len - (size_t)(nl - buf) - 1);
+
+	rflags = REG_EXTENDED | REG_NEWLINE | (icase ? REG_ICASE : 0);
+	if (regcomp(&re, pattern, rflags) != 0)
+		return;
+	df = dfa_compile(pattern, icase, &s);
+	if (df != NULL) {
+		want = regexec(&re, str, 0, NULL, 0) == 0 ?
+		    DFA_MATCH : DFA_NOMATCH;
+		switch (dfa_match(df, str)) {
+		case DFA_MATCH:
+			if (want != DFA_MATCH)
+				__builtin_trap();
+			break;
+		case DFA_NOMATCH:
+			if (want != DFA_NOMATCH)
+				__builtin_trap();
+			break;
+		}
+	}
+	regfree(&re);
+}
+FUZZER_TARGET_BUFFER(target);
+
+static void
+teardown(void *userdata)
+{
+	struct test_context *c = userdata;
+
+	arena_free(c->scratch);
+}
+FUZZER_TEARDOWN(teardown);
@@ -0,0 +1,466 @@
+#include "literal.h"
+#include "config.h"
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "libks/arena.h"
+
+/*
+ * Search for many literals at once using the Aho-Corasick algorithm, compiled
+ * into a dense transition table. The search is case insensitive, only
+ * considering ASCII. Bytes not present in any literal share the same class in
+ * order to keep the table small.
+ */
+struct literal_set {
+	unsigned char	 ls_classes[256];
+	size_t		 ls_nclasses;
+	unsigned int	*ls_delta;	/* transitions, nstates * nclasses */
+	int		*ls_out;	/* first literal ending in state */
+	int		*ls_dict;	/* nearest suffix state with output */
+	int		*ls_next;	/* next literal ending in same state */
+};
+
+/* Sequence of consecutive literal characters in a pattern. */
+struct run {
+	char	*buf;
+	size_t	 len;
+	size_t	 atom;	/* offset of the last character */
+};
+
+static void	run_init(struct run *, size_t, struct arena_scope *);
+static void	run_flush(struct run *, struct run *);
+static void	run_pop(struct run *);
+static void	run_push(struct run *, const char *, size_t);
+
+static size_t	skipbracket(const char *, size_t);
+static size_t	skipgroup(const char *, size_t);
+static size_t	utf8len(unsigned char);
+
+static inline unsigned char
+fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+/*
+ * Returns non-zero if the given character can only match itself in any case
+ * while ignoring case. Some ASCII letters also match non-ASCII characters, such
+ * as 'k' matching U+212A KELVIN SIGN and 's' matching U+017F LATIN SMALL LETTER
+ * LONG S.
+ */
+static int
+foldable(unsigned char c)
+{
+	if (c >= 0x80)
+		return 0;
+	switch (fold(c)) {
+	case 'i':
+	case 'k':
+	case 's':
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Returns the longest literal which must be present in any string matched by
+ * the given extended regular expression, or NULL if no such literal could be
+ * determined. Constructs not understood are considered to break the literal
+ * as opposed of being rejected, favoring a shorter literal or no literal at
+ * all. Only characters unaffected by locale specific case folding are
+ * considered in case insensitive patterns.
+ */
+const char *
+literal_required(const char *pattern, int icase, struct arena_scope *s)
+{
+	struct run best, cur;
+	size_t i = 0;
+	size_t len;
+
+	len = strlen(pattern);
+	run_init(&best, len, s);
+	run_init(&cur, len, s);
+
+	while (i < len) {
+		unsigned char c = (unsigned char)pattern[i];
+		size_t n;
+
+		switch (c) {
+		case '|':
+			/* Alternation, nothing is required. */
+			return NULL;
+
+		case '(':
+			if ((n = skipgroup(pattern, i)) == 0)
+				return NULL;
+			i = n;
+			run_flush(&cur, &best);
+			continue;
+
+		case '[':
+			if ((n = skipbracket(pattern, i)) == 0)
+				return NULL;
+			i = n;
+			run_flush(&cur, &best);
+			continue;
+
+		case '*':
+		case '?':
+			/* The previous character is optional. */
+			run_pop(&cur);
+			run_flush(&cur, &best);
+			i++;
+			continue;
+
+		case '+':
+			run_flush(&cur, &best);
+			i++;
+			continue;
+
+		case '{': {
+			int optional = 1;
+
+			if (!isdigit((unsigned char)pattern[i + 1]))
+				return NULL;
+			for (i++; isdigit((unsigned char)pattern[i]); i++) {
+				if (pattern[i] != '0')
+					optional = 0;
+			}
+			while (pattern[i] != '}') {
+				if (pattern[i] == '\0')
+					return NULL;
+				i++;
+			}
+			if (optional)
+				run_pop(&cur);
+			run_flush(&cur, &best);
+			i++;
+			continue;
+		}
+
+		case '\\':
+			c = (unsigned char)pattern[i + 1];
+			if (c == '\0')
+				return NULL;
+			if (strchr("^.[]$()|*+?{}\\/", c) == NULL) {
+				/* Back reference or extension. */
+				run_flush(&cur, &best);
+			} else {
+				run_push(&cur, &pattern[i + 1], 1);
+			}
+			i += 2;
+			continue;
+
+		case '.':
+		case '^':
+		case '$':
+		case ')':
+		case ']':
+		case '}':
+			run_flush(&cur, &best);
+			i++;
+			continue;
+		}
+
+		n = utf8len(c);
+		if (n == 0 || i + n > len || (icase && !foldable(c))) {
+			run_flush(&cur, &best);
+			i += n > 0 ? n : 1;
+			continue;
+		}
+		/* A multibyte character is treated as a single atom. */
+		run_push(&cur, &pattern[i], n);
+		i += n;
+	}
+	run_flush(&cur, &best);
+
+	if (best.len == 0)
+		return NULL;
+	best.buf[best.len] = '\0';
+	return best.buf;
+}
+
+/*
+ * Returns non-zero if the given literal is present in the string. The search
+ * is case insensitive if icase is non-zero, the literal must then originate
+ * from literal_required().
+ */
+int
+literal_find(const char *str, const char *literal, int icase)
+{
+	char first[3];
+	size_t len;
+
+	if (!icase)
+		return strstr(str, literal) != NULL;
+
+	/*
+	 * Skip ahead to the next occurrence of the first character in any case,
+	 * strcspn(3) is usually vectorized.
+	 */
+	first[0] = (char)tolower((unsigned char)literal[0]);
+	first[1] = (char)toupper((unsigned char)literal[0]);
+	first[2] = '\0';
+	len = strlen(literal);
+	for (;;) {
+		str += strcspn(str, first);
+		if (*str == '\0')
+			return 0;
+		if (strncasecmp(str, literal, len) == 0)
+			return 1;
+		str++;
+	}
+}
+
+/*
+ * Construct a set of the given literals, all of which must be non-empty.
+ */
+struct literal_set *
+literal_set_alloc(const char *const *literals, size_t nliterals,
+    struct arena_scope *s)
+{
+	struct literal_set *ls;
+	unsigned int *queue;
+	int *fail;
+	size_t maxstates = 1;
+	size_t nstates = 1;
+	size_t head = 0;
+	size_t tail = 0;
+	size_t ncls, i;
+	unsigned int c;
+
+	ls = arena_calloc(s, 1, sizeof(*ls));
+
+	/* Class zero is shared by all bytes not present in any literal. */
+	ncls = 1;
+	for (i = 0; i < nliterals; i++) {
+		const unsigned char *p = (const unsigned char *)literals[i];
+
+		for (; *p != '\0'; p++) {
+			if (ls->ls_classes[fold(*p)] == 0)
+				ls->ls_classes[fold(*p)] = (unsigned char)ncls++;
+			maxstates++;
+		}
+	}
+	for (c = 'A'; c <= 'Z'; c++)
+		ls->ls_classes[c] = ls->ls_classes[fold((unsigned char)c)];
+	ls->ls_nclasses = ncls;
+
+	ls->ls_delta = arena_calloc(s, maxstates * ncls,
+	    sizeof(*ls->ls_delta));
+	ls->ls_out = arena_malloc(s, maxstates * sizeof(*ls->ls_out));
+	ls->ls_dict = arena_malloc(s, maxstates * sizeof(*ls->ls_dict));
+	ls->ls_next = arena_malloc(s, nliterals * sizeof(*ls->ls_next));
+	for (i = 0; i < maxstates; i++) {
+		ls->ls_out[i] = -1;
+		ls->ls_dict[i] = -1;
+	}
+
+	/*
+	 * Construct the trie, a transition to the root state denotes an absent
+	 * transition as the root state is never a child.
+	 */
+	for (i = 0; i < nliterals; i++) {
+		const unsigned char *p = (const unsigned char *)literals[i];
+		unsigned int state = 0;
+
+		for (; *p != '\0'; p++) {
+			unsigned int *t;
+
+			t = &ls->ls_delta[state * ncls + ls->ls_classes[*p]];
+			if (*t == 0)
+				*t = (unsigned int)nstates++;
+			state = *t;
+		}
+		ls->ls_next[i] = ls->ls_out[state];
+		ls->ls_out[state] = (int)i;
+	}
+
+	/*
+	 * Compute the failure transitions in breadth-first order, any state
+	 * closer to the root is therefore already complete.
+	 */
+	fail = arena_calloc(s, nstates, sizeof(*fail));
+	queue = arena_calloc(s, nstates, sizeof(*queue));
+	for (c = 0; c < ncls; c++) {
+		unsigned int t = ls->ls_delta[c];
+
+		if (t != 0)
+			queue[tail++] = t;
+	}
+	while (head < tail) {
+		unsigned int state = queue[head++];
+		unsigned int f = (unsigned int)fail[state];
+
+		for (c = 0; c < ncls; c++) {
+			unsigned int *t = &ls->ls_delta[state * ncls + c];
+			unsigned int u = ls->ls_delta[f * ncls + c];
+
+			if (*t == 0) {
+				*t = u;
+				continue;
+			}
+			fail[*t] = (int)u;
+			ls->ls_dict[*t] = ls->ls_out[u] != -1 ?
+			    (int)u : ls->ls_dict[u];
+			queue[tail++] = *t;
+		}
+	}
+
+	return ls;
+}
+
+/*
+ * Search for all literals in the given string. The bit corresponding to each
+ * found literal, in order of construction, is set in the given bitset.
+ */
+void
+literal_set_search(const struct literal_set *ls, const char *str,
+    uint64_t *bits)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	unsigned int state = 0;
+
+	for (; *p != '\0'; p++) {
+		int t;
+
+		state = ls->ls_delta[state * ls->ls_nclasses +
+		    ls->ls_classes[*p]];
+		t = ls->ls_out[state] != -1 ? (int)state : ls->ls_dict[state];
+		for (; t != -1; t = ls->ls_dict[t]) {
+			int id;
+
+			for (id = ls->ls_out[t]; id != -1;
+			    id = ls->ls_next[id])
+				bits[id / 64] |= 1ULL << (id % 64);
+		}
+	}
+}
+
+static void
+run_init(struct run *r, size_t len, struct arena_scope *s)
+{
+	r->buf = arena_malloc(s, len + 1);
+	r->len = 0;
+	r->atom = 0;
+}
+
+/*
+ * Terminate the current run, keeping it if longer than the best one.
+ */
+static void
+run_flush(struct run *cur, struct run *best)
+{
+	if (cur->len > best->len) {
+		memcpy(best->buf, cur->buf, cur->len);
+		best->len = cur->len;
+	}
+	cur->len = 0;
+}
+
+/*
+ * Remove the last character from the current run, caused by a quantifier
+ * making it optional.
+ */
+static void
+run_pop(struct run *r)
+{
+	if (r->len > 0)
+		r->len = r->atom;
+}
+
+static void
+run_push(struct run *r, const char *str, size_t len)
+{
+	r->atom = r->len;
+	memcpy(&r->buf[r->len], str, len);
+	r->len += len;
+}
+
+/*
+ * Returns the offset after the bracket expression starting at the given
+ * offset, zero if not terminated.
+ */
+static size_t
+skipbracket(const char *pattern, size_t i)
+{
+	i++;
+	if (pattern[i] == '^')
+		i++;
+	if (pattern[i] == ']')
+		i++;
+	for (;;) {
+		char c = pattern[i];
+
+		if (c == '\0')
+			return 0;
+		if (c == ']')
+			return i + 1;
+		if (c == '[' && (pattern[i + 1] == ':' ||
+		    pattern[i + 1] == '=' || pattern[i + 1] == '.')) {
+			char term = pattern[i + 1];
+
+			for (i += 2; !(pattern[i] == term &&
+			    pattern[i + 1] == ']'); i++) {
+				if (pattern[i] == '\0')
+					return 0;
+			}
+			i += 2;
+			continue;
+		}
+		i++;
+	}
+}
+
+/*
+ * Returns the offset after the group starting at the given offset, zero if not
+ * terminated.
+ */
+static size_t
+skipgroup(const char *pattern, size_t i)
+{
+	int depth = 0;
+
+	for (;;) {
+		switch (pattern[i]) {
+		case '\0':
+			return 0;
+		case '\\':
+			if (pattern[i + 1] == '\0')
+				return 0;
+			i += 2;
+			continue;
+		case '[':
+			if ((i = skipbracket(pattern, i)) == 0)
+				return 0;
+			continue;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0)
+				return i + 1;
+			break;
+		}
+		i++;
+	}
+}
+
+/*
+ * Returns the length of the UTF-8 sequence starting with the given byte, zero
+ * if invalid.
+ */
+static size_t
+utf8len(unsigned char c)
+{
+	if (c < 0x80)
+		return 1;
+	if (c >= 0xc2 && c <= 0xdf)
+		return 2;
+	if (c >= 0xe0 && c <= 0xef)
+		return 3;
+	if (c >= 0xf0 && c <= 0xf4)
+		return 4;
+	return 0;
+}
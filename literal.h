@@ -0,0 +1,12 @@
+#include <stddef.h>	/* size_t */
+#include <stdint.h>	/* uint64_t */
+
+struct arena_scope;
+
+const char	*literal_required(const char *, int, struct arena_scope *);
+int		 literal_find(const char *, const char *, int);
+
+struct literal_set	*literal_set_alloc(const char *const *, size_t,
+    struct arena_scope *);
+void			 literal_set_search(const struct literal_set *,
+    const char *, uint64_t *);
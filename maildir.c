@@ -9,45 +9,168 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "libks/arena-buffer.h"
 #include "libks/arena.h"
+#include "libks/buffer.h"
 #include "environment.h"
 #include "fault.h"
 #include "log.h"
 #include "message.h"
+#include "sync.h"
+#include "uring.h"
 #include "util.h"
 
 #define FLAGS_MAX	64
 
+/*
+ * Size of the buffer used to read directory entries in batches. The maximum
+ * number of entries per batch is derived from the smallest possible entry,
+ * an 8-byte aligned record holding the inode, offset, length, type and a name
+ * consisting of a single character.
+ */
+#define DIRENT_BUFSIZ	(32 * 1024)
+#define DIRENT_MAX	(DIRENT_BUFSIZ / 24)
+
+/*
+ * Upper bound for the number of maildirs kept open by the cache, bounded in
+ * order to respect the limit on number of open file descriptors.
+ */
+#define MAILDIR_CACHE_MAX	64
+
+/*
+ * Upper bound for the number of actions queued before being carried out in a
+ * single batch.
+ */
+#define MAILDIR_QUEUE_MAX	32
+
 enum subdir {
 	SUBDIR_NEW,
 	SUBDIR_CUR,
 };
 
+struct maildir_dirent {
+	const char	*name;
+	ino_t		 ino;
+	unsigned char	 type;
+	unsigned char	 stat;	/* file status resolved, see md_sts */
+};
+
 struct maildir {
 	char		 md_root[PATH_MAX];	/* root directory */
 	char		 md_path[PATH_MAX];	/* current directory */
 	DIR		*md_dir;
 	enum subdir	 md_subdir;
 	unsigned int	 md_flags;
+	int		 md_eod;		/* end of current directory */
+
+	/* Batch of entries read from the current directory. */
+	char			*md_buf;
+	struct maildir_dirent	*md_ents;
+	struct stat		*md_sts;	/* file status per entry */
+	size_t			 md_nents;
+	size_t			 md_next;
+
+	/* File status of the latest lookup. */
+	struct stat		 md_st;
+
+	/* Statistics for the current directory. */
+	struct timespec		 md_start;
+	size_t			 md_total;
+
+	/* Message read from stdin, only resides in memory. */
+	struct {
+		char	*buf;
+		size_t	 len;
+		char	 name[NAME_MAX + 1];
+	} md_stdin;
+};
+
+struct maildir_cache_entry {
+	char		key[PATH_MAX];
+	struct maildir	md;
+	unsigned long	used;	/* last time used, zero if empty */
+};
+
+struct maildir_cache {
+	struct maildir_cache_entry	*mc_entries;
+	size_t				 mc_nentries;
+	unsigned long			 mc_clock;
+
+	struct {
+		unsigned long	hit;
+		unsigned long	miss;
+		unsigned long	evict;
+	} mc_stats;
 };
 
+struct maildir_queue_entry {
+	enum {
+		QUEUE_MOVE,
+		QUEUE_UNLINK,
+	} type;
+
+	char		 src[PATH_MAX];		/* source message path */
+	char		 srcdir[PATH_MAX];
+	char		 dst[PATH_MAX];		/* destination message path */
+	char		 dstdir[PATH_MAX];
+	char		 dstname[NAME_MAX + 1];
+	char		 flags[FLAGS_MAX];
+	struct message	*msg;
+	unsigned int	 count;		/* genname() counter */
+	int		 slot;		/* ring operation index, -1 if faulted */
+	int		 res;		/* ring operation result */
+	int		 error;
+};
+
+struct maildir_queue {
+	struct maildir_queue_entry	*mq_entries;
+	size_t				 mq_len;
+	int				*mq_results;
+	struct uring			*mq_ring;
+};
+
+static int		 maildir_init(struct maildir *, const char *,
+    unsigned int);
+static int		 maildir_isstdin(const struct maildir *);
+static int		 maildir_create(const struct maildir *,
+    struct message *, const char *, char *, size_t,
+    const struct environment *);
 static int		 maildir_fd(const struct maildir *);
 static int		 maildir_genname(const struct maildir *, const char *,
     char *, size_t, const struct environment *);
 static const char	*maildir_next(struct maildir *);
 static int		 maildir_opendir(struct maildir *, const char *);
+static int		 maildir_publish(const struct maildir *, int,
+    const char *, char *, size_t, const struct environment *);
 static int		 maildir_stdin(struct maildir *,
-    const struct environment *);
+    const struct environment *, struct arena_scope *);
 static const char	*maildir_set_path(struct maildir *);
+static int		 maildir_tmpfile(const struct maildir *);
 static int		 maildir_read(struct maildir *, struct maildir_entry *);
+static int		 maildir_fill(struct maildir *);
+static ssize_t		 maildir_getdents(struct maildir *);
 static int		 maildir_rename(const struct maildir *,
-    const struct maildir *, const char *, const char *);
+    const struct maildir *, const char *, const char *, char *, size_t,
+    const struct environment *);
+
+static int	queue_genname(struct maildir_queue_entry *,
+    const struct environment *);
+static int	queue_move(struct maildir_queue_entry *,
+    const struct environment *);
+static int	queue_open(struct maildir_queue_entry *,
+    const struct environment *);
 
-static int	isfile(int, const char *);
+static int	direntcmp(const void *, const void *);
+static int	genname(char *, size_t, const char *, unsigned int,
+    const struct environment *);
+static int	isfile(int, const char *, struct stat *);
 static int	msgflags(const struct maildir *, const struct maildir *,
     struct message *, char *, size_t);
 static int	parsesubdir(const char *, enum subdir *);
+static int	unlinkpath(const char *);
+static int	unlinksuperseded(const char *);
 
 /*
  * Open the maildir directory located at path.
@@ -58,7 +181,9 @@ static int	parsesubdir(const char *, enum subdir *);
  *                      present in the cur and new subdirectories rooted at
  *                      path.
  *
- *     MAILDIR_STDIN    Read messages from stdin.
+ *     MAILDIR_STDIN    Read a single message from stdin. The message is
+ *                      kept in memory and only written to disk once moved
+ *                      to another maildir.
  *
  * The caller is responsible for freeing the returned memory using
  * maildir_close().
@@ -68,93 +193,428 @@ maildir_open(const char *path, unsigned int flags,
     const struct environment *env, struct arena_scope *s)
 {
 	struct maildir *md;
-	size_t siz;
 
 	md = arena_calloc(s, 1, sizeof(*md));
-	md->md_subdir = SUBDIR_NEW;
-	md->md_flags = flags;
+	if (flags & MAILDIR_WALK) {
+		md->md_buf = arena_malloc(s, DIRENT_BUFSIZ);
+		md->md_ents = arena_calloc(s, DIRENT_MAX, sizeof(*md->md_ents));
+		/* Only populated for entries lacking a file type. */
+		md->md_sts = arena_malloc(s, DIRENT_MAX * sizeof(*md->md_sts));
+	}
+	if (flags & MAILDIR_STDIN) {
+		md->md_flags = flags;
+		if (maildir_stdin(md, env, s))
+			return NULL;
+		return md;
+	}
+	if (maildir_init(md, path, flags)) {
+		maildir_close(md);
+		return NULL;
+	}
+	return md;
+}
 
-	if (md->md_flags & MAILDIR_STDIN) {
-		if (maildir_stdin(md, env))
-			goto err;
+void
+maildir_close(struct maildir *md)
+{
+	if (md == NULL)
+		return;
 
-		return md;
+	if (md->md_dir != NULL)
+		closedir(md->md_dir);
+}
+
+/*
+ * Allocate a cache of open maildirs, used to avoid opening and closing the
+ * same destination maildir over and over again.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * maildir_cache_free().
+ */
+struct maildir_cache *
+maildir_cache_alloc(struct arena_scope *s)
+{
+	struct maildir_cache *mc;
+
+	mc = arena_calloc(s, 1, sizeof(*mc));
+	mc->mc_entries = arena_calloc(s, MAILDIR_CACHE_MAX,
+	    sizeof(*mc->mc_entries));
+	mc->mc_nentries = MAILDIR_CACHE_MAX;
+	return mc;
+}
+
+void
+maildir_cache_free(struct maildir_cache *mc)
+{
+	size_t i;
+
+	if (mc == NULL)
+		return;
+
+	for (i = 0; i < mc->mc_nentries; i++) {
+		if (mc->mc_entries[i].used > 0)
+			maildir_close(&mc->mc_entries[i].md);
 	}
 
-	if (md->md_flags & MAILDIR_WALK) {
-		siz = sizeof(md->md_root);
-		if (strlcpy(md->md_root, path, siz) >= siz) {
-			warnc(ENAMETOOLONG, "%s", __func__);
-			goto err;
-		}
-	} else {
-		if (parsesubdir(path, &md->md_subdir))
-			goto err;
+	/* Each hit saves one opendir(3) and closedir(3) pair. */
+	if (mc->mc_stats.hit > 0 || mc->mc_stats.miss > 0) {
+		log_info("%s: hit=%lu, miss=%lu, evict=%lu, "
+		    "syscalls saved=%lu\n", __func__, mc->mc_stats.hit,
+		    mc->mc_stats.miss, mc->mc_stats.evict,
+		    2 * mc->mc_stats.hit);
+	}
+}
 
-		siz = sizeof(md->md_root);
-		if (pathslice(path, md->md_root, siz, 0, -1) == NULL)
-			goto err;
+/*
+ * Open the maildir directory located at path, see maildir_open(). The maildir
+ * is owned by the cache and must not be closed by the caller. The maildir
+ * remains valid until the cache is freed or until the maildir is evicted by a
+ * subsequent invocation. As the least recently used maildir is evicted, the
+ * maildir returned by the previous invocation always remains valid.
+ */
+struct maildir *
+maildir_cache_open(struct maildir_cache *mc, const char *path)
+{
+	struct maildir_cache_entry *lru = NULL;
+	size_t i, siz;
+
+	for (i = 0; i < mc->mc_nentries; i++) {
+		struct maildir_cache_entry *ent = &mc->mc_entries[i];
+
+		if (ent->used > 0 && strcmp(ent->key, path) == 0) {
+			mc->mc_stats.hit++;
+			ent->used = ++mc->mc_clock;
+			return &ent->md;
+		}
+		if (lru == NULL || ent->used < lru->used)
+			lru = ent;
 	}
-	path = maildir_set_path(md);
-	if (maildir_opendir(md, path))
-		goto err;
 
-	return md;
+	mc->mc_stats.miss++;
+	if (lru->used > 0) {
+		mc->mc_stats.evict++;
+		log_debug("%s: evict %s\n", __func__, lru->md.md_path);
+		maildir_close(&lru->md);
+		lru->used = 0;
+	}
+	siz = sizeof(lru->key);
+	if (strlcpy(lru->key, path, siz) >= siz) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return NULL;
+	}
+	memset(&lru->md, 0, sizeof(lru->md));
+	if (maildir_init(&lru->md, path, 0)) {
+		maildir_close(&lru->md);
+		return NULL;
+	}
+	lru->used = ++mc->mc_clock;
+	return &lru->md;
+}
 
-err:
-	maildir_close(md);
-	return NULL;
+/*
+ * Allocate a queue of actions carried out in batches using io_uring, reducing
+ * the number of system calls. If io_uring is unavailable, all actions are
+ * carried out synchronously.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * maildir_queue_free().
+ */
+struct maildir_queue *
+maildir_queue_alloc(struct arena_scope *s)
+{
+	struct maildir_queue *mq;
+
+	mq = arena_calloc(s, 1, sizeof(*mq));
+	mq->mq_ring = uring_alloc(MAILDIR_QUEUE_MAX, s);
+	if (mq->mq_ring != NULL) {
+		mq->mq_entries = arena_calloc(s, MAILDIR_QUEUE_MAX,
+		    sizeof(*mq->mq_entries));
+		mq->mq_results = arena_calloc(s, MAILDIR_QUEUE_MAX,
+		    sizeof(*mq->mq_results));
+	}
+	return mq;
 }
 
 void
-maildir_close(struct maildir *md)
+maildir_queue_free(struct maildir_queue *mq)
 {
-	if (md == NULL)
+	if (mq == NULL)
 		return;
+	uring_free(mq->mq_ring);
+}
+
+/*
+ * Returns the number of actions the queue is capable of carrying out in a
+ * single batch, zero if all actions are carried out synchronously.
+ */
+size_t
+maildir_queue_size(const struct maildir_queue *mq)
+{
+	return mq->mq_ring != NULL ? MAILDIR_QUEUE_MAX : 0;
+}
+
+/*
+ * Queue a move of the message, see maildir_move(). The message must remain
+ * valid until the queue is flushed. Returns zero on success, non-zero
+ * otherwise. Errors related to the move itself are reported by
+ * maildir_queue_flush().
+ */
+int
+maildir_queue_move(struct maildir_queue *mq, const struct maildir *src,
+    const struct maildir *dst, struct message *msg,
+    const struct environment *env)
+{
+	struct maildir_queue_entry *e;
+	const char *srcname;
+	int error = 0;
+
+	if (mq->mq_ring == NULL || (src->md_flags & MAILDIR_STDIN))
+		return maildir_move(src, dst, msg, env);
 
-	if (md->md_flags & MAILDIR_STDIN) {
-		struct maildir_entry me;
+	if (mq->mq_len == MAILDIR_QUEUE_MAX && maildir_queue_flush(mq, env))
+		error = 1;
 
-		/* Best effort removal of the temporary maildir. */
-		rewinddir(md->md_dir);
-		while (maildir_walk(md, &me) == 1)
-			(void)unlinkat(me.dirfd, me.path, 0);
-		(void)rmdir(md->md_path);
-		(void)rmdir(md->md_root);
+	e = &mq->mq_entries[mq->mq_len];
+	e->type = QUEUE_MOVE;
+	srcname = message_get_name(msg);
+	if (pathjoin(e->src, sizeof(e->src), src->md_path, srcname) == NULL) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
 	}
+	if (msgflags(src, dst, msg, e->flags, sizeof(e->flags)))
+		return 1;
+	(void)strlcpy(e->srcdir, src->md_path, sizeof(e->srcdir));
+	(void)strlcpy(e->dstdir, dst->md_path, sizeof(e->dstdir));
+	e->count = arc4random() % 128;
+	if (queue_genname(e, env))
+		return 1;
+	e->msg = msg;
+	e->error = 0;
+	mq->mq_len++;
 
-	if (md->md_dir != NULL)
-		closedir(md->md_dir);
+	return error;
+}
+
+/*
+ * Queue a removal of the path located in the given maildir, see
+ * maildir_unlink().
+ */
+int
+maildir_queue_unlink(struct maildir_queue *mq, const struct maildir *md,
+    const char *path, const struct environment *env)
+{
+	struct maildir_queue_entry *e;
+	int error = 0;
+
+	if (mq->mq_ring == NULL || (md->md_flags & MAILDIR_STDIN))
+		return maildir_unlink(md, path);
+
+	if (mq->mq_len == MAILDIR_QUEUE_MAX && maildir_queue_flush(mq, env))
+		error = 1;
+
+	e = &mq->mq_entries[mq->mq_len];
+	e->type = QUEUE_UNLINK;
+	if (pathjoin(e->src, sizeof(e->src), md->md_path, path) == NULL) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+	e->msg = NULL;
+	e->error = 0;
+	mq->mq_len++;
+
+	return error;
+}
+
+/*
+ * Carry out all queued actions in one batch. Returns zero on success, non-zero
+ * otherwise.
+ */
+int
+maildir_queue_flush(struct maildir_queue *mq, const struct environment *env)
+{
+	size_t i;
+	int error = 0;
+
+	if (mq->mq_len == 0)
+		return 0;
+
+	for (i = 0; i < mq->mq_len; i++) {
+		struct maildir_queue_entry *e = &mq->mq_entries[i];
+
+		mq->mq_results[i] = -ECANCELED;
+		if (e->error)
+			continue;
+
+		switch (e->type) {
+		case QUEUE_MOVE:
+			if (FAULT("maildir_rename")) {
+				e->slot = -1;
+				e->res = -errno;
+				break;
+			}
+			e->slot = uring_renameat(mq->mq_ring, e->src, e->dst);
+			break;
+		case QUEUE_UNLINK:
+			if (FAULT("maildir_unlink")) {
+				e->slot = -1;
+				e->res = -errno;
+				break;
+			}
+			e->slot = uring_unlinkat(mq->mq_ring, e->src);
+			break;
+		}
+	}
+	if (uring_submit(mq->mq_ring, mq->mq_results))
+		error = 1;
+	for (i = 0; i < mq->mq_len; i++) {
+		struct maildir_queue_entry *e = &mq->mq_entries[i];
+
+		if (e->error) {
+			error = 1;
+			continue;
+		}
+		if (e->slot != -1)
+			e->res = mq->mq_results[e->slot];
+
+		switch (e->type) {
+		case QUEUE_MOVE:
+			if (queue_move(e, env))
+				error = 1;
+			break;
+		case QUEUE_UNLINK:
+			if (e->res < 0) {
+				/* Fault already reported. */
+				if (e->slot != -1) {
+					errno = -e->res;
+					warn("unlinkat: %s", e->src);
+				}
+				error = 1;
+			}
+			break;
+		}
+	}
+	mq->mq_len = 0;
+
+	return error;
 }
 
 /*
  * Traverse the given maildir. Returns one of the following:
  *
  *     1    A new file was encountered and the maildir entry is populated with
- *          the details.
+ *          the details. The entry is only valid until the next invocation,
+ *          except for the directory which remains valid until the end of the
+ *          current directory is reached.
+ *     2    All files in the current directory have been traversed. The next
+ *          invocation moves on to the next directory, invalidating all
+ *          previously returned entries.
  *     0    All files have been traversed.
  *    -1    An error occurred.
  */
 int
 maildir_walk(struct maildir *md, struct maildir_entry *me)
 {
+	int r;
+
 	if ((md->md_flags & MAILDIR_WALK) == 0)
 		return 0;
 
-	for (;;) {
-		const char *path;
-		int r;
+	if (maildir_isstdin(md)) {
+		if (md->md_eod)
+			return 0;
+		md->md_eod = 1;
+		me->dir = md->md_path;
+		me->dirfd = -1;
+		me->path = md->md_stdin.name;
+		me->buf = md->md_stdin.buf;
+		me->buflen = md->md_stdin.len;
+		me->st = NULL;
+		return 1;
+	}
 
-		r = maildir_read(md, me);
-		if (r != 0)
-			return r;
+	if (md->md_eod) {
+		const char *path;
 
 		path = maildir_next(md);
 		if (path == NULL)
 			return 0;
 		if (maildir_opendir(md, path))
 			return -1;
+		md->md_eod = 0;
+	}
+
+	r = maildir_read(md, me);
+	if (r != 0)
+		return r;
+	md->md_eod = 1;
+	return 2;
+}
+
+/*
+ * Lookup the file with the given name in the maildir, typically used in
+ * conjunction with a maildir opened without MAILDIR_WALK. Returns 1 if the
+ * file exists in which case the maildir entry is populated with the details,
+ * 0 otherwise.
+ */
+int
+maildir_lookup(struct maildir *md, const char *name, struct maildir_entry *me)
+{
+	if (!isfile(maildir_fd(md), name, &md->md_st))
+		return 0;
+
+	me->dir = md->md_path;
+	me->dirfd = maildir_fd(md);
+	me->path = name;
+	me->buf = NULL;
+	me->buflen = 0;
+	me->st = &md->md_st;
+	return 1;
+}
+
+/*
+ * Returns non-zero if the given file name was generated by this process.
+ */
+int
+maildir_isown(const char *name, const struct environment *env)
+{
+	char prefix[32];
+	const char *p;
+	size_t len;
+	int n;
+
+	if ((p = strchr(name, '.')) == NULL)
+		return 0;
+	n = snprintf(prefix, sizeof(prefix), ".%d_", env->ev_pid);
+	if (n < 0 || (size_t)n >= sizeof(prefix) ||
+	    strncmp(p, prefix, (size_t)n) != 0)
+		return 0;
+	if ((p = strchr(&p[n], '.')) == NULL)
+		return 0;
+	len = strlen(env->ev_hostname);
+	return strncmp(&p[1], env->ev_hostname, len) == 0 &&
+	    (p[len + 1] == '\0' || p[len + 1] == ':');
+}
+
+/*
+ * Returns non-zero if messages in the given maildir can be moved to the maildir
+ * located at path. A message read from stdin cannot be moved within its own
+ * nominal maildir as it does not exist on disk.
+ */
+int
+maildir_canmove(const struct maildir *src, const char *path)
+{
+	char root[PATH_MAX];
+
+	if (!maildir_isstdin(src))
+		return 1;
+	/* Let any error be reported while opening the maildir. */
+	if (pathslice(path, root, sizeof(root), 0, -1) == NULL)
+		return 1;
+	if (strcmp(root, src->md_root) == 0) {
+		warnx("cannot move message to temporary directory");
+		return 0;
 	}
+	return 1;
 }
 
 /*
@@ -174,57 +634,56 @@ maildir_move(const struct maildir *src, const struct maildir *dst,
 	const char *srcname;
 	int doutime = 0;
 	int error = 0;
-	int dstfd, fd, srcfd;
-
-	srcname = message_get_name(msg);
-	srcfd = maildir_fd(src);
-
-	if ((src->md_flags & MAILDIR_STDIN) &&
-	    strcmp(src->md_root, dst->md_root) == 0) {
-		warnx("cannot move message to temporary directory");
-		return 1;
-	}
-
-	if ((src->md_flags & MAILDIR_STDIN) == 0) {
-		if (fstatat(srcfd, srcname, &sb, 0) != -1) {
-			times[1] = sb.st_mtim;
-			doutime = 1;
-		} else {
-			warn("fstatat");
-		}
-	}
+	int fd;
 
 	if (msgflags(src, dst, msg, flags, sizeof(flags)))
 		return 1;
-	fd = maildir_genname(dst, flags, dstname, sizeof(dstname), env);
-	if (fd == -1)
-		return 1;
-	dstfd = maildir_fd(dst);
 
-	error = maildir_rename(src, dst, srcname, dstname);
+	/* Message only resides in memory, write it once. */
+	if (maildir_isstdin(src))
+		return maildir_write(src, dst, msg, env);
+
+	srcname = message_get_name(msg);
+	error = maildir_rename(src, dst, srcname, flags, dstname,
+	    sizeof(dstname), env);
 	if (error && errno == EXDEV) {
 		/*
 		 * Rename failed since source and destination reside on
-		 * different file systems. Fallback to writing a new message.
+		 * different file systems. Fallback to writing a new message
+		 * while preserving the modification time.
 		 */
+		if (message_stat(msg, &sb) == 0) {
+			times[1] = sb.st_mtim;
+			doutime = 1;
+		}
+
+		fd = maildir_genname(dst, flags, dstname, sizeof(dstname),
+		    env);
+		if (fd == -1)
+			return 1;
 		error = message_write(msg, fd);
 		if (!error)
-			error = maildir_unlink(src, srcname);
-	}
-	/*
-	 * Try to reduce side effects by removing the new message in
-	 * case of failure(s).
-	 */
-	if (error)
-		(void)maildir_unlink(dst, dstname);
-
-	close(fd);
+			error = unlinksuperseded(message_get_path(msg));
+		/*
+		 * Try to reduce side effects by removing the new message in
+		 * case of failure(s).
+		 */
+		if (error)
+			(void)maildir_unlink(dst, dstname);
+		close(fd);
 
-	if (!error && doutime && utimensat(dstfd, dstname, times, 0) == -1) {
-		warn("utimensat");
-		error = 1;
+		if (!error && doutime &&
+		    utimensat(maildir_fd(dst), dstname, times, 0) == -1) {
+			warn("utimensat");
+			error = 1;
+		}
 	}
 
+	if (!error)
+		error = sync_dir(src->md_path);
+	if (!error)
+		error = sync_dir(dst->md_path);
+
 	if (!error)
 		error = message_set_file(msg, dst->md_path, dstname, -1);
 
@@ -241,6 +700,10 @@ maildir_unlink(const struct maildir *md, const char *path)
 	if (FAULT("maildir_unlink"))
 		return 1;
 
+	/* Message only resides in memory, nothing to remove. */
+	if (maildir_isstdin(md))
+		return 0;
+
 	if (unlinkat(maildir_fd(md), path, 0) == -1) {
 		warn("unlinkat: %s/%s", md->md_path, path);
 		return 1;
@@ -249,50 +712,56 @@ maildir_unlink(const struct maildir *md, const char *path)
 }
 
 /*
- * Write message to a new file in the given maildir and remove the old file,
- * assuming the write succeeded.
+ * Write message to a new file in dst and remove the old file from src, assuming
+ * the write succeeded. The two maildirs are allowed to be the same. Used to
+ * write header modifications, optionally fused with a move as the message only
+ * has to be written once.
  */
 int
-maildir_write(struct maildir *md, struct message *msg,
-    const struct environment *env)
+maildir_write(const struct maildir *src, const struct maildir *dst,
+    struct message *msg, const struct environment *env)
 {
 	char flags[FLAGS_MAX], name[NAME_MAX + 1];
-	int error, fd, rdfd;
+	int error, fd;
 
-	if (msgflags(md, md, msg, flags, sizeof(flags)))
+	/*
+	 * Message only resides in memory, the modifications are written once
+	 * the message is moved.
+	 */
+	if (maildir_isstdin(dst))
+		return 0;
+
+	if (msgflags(src, dst, msg, flags, sizeof(flags)))
 		return 1;
-	fd = maildir_genname(md, flags, name, sizeof(name), env);
+	fd = maildir_create(dst, msg, flags, name, sizeof(name), env);
 	if (fd == -1)
 		return 1;
 
-	error = message_write(msg, fd);
-	close(fd);
-	if (!error)
-		error = maildir_unlink(md, message_get_name(msg));
 	/*
-	 * Either writing the new message or removing the old one failed, try to
-	 * reduce side effects by removing the new message.
+	 * Removing the old message failed, try to reduce side effects by
+	 * removing the new message.
 	 */
-	if (error) {
-		(void)maildir_unlink(md, name);
-		return error;
+	if (!maildir_isstdin(src) &&
+	    unlinksuperseded(message_get_path(msg))) {
+		(void)maildir_unlink(dst, name);
+		close(fd);
+		return 1;
+	}
+	if ((!maildir_isstdin(src) && maildir_cmp(src, dst) != 0 &&
+	    sync_dir(src->md_path)) || sync_dir(dst->md_path)) {
+		close(fd);
+		return 1;
 	}
 
 	/*
 	 * Update the message fd as the newly written message might have been
 	 * modified due to addition of headers etc. This is of importance to let
 	 * any following action(s) operating on the same message to observe the
-	 * modifications. Note, a message fd must be readable as opposed of the
-	 * one from maildir_genname() which is only writeable.
+	 * modifications.
 	 */
-	rdfd = openat(maildir_fd(md), name, O_RDONLY | O_CLOEXEC);
-	if (rdfd == -1) {
-		warn("openat: %s/%s", md->md_path, name);
-		return 1;
-	}
-	error = message_set_file(msg, md->md_path, name, rdfd);
+	error = message_set_file(msg, dst->md_path, name, fd);
 	if (error)
-		close(rdfd);
+		close(fd);
 
 	return error;
 }
@@ -310,12 +779,41 @@ maildir_cmp(const struct maildir *md1, const struct maildir *md2)
 	return strcmp(md1->md_root, md2->md_root);
 }
 
+static int
+maildir_init(struct maildir *md, const char *path, unsigned int flags)
+{
+	size_t siz;
+
+	md->md_subdir = SUBDIR_NEW;
+	md->md_flags = flags;
+
+	if (md->md_flags & MAILDIR_WALK) {
+		siz = sizeof(md->md_root);
+		if (strlcpy(md->md_root, path, siz) >= siz) {
+			warnc(ENAMETOOLONG, "%s", __func__);
+			return 1;
+		}
+	} else {
+		if (parsesubdir(path, &md->md_subdir))
+			return 1;
+
+		siz = sizeof(md->md_root);
+		if (pathslice(path, md->md_root, siz, 0, -1) == NULL)
+			return 1;
+	}
+	path = maildir_set_path(md);
+	return maildir_opendir(md, path);
+}
+
+static int
+maildir_isstdin(const struct maildir *md)
+{
+	return md->md_flags & MAILDIR_STDIN;
+}
+
 static const char *
 maildir_next(struct maildir *md)
 {
-	if (md->md_flags & MAILDIR_STDIN)
-		return NULL;
-
 	switch (md->md_subdir) {
 	case SUBDIR_NEW:
 		md->md_subdir = SUBDIR_CUR;
@@ -340,9 +838,60 @@ maildir_opendir(struct maildir *md, const char *path)
 		warn("opendir: %s", path);
 		return 1;
 	}
+	md->md_nents = 0;
+	md->md_next = 0;
+	md->md_total = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &md->md_start);
 	return 0;
 }
 
+/*
+ * Write the message to a new file in the given maildir. If supported, the file
+ * is created unnamed and only linked into the maildir once completely written,
+ * preventing readers from observing a partially written message and collisions
+ * from requiring the file to be created again. Returns a readable file
+ * descriptor to the new file on success, -1 otherwise.
+ */
+static int
+maildir_create(const struct maildir *md, struct message *msg,
+    const char *flags, char *buf, size_t bufsiz,
+    const struct environment *env)
+{
+	int error, fd, rdfd;
+
+	fd = maildir_tmpfile(md);
+	if (fd != -1) {
+		if (message_write(msg, fd) ||
+		    maildir_publish(md, fd, flags, buf, bufsiz, env)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	fd = maildir_genname(md, flags, buf, bufsiz, env);
+	if (fd == -1)
+		return -1;
+	error = message_write(msg, fd);
+	close(fd);
+	if (error) {
+		(void)maildir_unlink(md, buf);
+		return -1;
+	}
+
+	/*
+	 * A message fd must be readable as opposed of the one from
+	 * maildir_genname() which is only writeable.
+	 */
+	rdfd = openat(maildir_fd(md), buf, O_RDONLY | O_CLOEXEC);
+	if (rdfd == -1) {
+		warn("openat: %s/%s", md->md_path, buf);
+		(void)maildir_unlink(md, buf);
+		return -1;
+	}
+	return rdfd;
+}
+
 static int
 maildir_fd(const struct maildir *md)
 {
@@ -357,22 +906,15 @@ static int
 maildir_genname(const struct maildir *md, const char *flags, char *buf,
     size_t bufsiz, const struct environment *env)
 {
-	long long ts;
 	unsigned int count;
 
-	ts = env->ev_now;
 	count = arc4random() % 128;
 	for (;;) {
-		int fd, n;
+		int fd;
 
 		count++;
-		n = snprintf(buf, bufsiz, "%lld.%d_%u.%s%s",
-		    ts, env->ev_pid, count, env->ev_hostname,
-		    flags ? flags : "");
-		if (n < 0 || (size_t)n >= bufsiz) {
-			warnc(ENAMETOOLONG, "%s", __func__);
+		if (genname(buf, bufsiz, flags, count, env))
 			return -1;
-		}
 		fd = openat(maildir_fd(md), buf,
 		    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
 		if (fd == -1) {
@@ -388,6 +930,43 @@ maildir_genname(const struct maildir *md, const char *flags, char *buf,
 	}
 }
 
+/*
+ * Give the file created by maildir_tmpfile() a unique name in the given
+ * maildir.
+ */
+static int
+maildir_publish(const struct maildir *md, int fd, const char *flags,
+    char *buf, size_t bufsiz, const struct environment *env)
+{
+	char path[32];
+	unsigned int count;
+	int n;
+
+	n = snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if (n < 0 || (size_t)n >= sizeof(path)) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+
+	count = arc4random() % 128;
+	for (;;) {
+		count++;
+		if (genname(buf, bufsiz, flags, count, env))
+			return 1;
+		if (linkat(AT_FDCWD, path, maildir_fd(md), buf,
+		    AT_SYMLINK_FOLLOW) == 0) {
+			log_debug("%s: %s/%s\n", __func__, md->md_path, buf);
+			return 0;
+		}
+		if (errno == EEXIST) {
+			log_debug("%s: %s: file exists\n", __func__, buf);
+			continue;
+		}
+		warn("linkat: %s/%s", md->md_path, buf);
+		return 1;
+	}
+}
+
 static const char *
 maildir_set_path(struct maildir *md)
 {
@@ -408,116 +987,156 @@ maildir_set_path(struct maildir *md)
 	return path;
 }
 
+/*
+ * Create an unnamed file in the given maildir, see maildir_publish(). Returns
+ * a readable and writeable file descriptor on success. Otherwise, -1 is
+ * returned in which case the caller is expected to fallback to
+ * maildir_genname().
+ */
 static int
-maildir_stdin(struct maildir *md, const struct environment *env)
+maildir_tmpfile(const struct maildir *md)
 {
-	char buf[BUFSIZ], name[NAME_MAX + 1];
-	const char *path;
-	ssize_t nr, nw;
-	int error = 0;
+#ifdef HAVE_O_TMPFILE
+	/* Publishing the file requires the proc file system. */
+	static int haveproc = -1;
 	int fd;
 
+	if (haveproc == -1)
+		haveproc = access("/proc/self/fd", X_OK) == 0;
+	if (!haveproc)
+		return -1;
+
+	fd = openat(maildir_fd(md), ".", O_TMPFILE | O_RDWR | O_CLOEXEC,
+	    S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		log_debug("%s: %s: %s\n", __func__, md->md_path,
+		    strerror(errno));
+	}
+	return fd;
+#else
+	(void)md;
+	return -1;
+#endif
+}
+
+/*
+ * Read the message from stdin into memory. The maildir is only nominal, its
+ * path is never created as the message is written directly to its final
+ * destination once moved.
+ */
+static int
+maildir_stdin(struct maildir *md, const struct environment *env,
+    struct arena_scope *s)
+{
+	struct buffer *bf;
+
 	if (pathjoin(md->md_root, sizeof(md->md_root), env->ev_tmpdir,
-	    "mdsort-XXXXXXXX") == NULL) {
+	    "mdsort-stdin") == NULL) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		return 1;
 	}
-	if (mkdtemp(md->md_root) == NULL) {
-		warn("mkdtemp");
+	md->md_subdir = SUBDIR_NEW;
+	(void)maildir_set_path(md);
+	if (genname(md->md_stdin.name, sizeof(md->md_stdin.name), NULL,
+	    arc4random() % 128 + 1, env))
 		return 1;
-	}
 
-	path = maildir_set_path(md);
-	if (mkdir(path, S_IRUSR | S_IWUSR | S_IXUSR) == -1) {
-		warn("mkdir");
+	bf = arena_buffer_read_fd(s, STDIN_FILENO);
+	if (bf == NULL) {
+		warn("read");
 		return 1;
 	}
-	if (maildir_opendir(md, path))
-		return 1;
-
-	/*
-	 * No need to remove the created file in case of an error since
-	 * maildir_close() removes the complete temporary directory.
-	 */
-	fd = maildir_genname(md, NULL, name, sizeof(name), env);
-	if (fd == -1)
-		return 1;
+	md->md_stdin.len = buffer_get_len(bf);
+	md->md_stdin.buf = buffer_str(bf);
+	return 0;
+}
 
-	for (;;) {
-		nr = read(STDIN_FILENO, buf, sizeof(buf));
-		if (nr == -1) {
-			warn("read");
-			error = 1;
-			goto out;
-		}
-		if (nr == 0)
-			break;
+static int
+maildir_read(struct maildir *md, struct maildir_entry *me)
+{
+	const struct maildir_dirent *ent;
 
-		nw = write(fd, buf, (size_t)nr);
-		if (nw == -1) {
-			warn("write: %s/%s", path, name);
-			error = 1;
-			goto out;
-		}
-	}
+	if (FAULT("maildir_read"))
+		return -1;
 
-	if (fsync(fd) == -1) {
-		warn("fsync");
-		error = 1;
-	}
+	while (md->md_next == md->md_nents) {
+		int r;
 
-out:
-	/* Don't ignore potential EIO errors. */
-	if (close(fd) == -1) {
-		warn("close");
-		error = 1;
+		r = maildir_fill(md);
+		if (r <= 0)
+			return r;
 	}
 
-	/*
-	 * Rewind ensuring the newly written file to be observed during
-	 * maildir_walk().
-	 */
-	rewinddir(md->md_dir);
-
-	return error;
+	ent = &md->md_ents[md->md_next];
+	log_debug("%s: %s/%s\n", __func__, md->md_path, ent->name);
+	me->dir = md->md_path;
+	me->dirfd = maildir_fd(md);
+	me->path = ent->name;
+	me->buf = NULL;
+	me->buflen = 0;
+	me->st = ent->stat ? &md->md_sts[md->md_next] : NULL;
+	md->md_next++;
+	return 1;
 }
 
+/*
+ * Read the next batch of entries from the current directory. All entries
+ * except regular files are discarded. The remaining entries are sorted by
+ * inode number as traversing the files in the same order as they are laid out
+ * on disk favors sequential access over random access, in particular with a
+ * cold cache. Returns 1 if a batch was read, note that the batch could be
+ * empty if all entries were discarded. Returns 0 if the end of directory is
+ * reached and -1 on error.
+ */
 static int
-maildir_read(struct maildir *md, struct maildir_entry *me)
+maildir_fill(struct maildir *md)
 {
-	const struct dirent *ent;
-	unsigned int type;
+	struct timespec end;
+	ssize_t nr;
+	size_t i, n;
 
-	if (FAULT("maildir_read"))
+	md->md_nents = 0;
+	md->md_next = 0;
+
+	nr = maildir_getdents(md);
+	if (nr == -1)
 		return -1;
+	if (nr == 0) {
+		long long ns;
+
+		(void)clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (end.tv_sec - md->md_start.tv_sec) * 1000000000LL +
+		    (end.tv_nsec - md->md_start.tv_nsec);
+		log_debug("%s: %s: entries=%zu, entries/s=%lld\n", __func__,
+		    md->md_path, md->md_total,
+		    ns > 0 ? (long long)md->md_total * 1000000000LL / ns : 0);
+		return 0;
+	}
+	md->md_total += (size_t)nr;
 
-	for (;;) {
-		/*
-		 * Necessary to reset errno in order to distinguish between
-		 * reaching end of directory and errors.
-		 */
-		errno = 0;
-		ent = readdir(md->md_dir);
-		if (ent == NULL) {
-			if (errno) {
-				warn("readdir: %s", md->md_path);
-				return -1;
-			}
-			return 0;
-		}
+	if (FAULT("readdir_type")) {
+		for (i = 0; i < (size_t)nr; i++)
+			md->md_ents[i].type = DT_UNKNOWN;
+	}
+
+	qsort(md->md_ents, (size_t)nr, sizeof(*md->md_ents), direntcmp);
 
-		type = ent->d_type;
-		if (FAULT("readdir_type"))
-			type = DT_UNKNOWN;
+	for (i = 0, n = 0; i < (size_t)nr; i++) {
+		struct maildir_dirent *ent = &md->md_ents[i];
 
-		switch (type) {
+		ent->stat = 0;
+		switch (ent->type) {
 		case DT_UNKNOWN:
 			/*
 			 * Some filesystems like XFS does not return the file
-			 * type and stat(2) must instead be used.
+			 * type and stat(2) must instead be used. Done in inode
+			 * order as well, favoring locality of the inode table.
+			 * The file status is kept as the message would
+			 * otherwise be resolved again.
 			 */
-			if (!isfile(maildir_fd(md), ent->d_name))
+			if (!isfile(maildir_fd(md), ent->name, &md->md_sts[n]))
 				goto unknown;
+			ent->stat = 1;
 			break;
 		case DT_DIR:
 			continue;
@@ -526,44 +1145,318 @@ maildir_read(struct maildir *md, struct maildir_entry *me)
 		default:
 unknown:
 			log_debug("%s: %s/%s: unknown file type %u\n",
-			    __func__, md->md_path, ent->d_name, type);
+			    __func__, md->md_path, ent->name, ent->type);
 			continue;
 		}
 
-		log_debug("%s: %s/%s\n", __func__, md->md_path, ent->d_name);
-		me->dir = md->md_path;
-		me->dirfd = maildir_fd(md);
-		me->path = ent->d_name;
-		return 1;
+		md->md_ents[n++] = *ent;
+	}
+	md->md_nents = n;
+
+	return 1;
+}
+
+#ifdef HAVE_GETDENTS64
+
+/*
+ * Read as many entries as the buffer can hold using a single system call.
+ */
+static ssize_t
+maildir_getdents(struct maildir *md)
+{
+	ssize_t i, nr;
+	size_t n = 0;
+
+	nr = getdents64(maildir_fd(md), md->md_buf, DIRENT_BUFSIZ);
+	if (nr == -1) {
+		warn("getdents64: %s", md->md_path);
+		return -1;
+	}
+
+	for (i = 0; i < nr;) {
+		const struct dirent64 *ent =
+		    (const struct dirent64 *)&md->md_buf[i];
+
+		md->md_ents[n++] = (struct maildir_dirent){
+			.name	= ent->d_name,
+			.ino	= ent->d_ino,
+			.type	= ent->d_type,
+		};
+		i += ent->d_reclen;
 	}
+
+	return (ssize_t)n;
 }
 
+#else
+
+/*
+ * Read as many entries as the buffer can hold, emulating getdents64 by copying
+ * the names returned by readdir(3).
+ */
+static ssize_t
+maildir_getdents(struct maildir *md)
+{
+	size_t len = 0;
+	size_t n = 0;
+
+	while (n < DIRENT_MAX) {
+		const struct dirent *ent;
+		size_t namelen;
+
+		/*
+		 * Necessary to reset errno in order to distinguish between
+		 * reaching end of directory and errors.
+		 */
+		errno = 0;
+		ent = readdir(md->md_dir);
+		if (ent == NULL) {
+			if (errno) {
+				warn("readdir: %s", md->md_path);
+				return -1;
+			}
+			break;
+		}
+
+		namelen = strlen(ent->d_name) + 1;
+		memcpy(&md->md_buf[len], ent->d_name, namelen);
+		md->md_ents[n++] = (struct maildir_dirent){
+			.name	= &md->md_buf[len],
+			.ino	= ent->d_ino,
+			.type	= ent->d_type,
+		};
+		len += namelen;
+
+		/* Ensure room for the longest possible name. */
+		if (DIRENT_BUFSIZ - len < NAME_MAX + 1)
+			break;
+	}
+
+	return (ssize_t)n;
+}
+
+#endif
+
+/*
+ * Rename the message in src to a new unique name in dst. Returns zero on
+ * success. Otherwise, non-zero is returned and errno is set, where EXDEV is
+ * silenced as the caller is expected to recover.
+ */
 static int
 maildir_rename(const struct maildir *src, const struct maildir *dst,
-    const char *srcname, const char *dstname)
+    const char *srcname, const char *flags, char *buf, size_t bufsiz,
+    const struct environment *env)
 {
+	int fd, save_errno;
+
 	if (FAULT("maildir_rename"))
 		return 1;
 
-	if (renameat(maildir_fd(src), srcname,
-	    maildir_fd(dst), dstname) == -1) {
-		/* Silence as we're about to recover. */
-		if (errno != EXDEV)
-			warn("renameat");
+#ifdef HAVE_RENAMEAT2
+	{
+		unsigned int count;
+
+		count = arc4random() % 128;
+		for (;;) {
+			count++;
+			if (genname(buf, bufsiz, flags, count, env))
+				return 1;
+			if (renameat2(maildir_fd(src), srcname, maildir_fd(dst),
+			    buf, RENAME_NOREPLACE) == 0)
+				return 0;
+			if (errno == EEXIST) {
+				log_debug("%s: %s: file exists\n",
+				    __func__, buf);
+				continue;
+			}
+			break;
+		}
+		/* Not supported by the file system, see below. */
+		if (errno != EINVAL && errno != ENOSYS)
+			goto err;
+	}
+#endif
+
+	/*
+	 * Reserve the destination name by creating a file, which is replaced
+	 * by the rename.
+	 */
+	fd = maildir_genname(dst, flags, buf, bufsiz, env);
+	if (fd == -1)
+		return 1;
+	close(fd);
+	if (renameat(maildir_fd(src), srcname, maildir_fd(dst), buf) == 0)
+		return 0;
+	save_errno = errno;
+	(void)unlinkat(maildir_fd(dst), buf, 0);
+	errno = save_errno;
+
+err:
+	/* Silence as we're about to recover. */
+	if (errno != EXDEV)
+		warn("renameat");
+	return 1;
+}
+
+static int
+queue_genname(struct maildir_queue_entry *e, const struct environment *env)
+{
+	e->count++;
+	if (genname(e->dstname, sizeof(e->dstname), e->flags, e->count, env))
+		return 1;
+	if (pathjoin(e->dst, sizeof(e->dst), e->dstdir, e->dstname) == NULL) {
+		warnc(ENAMETOOLONG, "%s", __func__);
 		return 1;
 	}
 	return 0;
 }
 
+/*
+ * Finish a queued move, the outcome of the renameat operation is stored in the
+ * entry.
+ */
 static int
-isfile(int dirfd, const char *path)
+queue_move(struct maildir_queue_entry *e, const struct environment *env)
 {
+	struct timespec times[2] = {
+		{ 0,	UTIME_OMIT },
+		{ 0,	0 }
+	};
 	struct stat sb;
+	int doutime = 0;
+	int error = 0;
+	int fd;
+
+	if (e->res == 0)
+		goto out;
+	if (e->res != -EEXIST && e->res != -EINVAL && e->res != -EXDEV) {
+		/* Fault already reported. */
+		if (e->slot != -1) {
+			errno = -e->res;
+			warn("renameat");
+		}
+		return 1;
+	}
 
+	/*
+	 * Either the name is already taken, renaming without replacing is not
+	 * supported by the file system or source and destination reside on
+	 * different file systems. All cases are handled synchronously by
+	 * reserving the destination name by creating a file.
+	 */
+	fd = queue_open(e, env);
+	if (fd == -1)
+		return 1;
+	if (e->res != -EXDEV) {
+		e->res = 0;
+		if (rename(e->src, e->dst) == -1) {
+			e->res = -errno;
+			if (errno != EXDEV) {
+				warn("rename");
+				error = 1;
+			}
+		}
+	}
+	if (e->res == -EXDEV) {
+		/*
+		 * Fallback to writing a new message while preserving the
+		 * modification time.
+		 */
+		if (message_stat(e->msg, &sb) == 0) {
+			times[1] = sb.st_mtim;
+			doutime = 1;
+		}
+		error = message_write(e->msg, fd);
+		if (!error)
+			error = unlinksuperseded(e->src);
+	}
+	/*
+	 * Try to reduce side effects by removing the new message in
+	 * case of failure(s).
+	 */
+	if (error)
+		(void)unlinkpath(e->dst);
+	close(fd);
+
+	if (!error && doutime &&
+	    utimensat(AT_FDCWD, e->dst, times, 0) == -1) {
+		warn("utimensat");
+		error = 1;
+	}
+
+out:
+	if (!error)
+		error = sync_dir(e->srcdir);
+	if (!error)
+		error = sync_dir(e->dstdir);
+
+	if (!error)
+		error = message_set_file(e->msg, e->dstdir, e->dstname, -1);
+
+	return error;
+}
+
+/*
+ * Create the destination file of the given queued move. On collision, a new
+ * name is generated. Returns a write-only file descriptor on success, -1
+ * otherwise.
+ */
+static int
+queue_open(struct maildir_queue_entry *e, const struct environment *env)
+{
+	for (;;) {
+		int fd;
+
+		fd = open(e->dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		    S_IRUSR | S_IWUSR);
+		if (fd != -1)
+			return fd;
+		if (errno != EEXIST) {
+			warn("open: %s", e->dst);
+			return -1;
+		}
+		log_debug("%s: %s: file exists\n", __func__, e->dst);
+		if (queue_genname(e, env))
+			return -1;
+	}
+}
+
+static int
+direntcmp(const void *p1, const void *p2)
+{
+	const struct maildir_dirent *d1 = p1;
+	const struct maildir_dirent *d2 = p2;
+
+	if (d1->ino < d2->ino)
+		return -1;
+	if (d1->ino > d2->ino)
+		return 1;
+	return 0;
+}
+
+static int
+genname(char *buf, size_t bufsiz, const char *flags, unsigned int count,
+    const struct environment *env)
+{
+	int n;
+
+	n = snprintf(buf, bufsiz, "%lld.%d_%u.%s%s",
+	    (long long)env->ev_now, env->ev_pid, count, env->ev_hostname,
+	    flags ? flags : "");
+	if (n < 0 || (size_t)n >= bufsiz) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+isfile(int dirfd, const char *path, struct stat *sb)
+{
 	/* Best effort, ignore errors. */
-	if (fstatat(dirfd, path, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+	if (fstatat(dirfd, path, sb, AT_SYMLINK_NOFOLLOW) == -1)
 		return 0;
-	return S_ISREG(sb.st_mode);
+	return S_ISREG(sb->st_mode);
 }
 
 static int
@@ -600,3 +1493,29 @@ parsesubdir(const char *path, enum subdir *subdir)
 	warnx("%s: %s: subdir not found", __func__, path);
 	return 1;
 }
+
+static int
+unlinkpath(const char *path)
+{
+	if (FAULT("maildir_unlink"))
+		return 1;
+
+	if (unlinkat(AT_FDCWD, path, 0) == -1) {
+		warn("unlinkat: %s", path);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Remove the path of a message superseded by a newly written message, which
+ * might only be removed once the new message is durable. Returns zero on
+ * success, non-zero otherwise.
+ */
+static int
+unlinksuperseded(const char *path)
+{
+	if (FAULT("maildir_unlink"))
+		return 1;
+	return sync_unlink(path);
+}
@@ -1,6 +1,9 @@
+#include <stddef.h>	/* size_t */
+
 struct arena_scope;
 struct environment;
 struct message;
+struct stat;
 
 /* Flags passed to maildir_open(). */
 #define MAILDIR_WALK	0x00000001u
@@ -9,6 +12,9 @@ struct message;
 struct maildir_entry {
 	const char	*dir;
 	const char	*path;
+	const char	*buf;		/* message contents, if read from stdin */
+	size_t		 buflen;
+	const struct stat *st;		/* file status, NULL if not resolved */
 	int		 dirfd;
 };
 
@@ -16,11 +22,30 @@ struct maildir	*maildir_open(const char *, unsigned int,
     const struct environment *, struct arena_scope *);
 void		 maildir_close(struct maildir *);
 
+struct maildir_cache	*maildir_cache_alloc(struct arena_scope *);
+void			 maildir_cache_free(struct maildir_cache *);
+struct maildir		*maildir_cache_open(struct maildir_cache *,
+    const char *);
+
+struct maildir_queue	*maildir_queue_alloc(struct arena_scope *);
+void			 maildir_queue_free(struct maildir_queue *);
+size_t			 maildir_queue_size(const struct maildir_queue *);
+int			 maildir_queue_move(struct maildir_queue *,
+    const struct maildir *, const struct maildir *, struct message *,
+    const struct environment *);
+int			 maildir_queue_unlink(struct maildir_queue *,
+    const struct maildir *, const char *, const struct environment *);
+int			 maildir_queue_flush(struct maildir_queue *,
+    const struct environment *);
+
 int	maildir_walk(struct maildir *, struct maildir_entry *);
+int	maildir_lookup(struct maildir *, const char *, struct maildir_entry *);
+int	maildir_isown(const char *, const struct environment *);
+int	maildir_canmove(const struct maildir *, const char *);
 int	maildir_move(const struct maildir *, const struct maildir *,
     struct message *, const struct environment *);
 int	maildir_unlink(const struct maildir *, const char *);
-int	maildir_write(struct maildir *, struct message *,
-    const struct environment *);
+int	maildir_write(const struct maildir *, const struct maildir *,
+    struct message *, const struct environment *);
 
 int	maildir_cmp(const struct maildir *, const struct maildir *);
@@ -3,12 +3,13 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
-#include <limits.h>	/* INT_MAX */
+#include <limits.h>	/* INT_MAX, NAME_MAX, PATH_MAX */
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "libks/arena-buffer.h"
+#include "libks/arena-vector.h"
 #include "libks/arena.h"
 #include "libks/buffer.h"
 #include "libks/list.h"
@@ -29,17 +30,29 @@ struct backref {
 
 static void	matches_merge(struct match_list *, struct match *);
 
-static const char	*match_backref(const struct match *,
-    const struct backref *);
+static const char	*match_backref(const struct match_list *,
+    const struct match *, const struct backref *);
 
-static const char	*interpolate(const struct match *,
-    const struct macro_list *, struct arena *, const char *,
-    struct arena_scope *);
-static const char	*interpolate_with_scratch_scope(const struct match *,
+static const char	*interpolate(const struct match_list *,
+    const struct match *, const struct macro_list *, struct arena *,
+    const char *, struct arena_scope *);
+static const char	*interpolate_with_scratch_scope(
+    const struct match_list *, const struct match *,
     const struct macro_list *, const char *, struct arena_scope *,
     struct arena_scope *);
 static ssize_t		 isbackref(const char *, struct backref *);
 
+/*
+ * Initialize the given match list, all matches appended to it must be allocated
+ * from the given scope.
+ */
+void
+matches_init(struct match_list *ml, struct arena_scope *s)
+{
+	ARENA_VECTOR_INIT(s, ml->ml_matches, 8);
+	ml->ml_scope = s;
+}
+
 /*
  * Append the given match to the list and construct the maildir destination path
  * if needed.
@@ -47,40 +60,38 @@ static ssize_t		 isbackref(const char *, struct backref *);
 int
 matches_append(struct match_list *ml, struct match *mh)
 {
-	const char *p, *path;
-	size_t siz;
+	char buf[PATH_MAX];
+	const char *path;
 
 	matches_merge(ml, mh);
-	LIST_INSERT_TAIL(ml, mh);
+	*ARENA_VECTOR_ALLOC(ml->ml_matches) = mh;
 
 	if ((mh->mh_expr->ex_flags & EXPR_FLAG_PATH) == 0)
 		return 0;
 
 	path = message_get_path(mh->mh_msg);
-	if (mh->mh_maildir[0] == '\0') {
+	if (mh->mh_maildir == NULL) {
 		/* Infer maildir from message path. */
-		siz = sizeof(mh->mh_maildir);
-		p = pathslice(path, mh->mh_maildir, siz, 0, -2);
-		if (p == NULL) {
+		if (pathslice(path, buf, sizeof(buf), 0, -2) == NULL) {
 			warnx("%s: %s: maildir not found", __func__, path);
 			return 1;
 		}
+		mh->mh_maildir = arena_strdup(ml->ml_scope, buf);
 	}
-	if (mh->mh_subdir[0] == '\0') {
+	if (mh->mh_subdir == NULL) {
 		/* Infer subdir from message path. */
-		siz = sizeof(mh->mh_subdir);
-		p = pathslice(path, mh->mh_subdir, siz, -2, -2);
-		if (p == NULL) {
+		if (pathslice(path, buf, NAME_MAX + 1, -2, -2) == NULL) {
 			warnx("%s: %s: subdir not found", __func__, path);
 			return 1;
 		}
+		mh->mh_subdir = arena_strdup(ml->ml_scope, buf);
 	}
 
-	siz = sizeof(mh->mh_path);
-	if (pathjoin(mh->mh_path, siz, mh->mh_maildir, mh->mh_subdir) == NULL) {
+	if (pathjoin(buf, sizeof(buf), mh->mh_maildir, mh->mh_subdir) == NULL) {
 		warnc(ENAMETOOLONG, "%s", __func__);
 		return 1;
 	}
+	mh->mh_path = arena_strdup(ml->ml_scope, buf);
 
 	return 0;
 }
@@ -88,10 +99,7 @@ matches_append(struct match_list *ml, struct match *mh)
 void
 matches_clear(struct match_list *ml)
 {
-	struct match *mh;
-
-	while ((mh = LIST_FIRST(ml)) != NULL)
-		matches_remove(ml, mh);
+	VECTOR_CLEAR(ml->ml_matches);
 }
 
 int
@@ -100,6 +108,7 @@ matches_interpolate(struct match_list *ml, struct arena_scope *eternal_scope,
 {
 	struct macro_list *macros;
 	struct match *mh;
+	size_t i;
 	int error = 0;
 
 	arena_scope(scratch, s);
@@ -107,10 +116,11 @@ matches_interpolate(struct match_list *ml, struct arena_scope *eternal_scope,
 	macros = macros_alloc(MACRO_CTX_ACTION, &s);
 	/* Construct action macro context. */
 	macros_insertc(macros, "path",
-	    message_get_path(LIST_FIRST(ml)->mh_msg));
+	    message_get_path(ml->ml_matches[0]->mh_msg));
 
-	LIST_FOREACH(mh, ml) {
-		if (match_interpolate(mh, macros, eternal_scope, scratch)) {
+	for (i = 0; i < VECTOR_LENGTH(ml->ml_matches); i++) {
+		mh = ml->ml_matches[i];
+		if (match_interpolate(ml, mh, macros, eternal_scope, scratch)) {
 			error = 1;
 			break;
 		}
@@ -119,22 +129,49 @@ matches_interpolate(struct match_list *ml, struct arena_scope *eternal_scope,
 	return error;
 }
 
+/*
+ * Carry out the actions associated with the given matches. Destination
+ * maildirs are opened using the given cache. The last action, if it's a move
+ * or discard, is added to the given queue as no other action depends on it.
+ * Header modifications are written once, either prior to the first action
+ * observing the message on disk or after all actions.
+ */
 int
 matches_exec(const struct match_list *ml, struct maildir *src,
-    const struct environment *env, struct arena *scratch)
+    struct maildir_cache *mc, struct maildir_queue *mq,
+    const struct environment *env)
 {
 	struct maildir *dst = NULL;
-	struct match *mh;
-	int chsrc = 0;
+	struct message *msg = NULL;
+	size_t i, n;
+	int dirty = 0;
 	int error = 0;
 	int rv = MATCH_EXEC_SUCCESS;
 
-	arena_scope(scratch, s);
-
-	LIST_FOREACH(mh, ml) {
-		struct message *msg = mh->mh_msg;
+	n = VECTOR_LENGTH(ml->ml_matches);
+	for (i = 0; i < n; i++) {
+		const struct match *mh = ml->ml_matches[i];
+		enum expr_type type = mh->mh_expr->ex_type;
+		int last = i + 1 == n;
+
+		msg = mh->mh_msg;
+
+		/*
+		 * Write pending header modifications before any action
+		 * observing the message on disk, which only applies to exec.
+		 * A message about to be removed is never written while a
+		 * message about to be moved is written directly to its
+		 * destination.
+		 */
+		if (dirty && type == EXPR_TYPE_EXEC) {
+			dirty = 0;
+			if (maildir_write(src, src, msg, env)) {
+				error = 1;
+				break;
+			}
+		}
 
-		switch (mh->mh_expr->ex_type) {
+		switch (type) {
 		case EXPR_TYPE_FLAG:
 		case EXPR_TYPE_FLAGS:
 		case EXPR_TYPE_MOVE:
@@ -145,37 +182,52 @@ matches_exec(const struct match_list *ml, struct maildir *src,
 			 * importance if a following action requires a source
 			 * maildir.
 			 */
-			dst = maildir_open(mh->mh_path, 0, env, &s);
+			if (!maildir_canmove(src, mh->mh_path)) {
+				error = 1;
+				break;
+			}
+			dst = maildir_cache_open(mc, mh->mh_path);
 			if (dst == NULL) {
 				error = 1;
 				break;
 			}
 
-			if (maildir_move(src, dst, msg, env)) {
-				maildir_close(dst);
+			if (dirty) {
+				dirty = 0;
+				if (maildir_write(src, dst, msg, env)) {
+					error = 1;
+					break;
+				}
+			} else if (last) {
+				if (maildir_queue_move(mq, src, dst, msg, env))
+					error = 1;
+				break;
+			} else if (maildir_move(src, dst, msg, env)) {
 				error = 1;
 				break;
 			}
 
-			if (maildir_cmp(src, dst)) {
-				if (chsrc)
-					maildir_close(src);
-				chsrc = 1;
+			if (maildir_cmp(src, dst))
 				src = dst;
-			} else {
-				maildir_close(dst);
-			}
 			break;
 
 		case EXPR_TYPE_DISCARD:
+			/* Pending header modifications are irrelevant. */
+			dirty = 0;
+			if (last) {
+				if (maildir_queue_unlink(mq, src,
+				    message_get_name(msg), env))
+					error = 1;
+				break;
+			}
 			if (maildir_unlink(src, message_get_name(msg)))
 				error = 1;
 			break;
 
 		case EXPR_TYPE_LABEL:
 		case EXPR_TYPE_ADD_HEADER:
-			if (maildir_write(src, msg, env))
-				error = 1;
+			/* Headers already modified, see match_interpolate(). */
+			dirty = 1;
 			break;
 
 		case EXPR_TYPE_REJECT:
@@ -186,6 +238,11 @@ matches_exec(const struct match_list *ml, struct maildir *src,
 			unsigned int flags = mh->mh_expr->ex_exec.flags;
 			int fd = -1;
 
+			/* Let the command observe all preceding actions. */
+			if (maildir_queue_flush(mq, env)) {
+				error = 1;
+				break;
+			}
 			if (flags & EXPR_EXEC_STDIN) {
 				fd = message_get_fd(msg,
 				    flags & EXPR_EXEC_BODY);
@@ -213,9 +270,8 @@ matches_exec(const struct match_list *ml, struct maildir *src,
 		if (error)
 			break;
 	}
-
-	if (chsrc)
-		maildir_close(src);
+	if (!error && dirty && maildir_write(src, src, msg, env))
+		error = 1;
 
 	return error ? MATCH_EXEC_ERROR : rv;
 }
@@ -224,18 +280,18 @@ int
 matches_inspect(const struct match_list *ml, const struct environment *env,
     struct arena *scratch)
 {
-	const struct match *lhs, *mh;
 	const struct message *msg;
+	size_t i;
+	size_t j = 0;
 	int dryrun = env->ev_options & OPTION_DRYRUN;
 
 	arena_scope(scratch, s);
 
-	lhs = LIST_FIRST(ml);
-	msg = LIST_FIRST(ml)->mh_msg;
+	msg = ml->ml_matches[0]->mh_msg;
 
-	LIST_FOREACH(mh, ml) {
+	for (i = 0; i < VECTOR_LENGTH(ml->ml_matches); i++) {
+		const struct match *mh = ml->ml_matches[i];
 		const struct expr *ex = mh->mh_expr;
-		const struct match *rhs;
 		const char *path;
 
 		if ((ex->ex_flags & EXPR_FLAG_ACTION) == 0)
@@ -250,14 +306,11 @@ matches_inspect(const struct match_list *ml, const struct environment *env,
 			continue;
 
 		/* Handle all matches leading up to this action. */
-		rhs = lhs;
-		for (;;) {
-			if (rhs == mh)
-				break;
+		for (; j < i; j++) {
+			const struct match *rhs = ml->ml_matches[j];
+
 			expr_inspect_matches(rhs->mh_expr, rhs, env);
-			rhs = LIST_NEXT(rhs);
 		}
-		lhs = rhs;
 	}
 
 	return dryrun;
@@ -266,10 +319,12 @@ matches_inspect(const struct match_list *ml, const struct environment *env,
 struct match *
 matches_find(struct match_list *ml, int type)
 {
-	struct match *mh;
 	enum expr_type expr_type = (enum expr_type)type;
+	size_t i;
+
+	for (i = 0; i < VECTOR_LENGTH(ml->ml_matches); i++) {
+		struct match *mh = ml->ml_matches[i];
 
-	LIST_FOREACH(mh, ml) {
 		if (mh->mh_expr->ex_type == expr_type)
 			return mh;
 	}
@@ -277,11 +332,30 @@ matches_find(struct match_list *ml, int type)
 	return NULL;
 }
 
+struct match *
+matches_last(const struct match_list *ml)
+{
+	if (VECTOR_EMPTY(ml->ml_matches))
+		return NULL;
+	return *VECTOR_LAST(ml->ml_matches);
+}
+
 void
 matches_remove(struct match_list *ml, struct match *mh)
 {
-	/* NOLINTNEXTLINE(clang-analyzer-core.NullDereference) */
-	LIST_REMOVE(ml, mh);
+	size_t i, n;
+
+	/* Favor the end of the list as the latest match is usually removed. */
+	n = VECTOR_LENGTH(ml->ml_matches);
+	for (i = n; i > 0; i--) {
+		if (ml->ml_matches[i - 1] != mh)
+			continue;
+
+		memmove(&ml->ml_matches[i - 1], &ml->ml_matches[i],
+		    (n - i) * sizeof(*ml->ml_matches));
+		(void)VECTOR_POP(ml->ml_matches);
+		break;
+	}
 }
 
 /*
@@ -291,18 +365,23 @@ matches_remove(struct match_list *ml, struct match *mh)
 int
 matches_remove_by_type(struct match_list *ml, int type)
 {
-	struct match *mh, *tmp;
 	enum expr_type expr_type = (enum expr_type)type;
+	size_t i;
+	size_t j = 0;
 	int n = 0;
 
-	LIST_FOREACH_SAFE(mh, ml, tmp) {
+	for (i = 0; i < VECTOR_LENGTH(ml->ml_matches); i++) {
+		struct match *mh = ml->ml_matches[i];
 		const struct expr *ex = mh->mh_expr;
 
 		if (ex->ex_type == expr_type)
-			matches_remove(ml, mh);
-		else if (ex->ex_flags & EXPR_FLAG_ACTION)
+			continue;
+		if (ex->ex_flags & EXPR_FLAG_ACTION)
 			n++;
+		ml->ml_matches[j++] = mh;
 	}
+	while (VECTOR_LENGTH(ml->ml_matches) > j)
+		(void)VECTOR_POP(ml->ml_matches);
 
 	return n;
 }
@@ -312,8 +391,8 @@ matches_remove_until(struct match_list *ml, const struct match *stop)
 {
 	struct match *mh;
 
-	while ((mh = LIST_LAST(ml)) != NULL && mh != stop)
-		matches_remove(ml, mh);
+	while ((mh = matches_last(ml)) != NULL && mh != stop)
+		(void)VECTOR_POP(ml->ml_matches);
 }
 
 struct match *
@@ -328,8 +407,9 @@ match_alloc(const struct expr *ex, struct message *msg, struct arena_scope *s)
 }
 
 int
-match_interpolate(struct match *mh, const struct macro_list *macros,
-    struct arena_scope *eternal_scope, struct arena *scratch)
+match_interpolate(const struct match_list *ml, struct match *mh,
+    const struct macro_list *macros, struct arena_scope *eternal_scope,
+    struct arena *scratch)
 {
 	struct message *msg = mh->mh_msg;
 
@@ -337,18 +417,16 @@ match_interpolate(struct match *mh, const struct macro_list *macros,
 	case EXPR_TYPE_STAT:
 	case EXPR_TYPE_MOVE: {
 		const char *path;
-		size_t n, siz;
 
-		path = interpolate(mh, macros, scratch, mh->mh_path,
+		path = interpolate(ml, mh, macros, scratch, mh->mh_path,
 		    eternal_scope);
 		if (path == NULL)
 			return 1;
-		siz = sizeof(mh->mh_path);
-		n = strlcpy(mh->mh_path, path, siz);
-		if (n >= siz) {
+		if (strlen(path) >= PATH_MAX) {
 			warnc(ENAMETOOLONG, "%s", __func__);
 			return 1;
 		}
+		mh->mh_path = arena_strdup(eternal_scope, path);
 		break;
 	}
 
@@ -378,7 +456,7 @@ match_interpolate(struct match *mh, const struct macro_list *macros,
 			buffer_printf(bf, "%s", str->val);
 		}
 		buf = buffer_str(bf);
-		label = interpolate_with_scratch_scope(mh, macros, buf,
+		label = interpolate_with_scratch_scope(ml, mh, macros, buf,
 		    eternal_scope, &scratch_scope);
 		if (label == NULL)
 			return 1;
@@ -400,7 +478,7 @@ match_interpolate(struct match *mh, const struct macro_list *macros,
 		LIST_FOREACH(str, mh->mh_expr->ex_strings) {
 			const char *arg;
 
-			arg = interpolate(mh, macros, scratch, str->val,
+			arg = interpolate(ml, mh, macros, scratch, str->val,
 			    eternal_scope);
 			if (arg == NULL)
 				return 1;
@@ -413,8 +491,8 @@ match_interpolate(struct match *mh, const struct macro_list *macros,
 		const struct expr *ex = mh->mh_expr;
 		const char *val;
 
-		val = interpolate(mh, macros, scratch, ex->ex_add_header.val,
-		    eternal_scope);
+		val = interpolate(ml, mh, macros, scratch,
+		    ex->ex_add_header.val, eternal_scope);
 		if (val == NULL)
 			return 1;
 		message_set_header(msg, ex->ex_add_header.key, val);
@@ -459,7 +537,7 @@ matches_merge(struct match_list *ml, struct match *mh)
 	 * Merge consecutive flag and move actions, the last action dictates the
 	 * destination maildir anyway.
 	 */
-	dup = LIST_LAST(ml);
+	dup = matches_last(ml);
 	if (dup != NULL && dup->mh_expr->ex_type == ex->ex_type) {
 		matches_remove(ml, dup);
 		return;
@@ -476,37 +554,43 @@ matches_merge(struct match_list *ml, struct match *mh)
 
 	if (ex->ex_type == EXPR_TYPE_MOVE) {
 		/* Copy subdir from flag action. */
-		(void)strlcpy(mh->mh_subdir, dup->mh_subdir,
-		    sizeof(mh->mh_subdir));
+		mh->mh_subdir = dup->mh_subdir;
 	} else {
 		/* Copy maildir from move action. */
-		(void)strlcpy(mh->mh_maildir, dup->mh_maildir,
-		    sizeof(mh->mh_maildir));
+		mh->mh_maildir = dup->mh_maildir;
 	}
 
 	matches_remove(ml, dup);
 }
 
 static const char *
-match_backref(const struct match *mh, const struct backref *br)
+match_backref(const struct match_list *ml, const struct match *mh,
+    const struct backref *br)
 {
-	const struct match *tmp = mh;
 	const struct match *mi = NULL;
+	size_t beg, end;
 	unsigned int i = 0;
 
+	for (end = VECTOR_LENGTH(ml->ml_matches); end > 0; end--) {
+		if (ml->ml_matches[end - 1] == mh)
+			break;
+	}
+	if (end == 0)
+		return NULL;
+	end--;
+
 	/* Go backwards to the start of the given match. */
-	for (;;) {
-		tmp = LIST_PREV(tmp);
-		if (tmp == NULL)
-			return NULL;
-		if (tmp->mh_expr->ex_type == EXPR_TYPE_MATCH)
+	for (beg = end; beg > 0; beg--) {
+		if (ml->ml_matches[beg - 1]->mh_expr->ex_type ==
+		    EXPR_TYPE_MATCH)
 			break;
 	}
+	if (beg == 0)
+		return NULL;
+
+	for (; beg < end; beg++) {
+		const struct match *tmp = ml->ml_matches[beg];
 
-	for (;;) {
-		tmp = LIST_NEXT(tmp);
-		if (tmp == NULL || tmp == mh)
-			return NULL;
 		if ((tmp->mh_expr->ex_flags & EXPR_FLAG_INTERPOLATE) &&
 		    i++ == br->br_mi) {
 			mi = tmp;
@@ -554,17 +638,18 @@ isbackref(const char *str, struct backref *br)
 }
 
 static const char *
-interpolate(const struct match *mh, const struct macro_list *macros,
-    struct arena *scratch, const char *str, struct arena_scope *eternal_scope)
+interpolate(const struct match_list *ml, const struct match *mh,
+    const struct macro_list *macros, struct arena *scratch, const char *str,
+    struct arena_scope *eternal_scope)
 {
 	arena_scope(scratch, scratch_scope);
-	return interpolate_with_scratch_scope(mh, macros, str, eternal_scope,
-	    &scratch_scope);
+	return interpolate_with_scratch_scope(ml, mh, macros, str,
+	    eternal_scope, &scratch_scope);
 }
 
 static const char *
-interpolate_with_scratch_scope(const struct match *mh,
-    const struct macro_list *macros, const char *str,
+interpolate_with_scratch_scope(const struct match_list *ml,
+    const struct match *mh, const struct macro_list *macros, const char *str,
     struct arena_scope *eternal_scope, struct arena_scope *scratch_scope)
 {
 	struct buffer *bf;
@@ -582,7 +667,7 @@ interpolate_with_scratch_scope(const struct match *mh,
 		if (n < 0)
 			goto brerr;
 		if (n > 0) {
-			sub = match_backref(mh, &br);
+			sub = match_backref(ml, mh, &br);
 			if (sub == NULL)
 				goto brerr;
 
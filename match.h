@@ -1,12 +1,13 @@
-#include <limits.h>
 #include <stddef.h>	/* size_t */
-#include "libks/list.h"
+#include "libks/vector.h"
 
 struct arena;
 struct arena_scope;
 struct environment;
 struct macro_list;
 struct maildir;
+struct maildir_cache;
+struct maildir_queue;
 
 /* Return values for matches_exec(). */
 enum {
@@ -15,12 +16,16 @@ enum {
 	MATCH_EXEC_ERROR,
 };
 
-LIST(match_list, match);
+struct match_list {
+	VECTOR(struct match *)	 ml_matches;
+	struct arena_scope	*ml_scope;
+};
 
 struct match {
-	char			  mh_path[PATH_MAX];
-	char			  mh_maildir[PATH_MAX];
-	char			  mh_subdir[NAME_MAX + 1];
+	/* Destination paths, NULL if not applicable. */
+	char			 *mh_path;
+	char			 *mh_maildir;
+	char			 *mh_subdir;
 
 	const struct expr	 *mh_expr;
 	struct message		 *mh_msg;
@@ -37,25 +42,26 @@ struct match {
 
 	char			 *mh_key;
 	char			 *mh_val;
-
-	LIST_ENTRY(match_list, match);
 };
 
+void	matches_init(struct match_list *, struct arena_scope *);
 int	matches_append(struct match_list *, struct match *);
 void	matches_clear(struct match_list *);
 int	matches_interpolate(struct match_list *, struct arena_scope *,
     struct arena *);
 int	matches_exec(const struct match_list *, struct maildir *,
-    const struct environment *, struct arena *);
+    struct maildir_cache *, struct maildir_queue *,
+    const struct environment *);
 int	matches_inspect(const struct match_list *, const struct environment *,
     struct arena *);
 
 struct match	*match_alloc(const struct expr *, struct message *,
     struct arena_scope *);
 
-int		 match_interpolate(struct match *, const struct macro_list *,
-    struct arena_scope *, struct arena *);
+int		 match_interpolate(const struct match_list *, struct match *,
+    const struct macro_list *, struct arena_scope *, struct arena *);
 struct match	*matches_find(struct match_list *, int);
+struct match	*matches_last(const struct match_list *);
 void		 matches_remove(struct match_list *, struct match *);
 int		 matches_remove_by_type(struct match_list *, int);
 void		 matches_remove_until(struct match_list *,
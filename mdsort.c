@@ -1,18 +1,23 @@
 #include "config.h"
+#include <sys/stat.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>	/* PATH_MAX */
 #include <locale.h>
 #include <paths.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include "libks/arena-vector.h"
 #include "libks/arena.h"
 #include "libks/list.h"
 #include "libks/vector.h"
+#include "cache.h"
 #include "conf.h"
 #include "environment.h"
 #include "expr.h"
@@ -23,7 +28,10 @@
 #include "match.h"
 #include "message.h"
 #include "string-list.h"
+#include "sync.h"
 #include "util.h"
+#include "watch.h"
+#include "worker.h"
 
 /*
  * When reading messages from stdin and an error occurred, always exit with
@@ -40,16 +48,132 @@
  */
 #define EX_PERMFAIL	1
 
+/*
+ * Number of messages per worker in each batch. Bounded as all messages in a
+ * batch are kept in memory until the batch is executed.
+ */
+#define JOB_BATCH	4
+
+/*
+ * Number of milliseconds to wait for additional events before evaluating the
+ * messages that appeared while watching maildirs, coalescing bursts of
+ * deliveries into batches.
+ */
+#define WATCH_DEBOUNCE	50
+
+/*
+ * Upper bound for the number of events coalesced before evaluating the
+ * associated messages.
+ */
+#define WATCH_EVENTS	1024
+
+/*
+ * Number of milliseconds between checking if the configuration file has been
+ * modified while watching maildirs.
+ */
+#define WATCH_INTERVAL	1000
+
+/*
+ * A message evaluated by one of the workers. Any side effects caused by the
+ * matched actions are carried out by the main thread, in traversal order.
+ */
+struct job {
+	struct maildir_entry		 jb_me;
+	struct maildir			*jb_md;
+	struct expr			*jb_expr;
+	uint64_t			 jb_exprhash;	/* zero if not cacheable */
+	unsigned int			 jb_msgflags;	/* message_parse() flags */
+	const struct environment	*jb_env;
+	struct message			*jb_msg;
+	struct match_list		 jb_matches;
+	struct stat			 jb_st;
+	int				 jb_ev;
+	unsigned int			 jb_flags;
+/* Verdict could be cached. */
+#define JOB_FLAG_CACHE		0x00000001u
+/* Verdict already cached, no need to evaluate. */
+#define JOB_FLAG_CACHED		0x00000002u
+/* File status already resolved. */
+#define JOB_FLAG_STAT		0x00000004u
+};
+
+struct batch {
+	struct worker_pool	*b_pool;
+	struct cache		*b_cache;
+	struct maildir_cache	*b_mdcache;
+	struct maildir_queue	*b_queue;
+	struct job		*b_jobs;
+	size_t			 b_size;	/* capacity of jobs */
+	size_t			 b_len;		/* number of pending jobs */
+	int			 b_reject;
+};
+
+/*
+ * Configuration reloaded while watching maildirs, backed by its own arena.
+ */
+struct reload {
+	struct config_list	 r_cl;
+	struct arena		*r_arena;
+	struct arena_scope	 r_scope;
+};
+
+/*
+ * Configuration block along with properties derived from its expression,
+ * computed once as opposed of once per message.
+ */
+struct block {
+	const struct config	*bl_conf;
+	uint64_t		 bl_exprhash;	/* zero if not cacheable */
+	unsigned int		 bl_msgflags;	/* message_parse() flags */
+};
+
+/* Directory watched for new messages. */
+struct watched {
+	struct block	 wd_block;
+	struct maildir	*wd_md;
+};
+
+static volatile sig_atomic_t	gothup;
+static volatile sig_atomic_t	gotterm;
+
+static int		 config_cacheable(const struct config *);
 static int		 config_has_exec(const struct config_list *,
     const struct environment *);
+static void		 config_log_stats(const struct config_list *);
+static int		 config_mtime(const char *, struct timespec *);
+static int		 config_reload(struct reload *, const char **,
+    const struct environment *, struct arena *);
 static const char	*defaultconf(const char *);
 static int		 maildir_skip(const char *, const struct environment *);
 static void		 readenv(struct environment *);
+static void		 sighandler(int);
 static void		 usage(void) __attribute__((noreturn));
 
-static int	handle_message(struct expr *, struct maildir *,
-    const struct maildir_entry *, int *, const struct environment *,
-    struct arena *, struct arena *);
+static void	block_init(struct block *, const struct config *,
+    const struct batch *);
+
+static void	batch_add(struct batch *, const struct block *,
+    struct maildir *, const struct maildir_entry *,
+    const struct environment *, struct arena_scope *);
+static int	batch_exec(struct batch *, const struct environment *,
+    struct arena *);
+
+static int	sweep(struct batch *, const struct config_list *,
+    const struct environment *, struct arena *);
+
+static int	watch(struct batch *, const struct config_list *,
+    const char **, struct environment *, struct arena *);
+static int	watch_config(struct batch *, const struct config_list *,
+    const struct timespec *, struct environment *, struct arena *,
+    struct arena *, int *);
+static int	watch_events(struct batch *, const struct config_list *,
+    struct watch *, struct environment *, struct arena *, struct arena *);
+
+static int	eventcmp(const void *, const void *);
+
+static void	job_eval(void *, struct arena_scope *, struct arena *);
+static int	job_exec(struct job *, struct batch *,
+    const struct environment *, struct arena *);
 
 int
 main(int argc, char *argv[])
@@ -57,12 +181,11 @@ main(int argc, char *argv[])
 	struct arena *eternal, *scratch;
 	struct config_list cl;
 	struct environment env;
-	struct maildir_entry me;
-	struct maildir *md;
-	size_t i;
+	struct batch batch;
+	const char **defines;
+	unsigned int nworkers = 1;
 	int dousage = 0;
 	int error = 0;
-	int reject = 0;
 	int c;
 
 	if (pledge("stdio rpath wpath cpath fattr getpw proc exec", NULL) == -1)
@@ -77,8 +200,11 @@ main(int argc, char *argv[])
 	FAULT_INIT(&eternal_scope);
 	config_list_init(&cl, &eternal_scope);
 	environment_init(&env);
+	memset(&batch, 0, sizeof(batch));
+	/* Macro name and value pairs, needed when reloading. */
+	ARENA_VECTOR_INIT(&eternal_scope, defines, 2);
 
-	while ((c = getopt(argc, argv, "D:df:nv")) != -1) {
+	while ((c = getopt(argc, argv, "D:cdf:j:nvw")) != -1) {
 		switch (c) {
 		case 'D': {
 			char *eq;
@@ -95,20 +221,43 @@ main(int argc, char *argv[])
 				error = 1;
 				goto out;
 			}
+			*ARENA_VECTOR_ALLOC(defines) = optarg;
+			*ARENA_VECTOR_ALLOC(defines) = &eq[1];
 			break;
 		}
+		case 'c':
+			env.ev_options |= OPTION_CACHE;
+			break;
 		case 'd':
 			env.ev_options |= OPTION_DRYRUN;
 			break;
 		case 'f':
 			env.ev_confpath = optarg;
 			break;
+		case 'j': {
+			char *end;
+			long val;
+
+			errno = 0;
+			val = strtol(optarg, &end, 10);
+			if (errno != 0 || *optarg == '\0' || *end != '\0' ||
+			    val < 1 || val > WORKER_MAX) {
+				warnx("invalid jobs: %s", optarg);
+				error = 1;
+				goto out;
+			}
+			nworkers = (unsigned int)val;
+			break;
+		}
 		case 'n':
 			env.ev_options |= OPTION_SYNTAX;
 			break;
 		case 'v':
 			log_level++;
 			break;
+		case 'w':
+			env.ev_options |= OPTION_WATCH;
+			break;
 		default:
 			dousage = 1;
 			goto out;
@@ -125,7 +274,8 @@ main(int argc, char *argv[])
 		argv++;
 		env.ev_options |= OPTION_STDIN;
 	}
-	if (argc > 0) {
+	if (argc > 0 || ((env.ev_options & OPTION_WATCH) &&
+	    (env.ev_options & OPTION_STDIN))) {
 		dousage = 1;
 		goto out;
 	}
@@ -154,48 +304,44 @@ main(int argc, char *argv[])
 	if (env.ev_options & OPTION_SYNTAX)
 		goto out;
 
-	for (i = 0; i < VECTOR_LENGTH(cl.cl_list); i++) {
-		struct config *conf = &cl.cl_list[i];
-		const struct string *str;
-
-		LIST_FOREACH(str, conf->paths) {
-			const char *path = str->val;
-			unsigned int flags;
-
-			if (maildir_skip(path, &env))
-				continue;
-
-			arena_scope(scratch, s);
-
-			flags = MAILDIR_WALK;
-			if (isstdin(path))
-				flags |= MAILDIR_STDIN;
-			md = maildir_open(path, flags, &env, &s);
-			if (md == NULL) {
-				error = 1;
-				continue;
-			}
+	sync_init(cl.cl_sync);
 
-			for (;;) {
-				int w;
+	batch.b_queue = maildir_queue_alloc(&eternal_scope);
+	/*
+	 * Without any additional workers, stick to one message per batch
+	 * causing messages to be evaluated and executed in lockstep. Unless
+	 * actions are queued, the batch must then be large enough to let the
+	 * actions of many messages be carried out together.
+	 */
+	batch.b_size = nworkers > 1 ? nworkers * JOB_BATCH : 1;
+	if (batch.b_size < maildir_queue_size(batch.b_queue))
+		batch.b_size = maildir_queue_size(batch.b_queue);
+	batch.b_jobs = arena_calloc(&eternal_scope, batch.b_size,
+	    sizeof(*batch.b_jobs));
+	batch.b_pool = worker_pool_alloc(nworkers, job_eval, &eternal_scope);
+	batch.b_mdcache = maildir_cache_alloc(&eternal_scope);
 
-				w = maildir_walk(md, &me);
-				if (w == 0)
-					break;
-				if (w == -1) {
-					error = 1;
-					break;
-				}
+	/*
+	 * The cache is only consulted while traversing maildirs and left
+	 * untouched during dry run.
+	 */
+	if ((env.ev_options & OPTION_CACHE) &&
+	    (env.ev_options & (OPTION_DRYRUN | OPTION_STDIN)) == 0)
+		batch.b_cache = cache_open(&env, &eternal_scope);
 
-				if (handle_message(conf->expr, md,
-				    &me, &reject, &env, eternal, scratch))
-					error = 1;
-			}
-			maildir_close(md);
-		}
+	if (env.ev_options & OPTION_WATCH) {
+		if (watch(&batch, &cl, defines, &env, scratch))
+			error = 1;
+	} else if (sweep(&batch, &cl, &env, scratch)) {
+		error = 1;
 	}
+	config_log_stats(&cl);
 
 out:
+	cache_close(batch.b_cache);
+	maildir_queue_free(batch.b_queue);
+	maildir_cache_free(batch.b_mdcache);
+	worker_pool_free(batch.b_pool);
 	arena_free(scratch);
 	arena_free(eternal);
 	FAULT_SHUTDOWN();
@@ -206,7 +352,7 @@ out:
 	if (env.ev_options & OPTION_STDIN) {
 		if (error)
 			return EX_TEMPFAIL;
-		if (reject)
+		if (batch.b_reject)
 			return EX_PERMFAIL;
 	}
 
@@ -216,11 +362,24 @@ out:
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: mdsort [-dnv] [-D macro=value] [-f file] "
-	    "[-]\n");
+	fprintf(stderr, "usage: mdsort [-cdnvw] [-D macro=value] [-f file] "
+	    "[-j jobs] [-]\n");
 	exit(1);
 }
 
+/*
+ * Returns non-zero if the outcome of evaluating the expression associated
+ * with the given configuration only depends on the message itself and can
+ * therefore be cached.
+ */
+static int
+config_cacheable(const struct config *conf)
+{
+	return expr_count(conf->expr, EXPR_TYPE_DATE) == 0 &&
+	    expr_count(conf->expr, EXPR_TYPE_STAT) == 0 &&
+	    expr_count(conf->expr, EXPR_TYPE_COMMAND) == 0;
+}
+
 /*
  * Returns non-zero if any of the expressions associated with the given
  * configuration requires execution of external commands.
@@ -250,6 +409,57 @@ config_has_exec(const struct config_list *cl, const struct environment *env)
 	return (env->ev_options & OPTION_DRYRUN) == 0 && nexec > 0;
 }
 
+static void
+config_log_stats(const struct config_list *cl)
+{
+	size_t i;
+
+	for (i = 0; i < VECTOR_LENGTH(cl->cl_list); i++)
+		expr_log_stats(cl->cl_list[i].expr);
+}
+
+static int
+config_mtime(const char *path, struct timespec *mtime)
+{
+	struct stat sb;
+
+	if (stat(path, &sb) == -1) {
+		log_debug("%s: %s: %s\n", __func__, path, strerror(errno));
+		return 1;
+	}
+	*mtime = sb.st_mtim;
+	return 0;
+}
+
+/*
+ * Parse the configuration file again. On success, the given reload is
+ * populated with the new configuration. Otherwise, the reload is left
+ * untouched.
+ */
+static int
+config_reload(struct reload *r, const char **defines,
+    const struct environment *env, struct arena *scratch)
+{
+	size_t i;
+
+	r->r_arena = arena_alloc("config");
+	r->r_scope = arena_scope_enter(r->r_arena);
+	config_list_init(&r->r_cl, &r->r_scope);
+	for (i = 0; i + 1 < VECTOR_LENGTH(defines); i += 2) {
+		(void)macros_insert(r->r_cl.cl_macros, defines[i],
+		    defines[i + 1], MACRO_FLAG_STICKY, 0);
+	}
+	if (config_list_parse(&r->r_cl, env->ev_confpath, env, scratch,
+	    &r->r_scope)) {
+		arena_scope_leave(&r->r_scope);
+		arena_free(r->r_arena);
+		r->r_arena = NULL;
+		return 1;
+	}
+	log_info("%s: %s\n", __func__, env->ev_confpath);
+	return 0;
+}
+
 static const char *
 defaultconf(const char *home)
 {
@@ -283,6 +493,7 @@ readenv(struct environment *env)
 	const char *p;
 	char *dot;
 	size_t siz;
+	int n;
 
 	if (gethostname(env->ev_hostname, sizeof(env->ev_hostname)) == -1)
 		err(1, "gethostname");
@@ -321,6 +532,15 @@ readenv(struct environment *env)
 			errc(1, ENAMETOOLONG, "%s: TZ", __func__);
 	}
 
+	if ((p = getenv("XDG_CACHE_HOME")) != NULL && *p != '\0')
+		n = snprintf(env->ev_cachedir, sizeof(env->ev_cachedir),
+		    "%s/mdsort", p);
+	else
+		n = snprintf(env->ev_cachedir, sizeof(env->ev_cachedir),
+		    "%s/.cache/mdsort", env->ev_home);
+	if (n < 0 || (size_t)n >= sizeof(env->ev_cachedir))
+		errc(1, ENAMETOOLONG, "%s: XDG_CACHE_HOME", __func__);
+
 	env->ev_now = time(NULL);
 	tm = localtime((const time_t *)&env->ev_now);
 	if (tm == NULL)
@@ -334,34 +554,496 @@ readenv(struct environment *env)
 	    env->ev_tmpdir, (long long)env->ev_now, env->ev_tz.t_offset);
 }
 
+static void
+sighandler(int signo)
+{
+	switch (signo) {
+	case SIGHUP:
+		gothup = 1;
+		break;
+	case SIGINT:
+	case SIGTERM:
+		gotterm = 1;
+		break;
+	}
+}
+
+static void
+block_init(struct block *bl, const struct config *conf, const struct batch *b)
+{
+	bl->bl_conf = conf;
+	bl->bl_exprhash = 0;
+	if (b->b_cache != NULL && config_cacheable(conf))
+		bl->bl_exprhash = expr_hash(conf->expr);
+	/* Avoid reading the body unless needed by any expression. */
+	bl->bl_msgflags = 0;
+	if (!expr_needs_body(conf->expr))
+		bl->bl_msgflags |= MESSAGE_PARSE_HEADERS;
+}
+
+/*
+ * Add the given maildir entry to the batch. The caller is responsible for
+ * executing the batch once full.
+ */
+static void
+batch_add(struct batch *b, const struct block *bl, struct maildir *md,
+    const struct maildir_entry *me, const struct environment *env,
+    struct arena_scope *s)
+{
+	struct job *jb = &b->b_jobs[b->b_len++];
+
+	jb->jb_me = *me;
+	/* Only valid until the next walk. */
+	jb->jb_me.path = arena_strdup(s, me->path);
+	jb->jb_me.st = NULL;
+	jb->jb_md = md;
+	jb->jb_expr = bl->bl_conf->expr;
+	jb->jb_exprhash = bl->bl_exprhash;
+	jb->jb_msgflags = bl->bl_msgflags;
+	jb->jb_env = env;
+	jb->jb_flags = 0;
+
+	/* Favor the file status resolved while walking the maildir. */
+	if (me->st != NULL) {
+		jb->jb_st = *me->st;
+		jb->jb_flags |= JOB_FLAG_STAT;
+	} else if (jb->jb_exprhash != 0 && fstatat(me->dirfd, me->path,
+	    &jb->jb_st, AT_SYMLINK_NOFOLLOW) == 0) {
+		jb->jb_flags |= JOB_FLAG_STAT;
+	}
+	if (jb->jb_exprhash != 0 && (jb->jb_flags & JOB_FLAG_STAT)) {
+		jb->jb_flags |= JOB_FLAG_CACHE;
+		if (cache_lookup(b->b_cache, me->dir, me->path,
+		    jb->jb_exprhash, &jb->jb_st))
+			jb->jb_flags |= JOB_FLAG_CACHED;
+	}
+}
+
+/*
+ * Evaluate all jobs in the batch followed by executing them, in order.
+ * Returns zero on success, non-zero otherwise.
+ */
 static int
-handle_message(struct expr *expr, struct maildir *md,
-    const struct maildir_entry *me, int *reject, const struct environment *env,
-    struct arena *eternal, struct arena *scratch)
+batch_exec(struct batch *b, const struct environment *env,
+    struct arena *scratch)
 {
-	struct match_list matches;
-	struct message *msg;
+	size_t i;
 	int error = 0;
 
-	arena_scope(eternal, eternal_scope);
+	worker_pool_run(b->b_pool, b->b_jobs, b->b_len, sizeof(*b->b_jobs));
+	for (i = 0; i < b->b_len; i++) {
+		struct job *jb = &b->b_jobs[i];
+
+		if (jb->jb_ev == EXPR_NOMATCH &&
+		    (jb->jb_flags & JOB_FLAG_CACHE) &&
+		    (jb->jb_flags & JOB_FLAG_CACHED) == 0) {
+			cache_insert(b->b_cache, jb->jb_me.dir, jb->jb_me.path,
+			    jb->jb_exprhash, &jb->jb_st);
+		}
+		if (job_exec(jb, b, env, scratch))
+			error = 1;
+	}
+	/* Queued actions must be flushed while the messages are still valid. */
+	if (maildir_queue_flush(b->b_queue, env))
+		error = 1;
+	if (sync_flush())
+		error = 1;
+	worker_pool_release(b->b_pool);
+	b->b_len = 0;
+
+	return error;
+}
+
+/*
+ * Evaluate all messages in the maildirs associated with the given
+ * configuration. Returns zero on success, non-zero otherwise.
+ */
+static int
+sweep(struct batch *b, const struct config_list *cl,
+    const struct environment *env, struct arena *scratch)
+{
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < VECTOR_LENGTH(cl->cl_list); i++) {
+		const struct config *conf = &cl->cl_list[i];
+		const struct string *str;
+		struct block bl;
+
+		block_init(&bl, conf, b);
+
+		LIST_FOREACH(str, conf->paths) {
+			const char *path = str->val;
+			struct maildir *md;
+			unsigned int flags;
+
+			if (maildir_skip(path, env))
+				continue;
 
-	msg = message_parse(me->dir, me->dirfd, me->path, &eternal_scope,
-	    scratch);
-	if (msg == NULL)
+			arena_scope(scratch, s);
+
+			flags = MAILDIR_WALK;
+			if (isstdin(path))
+				flags |= MAILDIR_STDIN;
+			md = maildir_open(path, flags, env, &s);
+			if (md == NULL) {
+				error = 1;
+				continue;
+			}
+
+			for (;;) {
+				struct maildir_entry me;
+				int w = 1;
+
+				arena_scope(scratch, batch_scope);
+
+				while (b->b_len < b->b_size) {
+					w = maildir_walk(md, &me);
+					if (w != 1)
+						break;
+					batch_add(b, &bl, md, &me, env,
+					    &batch_scope);
+				}
+				if (batch_exec(b, env, scratch))
+					error = 1;
+
+				if (w == 0)
+					break;
+				if (w == -1) {
+					error = 1;
+					break;
+				}
+			}
+			maildir_close(md);
+		}
+	}
+
+	return error;
+}
+
+/*
+ * Watch the new and cur directories of all maildirs associated with the given
+ * configuration, evaluating messages as they appear. Runs until terminated by
+ * SIGINT or SIGTERM. The configuration is reloaded, followed by evaluating all
+ * messages, upon receiving SIGHUP or if the configuration file is modified.
+ * Returns zero on success, non-zero otherwise.
+ */
+static int
+watch(struct batch *b, const struct config_list *cl, const char **defines,
+    struct environment *env, struct arena *scratch)
+{
+	struct reload reloads[2];
+	struct sigaction sa;
+	struct timespec mtime = {0};
+	struct arena *wa;
+	unsigned int n = 0;
+	int error = 0;
+
+	memset(reloads, 0, sizeof(reloads));
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	/* Interrupt poll(2) as opposed of restarting it. */
+	sa.sa_handler = sighandler;
+	if (sigaction(SIGHUP, &sa, NULL) == -1 ||
+	    sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1) {
+		warn("sigaction");
 		return 1;
+	}
+
+	(void)config_mtime(env->ev_confpath, &mtime);
+
+	wa = arena_alloc("watch");
+	for (;;) {
+		struct reload *r;
+
+		if (!watch_config(b, cl, &mtime, env, scratch, wa, &error))
+			break;
+
+		/*
+		 * Keep the previous configuration if the new one is invalid,
+		 * the configuration file is not parsed again until modified.
+		 */
+		gothup = 0;
+		(void)config_mtime(env->ev_confpath, &mtime);
+		r = &reloads[n % 2];
+		if (config_reload(r, defines, env, scratch))
+			continue;
+		cl = &r->r_cl;
+		sync_init(cl->cl_sync);
+		r = &reloads[++n % 2];
+		if (r->r_arena != NULL) {
+			arena_scope_leave(&r->r_scope);
+			arena_free(r->r_arena);
+			r->r_arena = NULL;
+		}
+	}
+	arena_free(wa);
+
+	for (n = 0; n < 2; n++) {
+		struct reload *r = &reloads[n];
+
+		if (r->r_arena != NULL) {
+			arena_scope_leave(&r->r_scope);
+			arena_free(r->r_arena);
+		}
+	}
+
+	return error;
+}
+
+/*
+ * Watch all maildirs associated with the given configuration until terminated
+ * or the configuration must be reloaded. Returns 1 if the configuration must
+ * be reloaded and 0 if terminated, either by a signal or a fatal error. Any
+ * error is reported using the given error pointer.
+ */
+static int
+watch_config(struct batch *b, const struct config_list *cl,
+    const struct timespec *mtime, struct environment *env,
+    struct arena *scratch, struct arena *wa, int *error)
+{
+	static const char *subdirs[] = { "new", "cur" };
+	struct watched **watched;
+	struct watch *w;
+	size_t i;
+	int reload = 0;
+
+	arena_scope(wa, s);
+
+	w = watch_alloc(&s);
+	if (w == NULL) {
+		*error = 1;
+		return 0;
+	}
+	ARENA_VECTOR_INIT(&s, watched, 8);
+
+	for (i = 0; i < VECTOR_LENGTH(cl->cl_list); i++) {
+		const struct config *conf = &cl->cl_list[i];
+		const struct string *str;
+		struct block bl;
+
+		block_init(&bl, conf, b);
+
+		LIST_FOREACH(str, conf->paths) {
+			size_t j;
 
-	LIST_INIT(&matches);
+			if (maildir_skip(str->val, env))
+				continue;
+
+			for (j = 0; j < sizeof(subdirs) / sizeof(subdirs[0]);
+			    j++) {
+				char path[PATH_MAX];
+				struct watched *wd;
+
+				if (pathjoin(path, sizeof(path), str->val,
+				    subdirs[j]) == NULL) {
+					warnc(ENAMETOOLONG, "%s", str->val);
+					*error = 1;
+					continue;
+				}
+
+				wd = arena_calloc(&s, 1, sizeof(*wd));
+				wd->wd_block = bl;
+				wd->wd_md = maildir_open(path, 0, env, &s);
+				if (wd->wd_md == NULL) {
+					*error = 1;
+					continue;
+				}
+				*ARENA_VECTOR_ALLOC(watched) = wd;
+				if (watch_add(w, path, wd))
+					*error = 1;
+			}
+		}
+	}
+
+	/*
+	 * Evaluate all existing messages once the watches are in place, any
+	 * message delivered in between is therefore not missed.
+	 */
+	env->ev_now = time(NULL);
+	if (sweep(b, cl, env, scratch))
+		*error = 1;
+
+	while (!gotterm) {
+		struct timespec now;
+		int r;
+
+		r = watch_wait(w, WATCH_INTERVAL);
+		if (r == -1) {
+			*error = 1;
+			break;
+		}
+
+		/*
+		 * Favor reloading over evaluating pending events, as the
+		 * signal could arrive while not waiting. Messages associated
+		 * with pending events are evaluated by the sweep following the
+		 * reload.
+		 */
+		if (gothup || (config_mtime(env->ev_confpath, &now) == 0 &&
+		    (now.tv_sec != mtime->tv_sec ||
+		     now.tv_nsec != mtime->tv_nsec))) {
+			reload = 1;
+			break;
+		}
+		if (r == 1 && watch_events(b, cl, w, env, scratch, wa))
+			*error = 1;
+	}
+
+	for (i = 0; i < VECTOR_LENGTH(watched); i++)
+		maildir_close(watched[i]->wd_md);
+	watch_free(w);
+
+	return reload;
+}
+
+/*
+ * Evaluate the messages associated with all pending events. Events arriving
+ * shortly after each other are coalesced into the same batch. Returns zero on
+ * success, non-zero otherwise.
+ */
+static int
+watch_events(struct batch *b, const struct config_list *cl, struct watch *w,
+    struct environment *env, struct arena *scratch, struct arena *wa)
+{
+	struct watch_event *events;
+	size_t i, nevents;
+	int error = 0;
+
+	arena_scope(wa, s);
+
+	ARENA_VECTOR_INIT(&s, events, 16);
+	do {
+		if (watch_read(w, &events, &s))
+			return 1;
+	} while (VECTOR_LENGTH(events) < WATCH_EVENTS &&
+	    watch_wait(w, WATCH_DEBOUNCE) == 1);
+	nevents = VECTOR_LENGTH(events);
+	log_debug("%s: events=%zu\n", __func__, nevents);
+
+	env->ev_now = time(NULL);
+
+	for (i = 0; i < nevents; i++) {
+		if (events[i].arg == NULL) {
+			/* Events lost, fallback to evaluating all messages. */
+			return sweep(b, cl, env, scratch);
+		}
+	}
+
+	/* The same file could be subject to more than one event. */
+	qsort(events, nevents, sizeof(*events), eventcmp);
+
+	for (i = 0; i < nevents; i++) {
+		const struct watch_event *ev = &events[i];
+		const struct watched *wd = ev->arg;
+		struct maildir_entry me;
+
+		if (i > 0 && eventcmp(ev, &events[i - 1]) == 0)
+			continue;
+		/*
+		 * Ignore messages written by ourselves, preventing the same
+		 * message from being evaluated over and over again.
+		 */
+		if (maildir_isown(ev->name, env))
+			continue;
+		if (!maildir_lookup(wd->wd_md, ev->name, &me))
+			continue;
+
+		batch_add(b, &wd->wd_block, wd->wd_md, &me, env, &s);
+		if (b->b_len == b->b_size && batch_exec(b, env, scratch))
+			error = 1;
+	}
+	if (b->b_len > 0 && batch_exec(b, env, scratch))
+		error = 1;
+
+	return error;
+}
+
+static int
+eventcmp(const void *p1, const void *p2)
+{
+	const struct watch_event *e1 = p1;
+	const struct watch_event *e2 = p2;
+
+	if (e1->arg != e2->arg)
+		return (uintptr_t)e1->arg < (uintptr_t)e2->arg ? -1 : 1;
+	return strcmp(e1->name, e2->name);
+}
+
+/*
+ * Parse and evaluate the message associated with the given job. Invoked by
+ * one of the workers.
+ */
+static void
+job_eval(void *arg, struct arena_scope *eternal_scope, struct arena *scratch)
+{
+	struct job *jb = arg;
+	unsigned int evflags = 0;
+
+	matches_init(&jb->jb_matches, eternal_scope);
+	if (jb->jb_flags & JOB_FLAG_CACHED) {
+		jb->jb_ev = EXPR_NOMATCH;
+		return;
+	}
+	jb->jb_ev = EXPR_ERROR;
+
+	if (jb->jb_me.buf != NULL) {
+		jb->jb_msg = message_parse_buffer(jb->jb_me.dir,
+		    jb->jb_me.path, jb->jb_me.buf, jb->jb_me.buflen,
+		    eternal_scope, scratch);
+	} else {
+		/*
+		 * Favor evaluating the expression using the message path,
+		 * only opening the message if its content is needed.
+		 */
+		jb->jb_msg = message_parse(jb->jb_me.dir, jb->jb_me.dirfd,
+		    jb->jb_me.path, jb->jb_msgflags | MESSAGE_PARSE_LAZY,
+		    eternal_scope, scratch);
+		if (jb->jb_msg != NULL && (jb->jb_flags & JOB_FLAG_STAT))
+			message_set_stat(jb->jb_msg, &jb->jb_st);
+		evflags |= EXPR_EVAL_LAZY;
+	}
+	if (jb->jb_msg == NULL)
+		return;
 
 	struct expr_eval_arg ea = {
-		.ea_ml		= &matches,
-		.ea_msg		= msg,
-		.ea_env		= env,
+		.ea_ml		= &jb->jb_matches,
+		.ea_msg		= jb->jb_msg,
+		.ea_env		= jb->jb_env,
+		.ea_flags	= evflags,
 		.ea_arena	= {
-			.eternal_scope	= &eternal_scope,
+			.eternal_scope	= eternal_scope,
 			.scratch	= scratch,
 		},
 	};
-	switch (expr_eval(expr, &ea)) {
+	jb->jb_ev = expr_eval(jb->jb_expr, &ea);
+	if (jb->jb_ev == EXPR_DEFER) {
+		matches_clear(&jb->jb_matches);
+		if (message_load(jb->jb_msg)) {
+			jb->jb_ev = EXPR_ERROR;
+			return;
+		}
+		ea.ea_flags &= ~EXPR_EVAL_LAZY;
+		jb->jb_ev = expr_eval(jb->jb_expr, &ea);
+	}
+	if (jb->jb_ev == EXPR_MATCH &&
+	    matches_interpolate(&jb->jb_matches, eternal_scope, scratch))
+		jb->jb_ev = EXPR_ERROR;
+}
+
+/*
+ * Carry out the actions associated with the given evaluated job. Must be
+ * invoked by the main thread.
+ */
+static int
+job_exec(struct job *jb, struct batch *b, const struct environment *env,
+    struct arena *scratch)
+{
+	int error = 0;
+
+	switch (jb->jb_ev) {
 	case EXPR_MATCH:
 		break;
 	case EXPR_NOMATCH:
@@ -371,19 +1053,16 @@ handle_message(struct expr *expr, struct maildir *md,
 		goto out;
 	}
 
-	if (matches_interpolate(&matches, &eternal_scope, scratch)) {
-		error = 1;
-		goto out;
-	}
-	if (matches_inspect(&matches, env, scratch)) {
+	if (matches_inspect(&jb->jb_matches, env, scratch)) {
 		/* Dry run, we're done. */
 		goto out;
 	}
-	switch (matches_exec(&matches, md, env, scratch)) {
+	switch (matches_exec(&jb->jb_matches, jb->jb_md, b->b_mdcache,
+	    b->b_queue, env)) {
 	case MATCH_EXEC_SUCCESS:
 		break;
 	case MATCH_EXEC_REJECTED:
-		*reject = 1;
+		b->b_reject = 1;
 		break;
 	case MATCH_EXEC_ERROR:
 		error = 1;
@@ -391,6 +1070,6 @@ handle_message(struct expr *expr, struct maildir *md,
 	}
 
 out:
-	matches_clear(&matches);
+	matches_clear(&jb->jb_matches);
 	return error;
 }
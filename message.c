@@ -1,14 +1,21 @@
 #include "message.h"
 #include "config.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include "libks/arena-buffer.h"
 #include "libks/arena.h"
@@ -18,8 +25,18 @@
 #include "decode.h"
 #include "fault.h"
 #include "log.h"
+#include "sync.h"
 #include "util.h"
 
+/* Number of bytes to read at a time while looking for the end of headers. */
+#define HEADERS_CHUNK	4096
+
+/* Messages larger than this number of bytes are mapped as opposed of read. */
+#define MMAP_MIN	(64 * 1024)
+
+/* Number of buffers written at a time, well below IOV_MAX. */
+#define IOV_BATCH	256
+
 #define message_flags_resolve(mf, flag, flags, mask) do {		\
 	if ((flag) >= 'A' && (flag) <= 'Z') {				\
 		*(flags) = &(mf)->mf_upper;				\
@@ -35,19 +52,35 @@
 } while (0)
 
 struct message {
-	char			 me_path[PATH_MAX];	/* full path */
-	char			 me_name[NAME_MAX + 1];	/* file name */
-	const char		*me_body;
+	char			*me_path;		/* full path */
+	char			*me_name;		/* file name */
+	const char		*me_body;		/* NULL if not read */
+	size_t			 me_bodyoff;		/* file offset of body */
 	char			*me_buf;
 	const char		*me_buf_dec;		/* decoded body */
+	size_t			 me_mapsiz;		/* non-zero if mapped */
+	const char		*me_raw;		/* pristine message */
+	size_t			 me_rawlen;
+	const char		*me_part;		/* attachment body */
+	size_t			 me_partlen;		/* not NUL-terminated */
 	int			 me_fd;
+	int			 me_dirfd;		/* used while lazy */
+	unsigned int		 me_pflags;		/* message_parse() flags */
 	unsigned int		 me_flags;
 #define MESSAGE_FLAG_ATTACHMENT	0x00000001u
+#define MESSAGE_FLAG_MEMORY	0x00000002u	/* not backed by a file */
+#define MESSAGE_FLAG_MODIFIED	0x00000004u	/* headers modified */
+#define MESSAGE_FLAG_STAT	0x00000008u	/* file status cached */
+#define MESSAGE_FLAG_LAZY	0x00000010u	/* content not loaded */
+
+	struct stat		 me_st;			/* file status */
 
 	struct message_flags	 me_mflags;		/* maildir flags */
 
-	VECTOR(struct header)	 me_headers;
-	VECTOR(struct message)	 me_attachments;
+	VECTOR(struct header)	 me_headers;		/* in arrival order */
+	size_t			*me_index;		/* first header per id */
+	size_t			 me_nindex;
+	VECTOR(struct message *) me_attachments;
 
 	struct {
 		struct arena_scope	*eternal_scope;
@@ -56,13 +89,28 @@ struct message {
 };
 
 struct header {
-	unsigned long		 id;
-
 	const char		*key;
 	const char		*val;
+	unsigned int		 id;		/* interned key, zero if not */
+	size_t			 next;		/* next header with same id */
 	VECTOR(const char *)	 values;	/* all values for key */
 };
 
+/*
+ * Header names interned by message_header_intern(), shared by all messages.
+ * Identifiers start at one as zero denotes a name not being interned. Entries
+ * are never removed.
+ */
+static struct {
+	pthread_rwlock_t	  lock;
+	char			**names;	/* indexed by id - 1 */
+	size_t			  nnames;
+	unsigned int		 *slots;	/* open addressing, zero if empty */
+	size_t			  nslots;	/* power of two */
+} interned = {
+	.lock	= PTHREAD_RWLOCK_INITIALIZER,
+};
+
 struct header_slice {
 	struct {
 		char	*beg;
@@ -70,34 +118,51 @@ struct header_slice {
 	} key, val;
 };
 
+static struct message	*message_alloc(const char *, const char *, char *,
+    int, struct arena_scope *, struct arena *);
 static void		 message_free(void *);
 static int		 message_flags_parse(struct message_flags *,
     const char *);
+static int		 message_set_path(struct message *, const char *,
+    const char *);
 static struct header	*message_headers_alloc(struct message *);
+static void		 message_headers_index(struct message *);
 static int		 message_is_content_type(const struct message *,
     const char *);
 static const char	*message_parse_headers(struct message *);
+static int		 message_read_body(struct message *);
+static const char	*message_body_view(const struct message *, size_t *);
+static const char	*message_body_str(const struct message *);
 static const char	*message_decode_body(struct message *,
     const struct message *);
 
-static int		 cmpheaderid(const struct header *,
-    const struct header *);
-static int		 cmpheaderkey(const struct header *,
-    const struct header *);
 static int		 findheader(char *, struct header_slice *);
-static ssize_t		 searchheader(const struct header *, size_t,
-    const char *,
-    size_t *);
+static ssize_t		 headerfirst(const struct message *, unsigned int,
+    const char *);
+static ssize_t		 headernext(const struct message *, size_t);
+static uint64_t		 headerhash(const char *);
+static unsigned int	 headerlookup(const char *, uint64_t);
 static const char	*decodeheader(const char *, struct arena_scope *,
     struct arena *);
 static const char	*unfoldheader(const char *, struct arena_scope *);
 
 static int		 parseattachments(struct message *, struct message *,
     int);
-static const char	*findboundary(const char *, const char *, int *);
+static void		 parsepart(struct message *, const char *,
+    const char *);
+static const char	*findboundary(const char *, const char *,
+    const char *, int *);
 static int		 parseboundary(const char *, const char **,
     struct arena_scope *);
 
+static char		*mapmessage(int, const struct stat *, size_t *);
+static char		*readheaders(int, struct arena_scope *, int *);
+static int		 isseparator(const char *, size_t, size_t);
+static int		 copyfile(int, int);
+static void		 iovset(struct iovec *, const char *, size_t);
+static int		 writevall(int, struct iovec *, int);
+static int		 writeall(int, const char *, size_t);
+
 static const char	*skipline(const char *);
 static char		*skipseparator(char *);
 static ssize_t		 strflags(unsigned int, unsigned char, char *, size_t);
@@ -184,54 +249,174 @@ message_flags_set(struct message_flags *mf, char flag)
 	return 0;
 }
 
+/*
+ * Parse the message located at path. The flags may be any combination of the
+ * following values:
+ *
+ *     MESSAGE_PARSE_HEADERS    Only read the headers up front, the body is
+ *                              read once needed.
+ *
+ *     MESSAGE_PARSE_LAZY       Only derive properties from the path, the
+ *                              content is loaded once needed or by
+ *                              message_load().
+ */
 struct message *
-message_parse(const char *dir, int dirfd, const char *path,
+message_parse(const char *dir, int dirfd, const char *path, unsigned int flags,
     struct arena_scope *eternal_scope, struct arena *scratch)
 {
-	struct buffer *bf;
 	struct message *msg;
+
+	msg = message_alloc(dir, path, NULL, -1, eternal_scope, scratch);
+	if (msg == NULL)
+		return NULL;
+	msg->me_dirfd = dirfd;
+	msg->me_pflags = flags;
+	msg->me_flags |= MESSAGE_FLAG_LAZY;
+	if (message_flags_parse(&msg->me_mflags, msg->me_path))
+		return NULL;
+
+	if ((flags & MESSAGE_PARSE_LAZY) == 0 && message_load(msg))
+		return NULL;
+	return msg;
+}
+
+/*
+ * Load the content of the given message unless already done. Returns zero on
+ * success, non-zero otherwise.
+ */
+int
+message_load(struct message *msg)
+{
+	struct stat sb;
+	const char *body;
 	char *buf;
-	size_t siz;
+	size_t mapsiz = 0;
+	int eof = 1;
+	int havestat;
 	int fd;
 
-	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if ((msg->me_flags & MESSAGE_FLAG_LAZY) == 0)
+		return 0;
+	if (FAULT("message_load"))
+		return 1;
+
+	/* The name is only relative to the directory until moved. */
+	fd = openat(msg->me_dirfd,
+	    msg->me_dirfd == AT_FDCWD ? msg->me_path : msg->me_name,
+	    O_RDONLY | O_CLOEXEC);
 	if (fd == -1) {
-		warn("open: %s/%s", dir, path);
-		return NULL;
+		warn("open: %s", msg->me_path);
+		return 1;
 	}
-	bf = arena_buffer_read_fd(eternal_scope, fd);
-	if (bf == NULL) {
-		warn("%s", path);
+	/* Cached for later use, see message_stat(). */
+	havestat = fstat(fd, &sb) == 0;
+	if ((buf = mapmessage(fd, havestat ? &sb : NULL, &mapsiz)) != NULL) {
+		/* Pages are only read once touched, the whole body included. */
+	} else if (msg->me_pflags & MESSAGE_PARSE_HEADERS) {
+		eof = 0;
+		buf = readheaders(fd, msg->me_arena.eternal_scope, &eof);
+	} else {
+		struct buffer *bf;
+
+		bf = arena_buffer_read_fd(msg->me_arena.eternal_scope, fd);
+		buf = bf != NULL ? buffer_str(bf) : NULL;
+	}
+	if (buf == NULL) {
+		warn("%s", msg->me_name);
 		close(fd);
-		return NULL;
+		return 1;
 	}
-	buf = buffer_str(bf);
+
+	msg->me_fd = fd;
+	msg->me_buf = buf;
+	msg->me_mapsiz = mapsiz;
+	if (havestat) {
+		msg->me_st = sb;
+		msg->me_flags |= MESSAGE_FLAG_STAT;
+	}
+	msg->me_flags &= ~MESSAGE_FLAG_LAZY;
+
+	body = message_parse_headers(msg);
+	if (eof)
+		msg->me_body = body;
+	else
+		msg->me_bodyoff = (size_t)(body - msg->me_buf);
+
+	return 0;
+}
+
+/*
+ * Parse the message residing in the given buffer, used for messages read from
+ * stdin which are never written to disk unless moved. The buffer must remain
+ * valid during the lifetime of the message as it's written verbatim unless
+ * modified.
+ */
+struct message *
+message_parse_buffer(const char *dir, const char *path, const char *buf,
+    size_t len, struct arena_scope *eternal_scope, struct arena *scratch)
+{
+	struct message *msg;
+	char *dup;
+
+	/* Parsing is done in place, favor a copy to keep the buffer intact. */
+	dup = arena_malloc(eternal_scope, len + 1);
+	memcpy(dup, buf, len);
+	dup[len] = '\0';
+
+	msg = message_alloc(dir, path, dup, -1, eternal_scope, scratch);
+	if (msg == NULL)
+		return NULL;
+	msg->me_raw = buf;
+	msg->me_rawlen = len;
+	msg->me_flags |= MESSAGE_FLAG_MEMORY;
+	msg->me_body = message_parse_headers(msg);
+	if (message_flags_parse(&msg->me_mflags, msg->me_path))
+		return NULL;
+
+	return msg;
+}
+
+static struct message *
+message_alloc(const char *dir, const char *path, char *buf, int fd,
+    struct arena_scope *eternal_scope, struct arena *scratch)
+{
+	struct message *msg;
 
 	msg = arena_calloc(eternal_scope, 1, sizeof(*msg));
 	msg->me_arena.eternal_scope = eternal_scope;
 	msg->me_arena.scratch = scratch;
 	msg->me_fd = fd;
+	msg->me_dirfd = AT_FDCWD;
 	msg->me_buf = buf;
 	if (VECTOR_INIT(msg->me_headers))
 		err(1, NULL);
 	arena_cleanup(eternal_scope, message_free, msg);
 
-	if (pathjoin(msg->me_path, sizeof(msg->me_path), dir, path) == NULL) {
-		warnc(ENAMETOOLONG, "%s", __func__);
-		return NULL;
-	}
-	siz = sizeof(msg->me_name);
-	if (strlcpy(msg->me_name, path, siz) >= siz) {
-		warnc(ENAMETOOLONG, "%s", __func__);
+	if (message_set_path(msg, dir, path))
 		return NULL;
-	}
 
-	msg->me_body = message_parse_headers(msg);
+	return msg;
+}
 
-	if (message_flags_parse(&msg->me_mflags, msg->me_path))
-		return NULL;
+/*
+ * Set the path of the given message, allocated using its exact length. The
+ * name is a suffix of the path.
+ */
+static int
+message_set_path(struct message *msg, const char *dir, const char *name)
+{
+	size_t dirlen, namelen;
 
-	return msg;
+	dirlen = strlen(dir);
+	namelen = strlen(name);
+	if (namelen > NAME_MAX || dirlen + namelen + 1 >= PATH_MAX) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+	msg->me_path = arena_sprintf(msg->me_arena.eternal_scope, "%s/%s",
+	    dir, name);
+	msg->me_name = &msg->me_path[dirlen + 1];
+	return 0;
 }
 
 static void
@@ -241,10 +426,10 @@ message_free(void *arg)
 
 	if (msg->me_attachments != NULL) {
 		while (!VECTOR_EMPTY(msg->me_attachments)) {
-			struct message *attach;
+			struct message **attach;
 
 			attach = VECTOR_POP(msg->me_attachments);
-			message_free(attach);
+			message_free(*attach);
 		}
 		VECTOR_FREE(msg->me_attachments);
 	}
@@ -259,66 +444,69 @@ message_free(void *arg)
 
 	if (msg->me_fd != -1)
 		close(msg->me_fd);
+	if (msg->me_mapsiz > 0)
+		(void)munmap(msg->me_buf, msg->me_mapsiz);
 }
 
 int
 message_write(struct message *msg, int fd)
 {
-	FILE *fh;
+	struct iovec iov[IOV_BATCH];
+	const char *body;
+	size_t bodylen;
 	unsigned int i;
 	int error = 0;
-	int newfd;
+	int iovcnt = 0;
+
+	if (message_load(msg))
+		return 1;
 
 	/*
-	 * Since fclose(3) uncondtionally closes the file descriptor, operate on
-	 * a duplicate in order to prevent side effects.
+	 * Unmodified messages are written verbatim, favoring the file as it
+	 * reflects any previous write.
 	 */
-	newfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
-	if (newfd == -1) {
-		warn("dup");
-		return 1;
+	if ((msg->me_flags & MESSAGE_FLAG_MODIFIED) == 0 &&
+	    (msg->me_fd != -1 || msg->me_raw != NULL)) {
+		if (msg->me_fd != -1)
+			error = copyfile(msg->me_fd, fd);
+		else
+			error = writeall(fd, msg->me_raw, msg->me_rawlen);
+		goto out;
 	}
 
-	fh = fdopen(newfd, "we");
-	if (fh == NULL) {
-		warn("fdopen");
-		close(newfd);
+	if (message_read_body(msg))
 		return 1;
-	}
-
-	/* Preserve ordering of headers. */
-	VECTOR_SORT(msg->me_headers, cmpheaderid);
+	body = message_body_view(msg, &bodylen);
 
+	/*
+	 * Gather the headers and body as is from the message buffer, writing
+	 * them in as few system calls as possible.
+	 */
 	for (i = 0; i < VECTOR_LENGTH(msg->me_headers); i++) {
 		const struct header *hdr = &msg->me_headers[i];
 
-		if (fprintf(fh, "%s: %s\n", hdr->key, hdr->val) < 0) {
-			warn("fprintf");
-			error = 1;
-			goto out;
+		if (iovcnt + 4 > IOV_BATCH) {
+			if ((error = writevall(fd, iov, iovcnt)))
+				goto out;
+			iovcnt = 0;
 		}
+		iovset(&iov[iovcnt++], hdr->key, strlen(hdr->key));
+		iovset(&iov[iovcnt++], ": ", 2);
+		iovset(&iov[iovcnt++], hdr->val, strlen(hdr->val));
+		iovset(&iov[iovcnt++], "\n", 1);
 	}
-
-	if (fprintf(fh, "\n%s", msg->me_body) < 0) {
-		warn("fprintf");
-		error = 1;
-		goto out;
-	}
-
-	if (fflush(fh) == EOF) {
-		warn("fflush");
-		error = 1;
-	} else if (fsync(newfd) == -1) {
-		warn("fsync");
-		error = 1;
+	if (iovcnt + 2 > IOV_BATCH) {
+		if ((error = writevall(fd, iov, iovcnt)))
+			goto out;
+		iovcnt = 0;
 	}
+	iovset(&iov[iovcnt++], "\n", 1);
+	iovset(&iov[iovcnt++], body, bodylen);
+	error = writevall(fd, iov, iovcnt);
 
 out:
-	if (fclose(fh) == EOF) {
-		warn("fclose");
-		error = 1;
-	}
-
+	if (!error)
+		error = sync_file(fd);
 	if (FAULT("message_write"))
 		error = 1;
 
@@ -336,6 +524,9 @@ message_get_fd(struct message *msg, int skipheaders)
 	char path[PATH_MAX];
 	int fd;
 
+	if (message_load(msg))
+		return -1;
+
 	if (skipheaders) {
 		const char *body;
 		size_t len;
@@ -348,7 +539,8 @@ message_get_fd(struct message *msg, int skipheaders)
 		fd = KS_fs_tmpfd(body, len, path, sizeof(path));
 		if (fd == -1)
 			return -1;
-	} else if (msg->me_flags & MESSAGE_FLAG_ATTACHMENT) {
+	} else if (msg->me_fd == -1) {
+		/* Either an attachment or a message residing in memory. */
 		fd = KS_fs_tmpfd(NULL, 0, path, sizeof(path));
 		if (fd == -1)
 			return -1;
@@ -382,11 +574,13 @@ const char *
 message_get_body(struct message *msg)
 {
 	VECTOR(struct message *) attachments;
-	const struct message *found = NULL;
+	struct message *found = NULL;
 	size_t i;
 
 	if (msg->me_buf_dec != NULL)
 		return msg->me_buf_dec;
+	if (message_read_body(msg))
+		return NULL;
 	if (!message_is_content_type(msg, "multipart/alternative"))
 		return message_decode_body(msg, msg);
 
@@ -397,7 +591,7 @@ message_get_body(struct message *msg)
 
 	/* Scan attachments, favor plain text over HTML. */
 	for (i = 0; i < VECTOR_LENGTH(attachments); i++) {
-		const struct message *attach = attachments[i];
+		struct message *attach = attachments[i];
 
 		if (message_is_content_type(attach, "text/plain")) {
 			found = attach;
@@ -410,40 +604,58 @@ message_get_body(struct message *msg)
 		}
 	}
 	message_free_attachments(attachments);
-	if (found == NULL)
-		return msg->me_body;
+	if (found == NULL) {
+		msg->me_buf_dec = message_body_str(msg);
+		return msg->me_buf_dec;
+	}
+	if (message_read_body(found))
+		return NULL;
 
 	return message_decode_body(msg, found);
 }
 
 const char *const *
 message_get_header(const struct message *msg, const char *header)
+{
+	return message_get_header_id(msg, message_header_intern(header));
+}
+
+/*
+ * Get all values of the header with the given interned name, in order of
+ * appearance.
+ */
+const char *const *
+message_get_header_id(const struct message *msg, unsigned int id)
 {
 	struct header *hdr;
+	const char *name = NULL;
 	ssize_t idx;
-	size_t nfound;
 
-	idx = searchheader(msg->me_headers, VECTOR_LENGTH(msg->me_headers),
-	    header, &nfound);
+	assert((msg->me_flags & MESSAGE_FLAG_LAZY) == 0);
+	assert(id > 0);
+
+	/* Name interned after the message was indexed. */
+	if (id > msg->me_nindex) {
+		pthread_rwlock_rdlock(&interned.lock);
+		name = interned.names[id - 1];
+		pthread_rwlock_unlock(&interned.lock);
+	}
+
+	idx = headerfirst(msg, id, name);
 	if (idx == -1)
 		return NULL;
 
 	hdr = &msg->me_headers[idx];
 	if (hdr->values == NULL) {
-		struct header *tmp;
-		size_t i;
-
 		if (VECTOR_INIT(hdr->values))
 			err(1, NULL);
-		if (VECTOR_RESERVE(hdr->values, nfound))
-			err(1, NULL);
-		for (i = 0, tmp = hdr; i < nfound; i++, tmp++) {
+		for (; idx != -1; idx = headernext(msg, (size_t)idx)) {
 			const char **dst;
 
 			dst = VECTOR_ALLOC(hdr->values);
 			if (dst == NULL)
 				err(1, NULL);
-			*dst = decodeheader(tmp->val,
+			*dst = decodeheader(msg->me_headers[idx].val,
 			    msg->me_arena.eternal_scope, msg->me_arena.scratch);
 		}
 	}
@@ -466,36 +678,103 @@ message_set_header(struct message *msg, const char *header, const char *val)
 {
 	struct header *hdr;
 	ssize_t idx;
-	size_t nfound;
 
-	idx = searchheader(msg->me_headers, VECTOR_LENGTH(msg->me_headers),
-	    header, &nfound);
+	assert((msg->me_flags & MESSAGE_FLAG_LAZY) == 0);
+
+	msg->me_flags |= MESSAGE_FLAG_MODIFIED;
+
+	idx = headerfirst(msg, message_header_intern(header), header);
 	if (idx == -1) {
 		hdr = message_headers_alloc(msg);
 		hdr->key = header;
 		hdr->val = val;
-		VECTOR_SORT(msg->me_headers, cmpheaderkey);
 	} else {
-		if (nfound > 1) {
-			size_t i = (size_t)idx;
+		size_t i;
+
+		/*
+		 * Multiple occurrences of the given header.
+		 * Remove all occurrences except the first one.
+		 */
+		for (i = VECTOR_LENGTH(msg->me_headers) - 1; i > (size_t)idx;
+		    i--) {
 			size_t tail;
 
-			/*
-			 * Multiple occurrences of the given header.
-			 * Remove all occurrences except the first one.
-			 */
-			tail = VECTOR_LENGTH(msg->me_headers) - (i + nfound);
-			memmove(&msg->me_headers[i + 1],
-			    &msg->me_headers[i + nfound],
-			    tail * sizeof(*msg->me_headers));
-			for (; nfound > 1; nfound--)
-				VECTOR_POP(msg->me_headers);
+			hdr = &msg->me_headers[i];
+			if (strcasecmp(hdr->key, header) != 0)
+				continue;
+			VECTOR_FREE(hdr->values);
+			tail = VECTOR_LENGTH(msg->me_headers) - (i + 1);
+			memmove(hdr, hdr + 1, tail * sizeof(*hdr));
+			(void)VECTOR_POP(msg->me_headers);
 		}
 
 		hdr = &msg->me_headers[idx];
 		hdr->val = val;
 		VECTOR_FREE(hdr->values);
 	}
+	message_headers_index(msg);
+}
+
+/*
+ * Intern the given header name, returning its identifier. Header names are
+ * compared case insensitive.
+ */
+unsigned int
+message_header_intern(const char *name)
+{
+	uint64_t hash;
+	size_t i, mask;
+	unsigned int id;
+
+	hash = headerhash(name);
+	pthread_rwlock_rdlock(&interned.lock);
+	id = headerlookup(name, hash);
+	pthread_rwlock_unlock(&interned.lock);
+	if (id > 0)
+		return id;
+
+	pthread_rwlock_wrlock(&interned.lock);
+	/* Could have been interned while not holding the lock. */
+	id = headerlookup(name, hash);
+	if (id > 0)
+		goto out;
+
+	/* Keep the load factor below one half. */
+	if ((interned.nnames + 1) * 2 > interned.nslots) {
+		size_t nslots = interned.nslots > 0 ? interned.nslots * 2 : 64;
+		unsigned int *slots;
+		size_t j;
+
+		slots = calloc(nslots, sizeof(*slots));
+		if (slots == NULL)
+			err(1, NULL);
+		for (j = 0; j < interned.nnames; j++) {
+			i = headerhash(interned.names[j]) & (nslots - 1);
+			while (slots[i] != 0)
+				i = (i + 1) & (nslots - 1);
+			slots[i] = (unsigned int)(j + 1);
+		}
+		free(interned.slots);
+		interned.slots = slots;
+		interned.nslots = nslots;
+		interned.names = realloc(interned.names,
+		    (nslots / 2) * sizeof(*interned.names));
+		if (interned.names == NULL)
+			err(1, NULL);
+	}
+
+	interned.names[interned.nnames] = strdup(name);
+	if (interned.names[interned.nnames] == NULL)
+		err(1, NULL);
+	id = (unsigned int)++interned.nnames;
+	mask = interned.nslots - 1;
+	for (i = hash & mask; interned.slots[i] != 0; i = (i + 1) & mask)
+		continue;
+	interned.slots[i] = id;
+
+out:
+	pthread_rwlock_unlock(&interned.lock);
+	return id;
 }
 
 /*
@@ -506,31 +785,81 @@ int
 message_set_file(struct message *msg, const char *path, const char *name,
     int fd)
 {
-	size_t siz;
-
 	if (FAULT("message_set_file"))
 		return 1;
 
-	if (pathjoin(msg->me_path, sizeof(msg->me_path), path, name) == NULL) {
-		warnc(ENAMETOOLONG, "%s", __func__);
-		return 1;
-	}
-
-	siz = sizeof(msg->me_name);
-	if (strlcpy(msg->me_name, name, siz) >= siz) {
-		warnc(ENAMETOOLONG, "%s", __func__);
+	if (message_set_path(msg, path, name))
 		return 1;
-	}
 
 	if (fd != -1) {
 		if (msg->me_fd != -1)
 			close(msg->me_fd);
 		msg->me_fd = fd;
+		/* The new file reflects all modifications. */
+		msg->me_flags &= ~MESSAGE_FLAG_MODIFIED;
+	}
+	msg->me_flags &= ~(MESSAGE_FLAG_MEMORY | MESSAGE_FLAG_STAT);
+	/* The name is no longer relative to the directory. */
+	msg->me_dirfd = AT_FDCWD;
+
+	return 0;
+}
+
+/*
+ * Get the file status of the given message. The status is cached, favoring the
+ * one obtained while parsing the message. A message residing in memory is
+ * considered to be created at the time of the first invocation.
+ */
+int
+message_stat(struct message *msg, struct stat *sb)
+{
+	struct timespec now;
+
+	if (msg->me_flags & MESSAGE_FLAG_STAT) {
+		*sb = msg->me_st;
+		return 0;
 	}
 
+	if (msg->me_flags & MESSAGE_FLAG_MEMORY) {
+		if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+			warn("clock_gettime");
+			return 1;
+		}
+		memset(&msg->me_st, 0, sizeof(msg->me_st));
+		msg->me_st.st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+		msg->me_st.st_nlink = 1;
+		msg->me_st.st_size = (off_t)msg->me_rawlen;
+		msg->me_st.st_atim = now;
+		msg->me_st.st_mtim = now;
+		msg->me_st.st_ctim = now;
+	} else if (msg->me_fd != -1) {
+		if (fstat(msg->me_fd, &msg->me_st) == -1) {
+			warn("fstat: %s", msg->me_path);
+			return 1;
+		}
+	} else {
+		log_debug("%s: %s\n", __func__, msg->me_path);
+		if (stat(msg->me_path, &msg->me_st) == -1) {
+			warn("stat: %s", msg->me_path);
+			return 1;
+		}
+	}
+	msg->me_flags |= MESSAGE_FLAG_STAT;
+	*sb = msg->me_st;
 	return 0;
 }
 
+/*
+ * Seed the cached file status of the message, as already resolved by the
+ * caller.
+ */
+void
+message_set_stat(struct message *msg, const struct stat *sb)
+{
+	msg->me_st = *sb;
+	msg->me_flags |= MESSAGE_FLAG_STAT;
+}
+
 const char *
 message_get_path(const struct message *msg)
 {
@@ -559,6 +888,9 @@ message_get_attachments(struct message *msg)
 	VECTOR(struct message *) attachments;
 	size_t i, n;
 
+	if (message_read_body(msg))
+		return NULL;
+
 	if (msg->me_attachments == NULL) {
 		if (VECTOR_INIT(msg->me_attachments))
 			err(1, NULL);
@@ -577,7 +909,7 @@ message_get_attachments(struct message *msg)
 		dst = VECTOR_ALLOC(attachments);
 		if (dst == NULL)
 			err(1, NULL);
-		*dst = &msg->me_attachments[i];
+		*dst = msg->me_attachments[i];
 	}
 	return attachments;
 }
@@ -618,10 +950,41 @@ message_headers_alloc(struct message *msg)
 	hdr = VECTOR_CALLOC(msg->me_headers);
 	if (hdr == NULL)
 		err(1, NULL);
-	hdr->id = VECTOR_LENGTH(msg->me_headers);
 	return hdr;
 }
 
+/*
+ * Index the headers by interned name, mapping each identifier to the first
+ * header with the same name which in turn links to the next one. Header names
+ * not interned are left out.
+ */
+static void
+message_headers_index(struct message *msg)
+{
+	size_t i;
+
+	pthread_rwlock_rdlock(&interned.lock);
+	if (msg->me_index == NULL || msg->me_nindex != interned.nnames) {
+		msg->me_nindex = interned.nnames;
+		msg->me_index = arena_calloc(msg->me_arena.eternal_scope,
+		    msg->me_nindex, sizeof(*msg->me_index));
+	} else {
+		memset(msg->me_index, 0,
+		    msg->me_nindex * sizeof(*msg->me_index));
+	}
+	for (i = VECTOR_LENGTH(msg->me_headers); i > 0; i--) {
+		struct header *hdr = &msg->me_headers[i - 1];
+
+		hdr->id = headerlookup(hdr->key, headerhash(hdr->key));
+		hdr->next = 0;
+		if (hdr->id == 0)
+			continue;
+		hdr->next = msg->me_index[hdr->id - 1];
+		msg->me_index[hdr->id - 1] = i;
+	}
+	pthread_rwlock_unlock(&interned.lock);
+}
+
 static int
 message_is_content_type(const struct message *msg, const char *needle)
 {
@@ -657,49 +1020,98 @@ message_parse_headers(struct message *msg)
 
 		buf = &slice.val.end[1];
 	}
-	VECTOR_SORT(msg->me_headers, cmpheaderkey);
+	message_headers_index(msg);
 
 	for (; *buf == '\n'; buf++)
 		continue;
 	return buf;
 }
 
+/*
+ * Read the body of the message unless already done. Returns zero on success,
+ * non-zero otherwise.
+ */
+static int
+message_read_body(struct message *msg)
+{
+	struct buffer *bf;
+	char *buf;
+
+	if (message_load(msg))
+		return 1;
+	/* The body of an attachment is a view of the parent body. */
+	if (msg->me_body != NULL || (msg->me_flags & MESSAGE_FLAG_ATTACHMENT))
+		return 0;
+
+	log_debug("%s: %s: offset=%zu\n", __func__, msg->me_path,
+	    msg->me_bodyoff);
+	if (lseek(msg->me_fd, (off_t)msg->me_bodyoff, SEEK_SET) == -1) {
+		warn("lseek: %s", msg->me_path);
+		return 1;
+	}
+	bf = arena_buffer_read_fd(msg->me_arena.eternal_scope, msg->me_fd);
+	if (bf == NULL) {
+		warn("%s", msg->me_path);
+		return 1;
+	}
+	buf = buffer_str(bf);
+	for (; *buf == '\n'; buf++)
+		continue;
+	msg->me_body = buf;
+	return 0;
+}
+
+/*
+ * Get the body of the message along with its length, which is only
+ * NUL-terminated unless the message is an attachment.
+ */
+static const char *
+message_body_view(const struct message *msg, size_t *len)
+{
+	if (msg->me_flags & MESSAGE_FLAG_ATTACHMENT) {
+		*len = msg->me_partlen;
+		return msg->me_part;
+	}
+	*len = strlen(msg->me_body);
+	return msg->me_body;
+}
+
+/*
+ * Get the NUL-terminated body of the message, the body of an attachment is
+ * therefore copied.
+ */
+static const char *
+message_body_str(const struct message *msg)
+{
+	if (msg->me_flags & MESSAGE_FLAG_ATTACHMENT) {
+		return arena_strndup(msg->me_arena.eternal_scope, msg->me_part,
+		    msg->me_partlen);
+	}
+	return msg->me_body;
+}
+
 static const char *
 message_decode_body(struct message *msg, const struct message *attachment)
 {
-	const char *enc;
+	const char *body, *enc;
+	size_t len;
 
+	body = message_body_view(attachment, &len);
 	enc = message_get_header1(attachment, "Content-Transfer-Encoding");
 	if (enc != NULL && strcmp(enc, "base64") == 0) {
-		msg->me_buf_dec = base64_decode(attachment->me_body,
+		msg->me_buf_dec = base64_decode(body, len,
 		    msg->me_arena.eternal_scope);
 		if (msg->me_buf_dec == NULL)
 			warnx("%s: failed to decode body", msg->me_path);
 	} else if (enc != NULL && strcmp(enc, "quoted-printable") == 0) {
-		msg->me_buf_dec = quoted_printable_decode(attachment->me_body,
+		msg->me_buf_dec = quoted_printable_decode(body, len,
 		    msg->me_arena.eternal_scope);
 	} else {
-		msg->me_buf_dec = attachment->me_body;
+		msg->me_buf_dec = message_body_str(attachment);
 	}
 	return msg->me_buf_dec;
 }
 
-static int
-cmpheaderid(const struct header *a, const struct header *b)
-{
-	if (a->id < b->id)
-		return -1;
-	if (a->id > b->id)
-		return 1;
-	return 0;
-}
-
-static int
-cmpheaderkey(const struct header *a, const struct header *b)
-{
-	return strcasecmp(a->key, b->key);
-}
-
 static const char *
 decodeheader(const char *str, struct arena_scope *eternal_scope,
     struct arena *scratch)
@@ -791,63 +1203,89 @@ findheader(char *str, struct header_slice *slice)
 }
 
 /*
- * Search for the header with the name given by key. Returns the index of the
- * first matching element in headers. Otherwise, -1 is returned. If the given
- * header has more than one occurrence, nfound will reflect that.
+ * Returns the index of the first header with the given interned name, or -1 if
+ * absent. The name is only consulted if the identifier is not covered by the
+ * index of the message.
  */
 static ssize_t
-searchheader(const struct header *headers, size_t nmemb, const char *key,
-    size_t *nfound)
+headerfirst(const struct message *msg, unsigned int id, const char *name)
 {
-	struct header needle;
-	size_t hi, lo;
+	size_t i;
 
-	*nfound = 0;
+	if (id <= msg->me_nindex)
+		return (ssize_t)msg->me_index[id - 1] - 1;
 
-	if (nmemb == 0)
-		return -1;
+	for (i = 0; i < VECTOR_LENGTH(msg->me_headers); i++) {
+		if (strcasecmp(msg->me_headers[i].key, name) == 0)
+			return (ssize_t)i;
+	}
+	return -1;
+}
 
-	memset(&needle, 0, sizeof(needle));
-	needle.key = key;
-	lo = 0;
-	hi = nmemb - 1;
-	while (lo <= hi) {
-		size_t mi;
-		int cmp;
-
-		mi = lo + (hi - lo)/2;
-		cmp = cmpheaderkey(&needle, headers + mi);
-		if (cmp == 0) {
-			size_t beg, end;
-
-			/* Find the first matching header. */
-			for (beg = mi; beg > 0; beg--) {
-				if (cmpheaderkey(&needle, headers + beg - 1))
-					break;
-			}
-			/* Find the header after the last matching one. */
-			for (end = mi + 1; end < nmemb; end++) {
-				if (cmpheaderkey(&needle, headers + end))
-					break;
-			}
-			*nfound = end - beg;
-			return (ssize_t)beg;
-		}
-		if (cmp > 0)
-			lo = mi + 1;
-		else if (mi > 0)
-			hi = mi - 1;
-		else
-			break;
+/*
+ * Returns the index of the next header with the same name as the header with
+ * the given index, or -1 if absent.
+ */
+static ssize_t
+headernext(const struct message *msg, size_t idx)
+{
+	const struct header *hdr = &msg->me_headers[idx];
+	size_t i;
+
+	if (hdr->id > 0)
+		return (ssize_t)hdr->next - 1;
+
+	for (i = idx + 1; i < VECTOR_LENGTH(msg->me_headers); i++) {
+		if (strcasecmp(msg->me_headers[i].key, hdr->key) == 0)
+			return (ssize_t)i;
 	}
 	return -1;
 }
 
+/*
+ * Hash the given header name, ignoring case.
+ */
+static uint64_t
+headerhash(const char *name)
+{
+	uint64_t h = FNV1A_INIT;
+
+	for (; *name != '\0'; name++) {
+		unsigned char c = (unsigned char)tolower((unsigned char)*name);
+
+		h = fnv1a(h, &c, 1);
+	}
+	return h;
+}
+
+/*
+ * Returns the identifier of the given interned header name, zero if not
+ * interned. The caller must hold the interned lock.
+ */
+static unsigned int
+headerlookup(const char *name, uint64_t hash)
+{
+	size_t i, mask;
+
+	if (interned.nslots == 0)
+		return 0;
+
+	mask = interned.nslots - 1;
+	for (i = hash & mask; interned.slots[i] != 0; i = (i + 1) & mask) {
+		unsigned int id = interned.slots[i];
+
+		if (strcasecmp(interned.names[id - 1], name) == 0)
+			return id;
+	}
+	return 0;
+}
+
 static int
 parseattachments(struct message *msg, struct message *parent, int depth)
 {
-	struct message *attach;
-	const char *b, *beg, *body, *boundary, *end, *type;
+	struct message *attach, **dst;
+	const char *b, *beg, *body, *bodyend, *boundary, *end, *type;
+	size_t len;
 	int term;
 
 	if (depth > 4) {
@@ -871,15 +1309,14 @@ parseattachments(struct message *msg, struct message *parent, int depth)
 
 	log_debug("%s: boundary=%s, depth=%d\n", __func__, boundary, depth);
 
-	body = msg->me_body;
+	body = message_body_view(msg, &len);
+	bodyend = &body[len];
 	beg = end = NULL;
 	term = 0;
 	while (!term) {
-		size_t len;
-
 		/* Redundant, used to silence clang-tidy false positive. */
 		assert(body != NULL);
-		b = findboundary(boundary, body, &term);
+		b = findboundary(boundary, body, bodyend, &term);
 		if (b == NULL)
 			break;
 		if (beg == NULL)
@@ -890,22 +1327,25 @@ parseattachments(struct message *msg, struct message *parent, int depth)
 		if (beg == NULL || end == NULL)
 			continue;
 
-		attach = VECTOR_CALLOC(parent->me_attachments);
-		if (attach == NULL)
-			err(1, NULL);
+		attach = arena_calloc(parent->me_arena.eternal_scope, 1,
+		    sizeof(*attach));
 		attach->me_arena = parent->me_arena;
 		attach->me_fd = -1;
 		attach->me_flags = MESSAGE_FLAG_ATTACHMENT;
-		len = (size_t)(end - beg);
-		attach->me_buf = arena_strndup(attach->me_arena.eternal_scope,
-		    beg, len);
+		/* Path and name are shared with the parent. */
+		attach->me_path = parent->me_path;
+		attach->me_name = parent->me_name;
 		if (VECTOR_INIT(attach->me_headers))
 			err(1, NULL);
-		(void)strlcpy(attach->me_path, msg->me_path,
-		    sizeof(attach->me_path));
-		(void)strlcpy(attach->me_name, msg->me_name,
-		    sizeof(attach->me_name));
-		attach->me_body = message_parse_headers(attach);
+		parsepart(attach, beg, end);
+		/*
+		 * Only a pointer is stored as the vector could be reallocated
+		 * while parsing nested attachments.
+		 */
+		dst = VECTOR_ALLOC(parent->me_attachments);
+		if (dst == NULL)
+			err(1, NULL);
+		*dst = attach;
 
 		if (parseattachments(attach, parent, depth + 1)) {
 			term = 0;
@@ -918,8 +1358,36 @@ parseattachments(struct message *msg, struct message *parent, int depth)
 	return term ? 0 : 1;
 }
 
+/*
+ * Parse the headers of the given attachment spanning from beg to end within the
+ * parent message. Only the headers are copied as they are modified while being
+ * parsed, the body is left as is until needed, see message_read_body().
+ */
+static void
+parsepart(struct message *attach, const char *beg, const char *end)
+{
+	const char *p = beg;
+	size_t len, off;
+
+	/* Headers cannot span beyond the first empty line. */
+	len = (size_t)(end - beg);
+	while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+		if (p + 1 < end && p[1] == '\n') {
+			len = (size_t)(p - beg) + 1;
+			break;
+		}
+		p++;
+	}
+	attach->me_buf = arena_strndup(attach->me_arena.eternal_scope, beg, len);
+	off = (size_t)(message_parse_headers(attach) - attach->me_buf);
+	for (; &beg[off] < end && beg[off] == '\n'; off++)
+		continue;
+	attach->me_part = &beg[off];
+	attach->me_partlen = (size_t)(end - &beg[off]);
+}
+
 static const char *
-findboundary(const char *boundary, const char *s, int *term)
+findboundary(const char *boundary, const char *s, const char *end, int *term)
 {
 	size_t len;
 	int skip = 0;
@@ -933,7 +1401,7 @@ findboundary(const char *boundary, const char *s, int *term)
 
 		if (skip)
 			s = skipline(s);
-		if (*s == '\0')
+		if (s >= end || *s == '\0')
 			break;
 		skip = 1;
 		beg = s;
@@ -950,7 +1418,7 @@ findboundary(const char *boundary, const char *s, int *term)
 			s += 2;
 			*term = 1;
 		}
-		if (*s == '\n')
+		if (*s == '\n' && s < end)
 			return beg;
 	}
 
@@ -992,6 +1460,194 @@ parseboundary(const char *str, const char **boundary, struct arena_scope *s)
 	return 1;
 }
 
+/*
+ * Map the given message file into memory. The mapping is private, only pages
+ * modified while parsing the headers end up being copied. Since the parser
+ * expects a NUL-terminated buffer, the file size cannot be a multiple of the
+ * page size as the remainder of the last page is guaranteed to be zeroed.
+ * Returns NULL if the message should be read instead.
+ */
+static char *
+mapmessage(int fd, const struct stat *sb, size_t *siz)
+{
+	void *ptr;
+	long pagesiz;
+
+	if (sb == NULL || !S_ISREG(sb->st_mode) || sb->st_size < MMAP_MIN)
+		return NULL;
+	pagesiz = sysconf(_SC_PAGESIZE);
+	if (pagesiz <= 0 || sb->st_size % pagesiz == 0)
+		return NULL;
+
+	ptr = mmap(NULL, (size_t)sb->st_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED) {
+		log_debug("%s: mmap: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+	*siz = (size_t)sb->st_size;
+	return ptr;
+}
+
+/*
+ * Read the given file until the end of the headers, denoted by an empty line.
+ * The end of file flag is set if the whole file was read.
+ */
+static char *
+readheaders(int fd, struct arena_scope *s, int *eof)
+{
+	struct buffer *bf;
+	size_t off = 0;
+
+	bf = arena_buffer_alloc(s, HEADERS_CHUNK);
+	for (;;) {
+		char chunk[HEADERS_CHUNK];
+		ssize_t n;
+		size_t len;
+
+		n = read(fd, chunk, sizeof(chunk));
+		if (n == -1)
+			return NULL;
+		if (n == 0) {
+			*eof = 1;
+			break;
+		}
+		if (buffer_puts(bf, chunk, (size_t)n) == -1)
+			return NULL;
+
+		len = buffer_get_len(bf);
+		if (isseparator(buffer_get_ptr(bf), off, len))
+			break;
+		/* The separator could span across chunks. */
+		off = len > 2 ? len - 2 : 0;
+	}
+	return buffer_str(bf);
+}
+
+/*
+ * Returns non-zero if the given range of the buffer contains an empty line.
+ */
+static int
+isseparator(const char *buf, size_t off, size_t len)
+{
+	size_t i;
+
+	for (i = off; i + 1 < len; i++) {
+		if (buf[i] != '\n')
+			continue;
+		if (buf[i + 1] == '\n' ||
+		    (buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n'))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the contents of the source file to the destination file, favoring
+ * mechanisms not requiring the data to pass through userspace.
+ */
+static int
+copyfile(int srcfd, int dstfd)
+{
+	char buf[HEADERS_CHUNK];
+	off_t off = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		ssize_t n;
+
+		n = copy_file_range(srcfd, &off, dstfd, NULL, SSIZE_MAX, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			/* Not supported between the given files. */
+			if (off == 0 && (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP))
+				break;
+			warn("copy_file_range");
+			return 1;
+		}
+		if (n == 0) {
+			log_debug("%s: copy_file_range: bytes=%lld\n",
+			    __func__, (long long)off);
+			return 0;
+		}
+	}
+#endif
+
+	for (;;) {
+		ssize_t n;
+
+		n = pread(srcfd, buf, sizeof(buf), off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("pread");
+			return 1;
+		}
+		if (n == 0)
+			break;
+		if (writeall(dstfd, buf, (size_t)n))
+			return 1;
+		off += n;
+	}
+	log_debug("%s: read: bytes=%lld\n", __func__, (long long)off);
+	return 0;
+}
+
+static void
+iovset(struct iovec *iov, const char *buf, size_t len)
+{
+	iov->iov_base = (void *)(uintptr_t)buf;
+	iov->iov_len = len;
+}
+
+/*
+ * Write all given buffers, taking partial writes into account. The buffers are
+ * modified in the process.
+ */
+static int
+writevall(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n;
+
+		n = writev(fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("writev");
+			return 1;
+		}
+		for (; iovcnt > 0 && (size_t)n >= iov->iov_len; iov++, iovcnt--)
+			n -= (ssize_t)iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 0;
+}
+
+static int
+writeall(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n;
+
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("write");
+			return 1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
 static const char *
 skipline(const char *s)
 {
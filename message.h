@@ -2,6 +2,7 @@
 
 struct arena;
 struct arena_scope;
+struct stat;
 
 struct message_flags {
 	unsigned int	mf_upper;
@@ -13,8 +14,15 @@ int	 message_flags_isset(const struct message_flags *, char);
 int	 message_flags_clr(struct message_flags *, char);
 int	 message_flags_set(struct message_flags *, char);
 
-struct message	*message_parse(const char *, int, const char *,
+/* Flags passed to message_parse(). */
+#define MESSAGE_PARSE_HEADERS	0x00000001u
+#define MESSAGE_PARSE_LAZY	0x00000002u
+
+struct message	*message_parse(const char *, int, const char *, unsigned int,
     struct arena_scope *, struct arena *);
+struct message	*message_parse_buffer(const char *, const char *, const char *,
+    size_t, struct arena_scope *, struct arena *);
+int		 message_load(struct message *);
 
 int	message_write(struct message *, int);
 
@@ -22,6 +30,8 @@ int			 message_get_fd(struct message *, int);
 const char		*message_get_body(struct message *);
 const char *const	*message_get_header(const struct message *,
     const char *);
+const char *const	*message_get_header_id(const struct message *,
+    unsigned int);
 const char		*message_get_header1(const struct message *,
     const char *);
 const char		*message_get_path(const struct message *);
@@ -31,5 +41,10 @@ const char		*message_get_name(const struct message *);
 struct message	**message_get_attachments(struct message *);
 void		  message_free_attachments(struct message **);
 
+unsigned int	message_header_intern(const char *);
+
 void	message_set_header(struct message *, const char *, const char *);
 int	message_set_file(struct message *, const char *, const char *, int);
+
+int	message_stat(struct message *, struct stat *);
+void	message_set_stat(struct message *, const struct stat *);
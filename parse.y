@@ -23,6 +23,7 @@
 #include "expr.h"
 #include "macro.h"
 #include "string-list.h"
+#include "sync.h"
 #include "util.h"
 
 #define YY_NO_LEAKS
@@ -68,6 +69,7 @@ static struct {
 	int				 error;
 	int				 sflag;
 	int				 pflag;
+	int				 yflag;	/* sync defined */
 } parser_state;
 
 typedef struct {
@@ -92,7 +94,9 @@ typedef struct {
 %token ACCESS
 %token ADDHEADER
 %token ALL
+%token ALWAYS
 %token ATTACHMENT
+%token BATCH
 %token BODY
 %token BREAK
 %token COMMAND
@@ -100,6 +104,7 @@ typedef struct {
 %token DATE
 %token DISCARD
 %token EXEC
+%token FILENAME
 %token FLAG
 %token FLAGS
 %token HEADER
@@ -110,6 +115,7 @@ typedef struct {
 %token MODIFIED
 %token MOVE
 %token NEW
+%token NONE
 %token OLD
 %token PASS
 %token REJECT
@@ -132,6 +138,7 @@ typedef struct {
 %type	<number>	exec_flags
 %type	<number>	optneg
 %type	<number>	scalar
+%type	<number>	sync_policy
 %token	<pattern>	PATTERN
 %type	<pattern>	pattern
 %token	<string>	MACRO
@@ -151,6 +158,7 @@ typedef struct {
 grammar		: /* empty */
 		| grammar macro
 		| grammar maildir
+		| grammar sync
 		| error {
 			yyrecover();
 		}
@@ -173,6 +181,25 @@ macro		: MACRO '=' STRING {
 		}
 		;
 
+sync		: SYNC sync_policy {
+			if (parser_state.yflag)
+				yyerror("sync already defined");
+			parser_state.yflag = 1;
+			parser_state.config->cl_sync = (int)$2;
+		}
+		;
+
+sync_policy	: ALWAYS {
+			$$ = SYNC_ALWAYS;
+		}
+		| BATCH {
+			$$ = SYNC_BATCH;
+		}
+		| NONE {
+			$$ = SYNC_NONE;
+		}
+		;
+
 maildir		: maildir_paths exprblock {
 			struct config *conf;
 			const struct string *str;
@@ -304,7 +331,7 @@ expr3		: BODY pattern {
 			    parser_state.scope))
 				yyerror("invalid pattern: %s", errstr);
 			$2 = expandstrings($2, MACRO_CTX_DEFAULT);
-			expr_set_strings($$, $2);
+			expr_set_header($$, $2, parser_state.scope);
 		}
 		| DATE date_field date_cmp date_age {
 			$$ = expr_alloc(EXPR_TYPE_DATE, parser_state.lineno,
@@ -469,6 +496,9 @@ date_field	: /* empty */ {
 		| CREATED {
 			$$ = EXPR_DATE_FIELD_CREATED;
 		}
+		| FILENAME {
+			$$ = EXPR_DATE_FIELD_FILENAME;
+		}
 		;
 
 date_cmp	: '<' {
@@ -557,6 +587,12 @@ config_list_parse(struct config_list *cl, const char *path,
 	yyparse();
 	fclose(parser_state.fh);
 	macros_validate(parser_state.config->cl_macros, scratch);
+	if (parser_state.error == 0) {
+		size_t i;
+
+		for (i = 0; i < VECTOR_LENGTH(cl->cl_list); i++)
+			expr_compile(cl->cl_list[i].expr, s);
+	}
 	return parser_state.error;
 }
 
@@ -608,8 +644,10 @@ yylex1(int last_token)
 		{ "access",		ACCESS },
 		{ "add-header",		ADDHEADER },
 		{ "all",		ALL },
+		{ "always",		ALWAYS },
 		{ "and",		AND },
 		{ "attachment",		ATTACHMENT },
+		{ "batch",		BATCH },
 		{ "body",		BODY },
 		{ "break",		BREAK },
 		{ "command",		COMMAND },
@@ -617,6 +655,7 @@ yylex1(int last_token)
 		{ "date",		DATE },
 		{ "discard",		DISCARD },
 		{ "exec",		EXEC },
+		{ "filename",		FILENAME },
 		{ "flag",		FLAG },
 		{ "flags",		FLAGS },
 		{ "header",		HEADER },
@@ -627,11 +666,13 @@ yylex1(int last_token)
 		{ "modified",		MODIFIED },
 		{ "move",		MOVE },
 		{ "new",		NEW },
+		{ "none",		NONE },
 		{ "old",		OLD },
 		{ "or",			OR },
 		{ "pass",		PASS },
 		{ "reject",		REJECT },
 		{ "stdin",		STDIN },
+		{ "sync",		SYNC },
 
 		{ NULL,		0 },
 	};
@@ -0,0 +1,262 @@
+#include "sync.h"
+#include "config.h"
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>	/* PATH_MAX */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libks/compiler.h"
+#include "fault.h"
+#include "log.h"
+
+/*
+ * Upper bound for the number of files and directories awaiting to be synced
+ * while using the batch policy.
+ */
+#define SYNC_BATCH_MAX		64
+
+/*
+ * Upper bound for the number of milliseconds files and directories are allowed
+ * to await being synced while using the batch policy.
+ */
+#define SYNC_BATCH_INTERVAL	1000
+
+struct sync_pending {
+	char	path[PATH_MAX];	/* empty unless directory */
+	int	fd;
+};
+
+static int	sync_add(int, const char *);
+static int	sync_expired(void);
+static int	sync_fd(int, dev_t *, size_t *);
+
+static struct sync_pending	pending[SYNC_BATCH_MAX];
+static size_t			npending = 0;
+static char			unlinks[SYNC_BATCH_MAX][PATH_MAX];
+static size_t			nunlinks = 0;
+static struct timespec		first;
+static enum sync_policy		policy = SYNC_ALWAYS;
+
+/*
+ * Set the durability policy, must be one of the following:
+ *
+ *     SYNC_ALWAYS    Sync each written file before returning.
+ *
+ *     SYNC_BATCH     Defer syncing written files and the directories affected
+ *                    by renames until sync_flush() is invoked or enough files
+ *                    are pending. Removal of superseded files is deferred
+ *                    likewise.
+ *
+ *     SYNC_NONE      Never sync.
+ */
+void
+sync_init(enum sync_policy p)
+{
+	/* Do not lose anything pending according to the previous policy. */
+	(void)sync_flush();
+	policy = p;
+}
+
+/*
+ * Sync the given file according to the policy. Returns zero on success,
+ * non-zero otherwise.
+ */
+int
+sync_file(int fd)
+{
+	switch (policy) {
+	case SYNC_ALWAYS:
+		if (fsync(fd) == -1) {
+			warn("fsync");
+			return 1;
+		}
+		return 0;
+	case SYNC_BATCH:
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (fd == -1) {
+			warn("fcntl");
+			return 1;
+		}
+		return sync_add(fd, NULL);
+	case SYNC_NONE:
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Remove the given file which has been superseded by a newly written file.
+ * Under the batch policy, the removal is deferred until all pending files are
+ * synced as a crash in between could otherwise lose both files. Returns zero on
+ * success, non-zero otherwise.
+ */
+int
+sync_unlink(const char *path)
+{
+	if (policy != SYNC_BATCH) {
+		if (unlink(path) == -1) {
+			warn("unlink: %s", path);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (nunlinks == SYNC_BATCH_MAX && sync_flush())
+		return 1;
+	if (strlcpy(unlinks[nunlinks], path, sizeof(unlinks[0])) >=
+	    sizeof(unlinks[0])) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+	nunlinks++;
+	return 0;
+}
+
+/*
+ * Sync the given directory, after renaming files in or out of it. Only
+ * honored by the batch policy. Returns zero on success, non-zero otherwise.
+ */
+int
+sync_dir(const char *path)
+{
+	size_t i;
+	int fd;
+
+	if (policy != SYNC_BATCH)
+		return 0;
+
+	for (i = 0; i < npending; i++) {
+		if (strcmp(pending[i].path, path) == 0)
+			return 0;
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		warn("open: %s", path);
+		return 1;
+	}
+	return sync_add(fd, path);
+}
+
+/*
+ * Sync all pending files and directories followed by removing the superseded
+ * files. The superseded files are kept if syncing failed. Returns zero on
+ * success, non-zero otherwise.
+ */
+int
+sync_flush(void)
+{
+	dev_t devs[SYNC_BATCH_MAX];
+	size_t i;
+	size_t ndevs = 0;
+	size_t nunlinked = 0;
+	int error = 0;
+
+	if (npending == 0 && nunlinks == 0)
+		return 0;
+
+	for (i = 0; i < npending; i++) {
+		if (sync_fd(pending[i].fd, devs, &ndevs))
+			error = 1;
+		close(pending[i].fd);
+	}
+	if (FAULT("sync_flush"))
+		error = 1;
+	for (i = 0; !error && i < nunlinks; i++) {
+		if (unlink(unlinks[i]) == -1) {
+			warn("unlink: %s", unlinks[i]);
+			error = 1;
+		} else {
+			nunlinked++;
+		}
+	}
+	log_debug("%s: pending=%zu, syncs=%zu, unlinks=%zu\n", __func__,
+	    npending, ndevs > 0 ? ndevs : npending, nunlinked);
+	npending = 0;
+	nunlinks = 0;
+
+	return error;
+}
+
+/*
+ * Add the given file descriptor to the pending ones, the file descriptor is
+ * owned by this module from now on.
+ */
+static int
+sync_add(int fd, const char *path)
+{
+	struct sync_pending *sp;
+
+	if (npending == 0)
+		(void)clock_gettime(CLOCK_MONOTONIC, &first);
+	sp = &pending[npending++];
+	sp->fd = fd;
+	if (path != NULL)
+		(void)strlcpy(sp->path, path, sizeof(sp->path));
+	else
+		sp->path[0] = '\0';
+
+	if (npending == SYNC_BATCH_MAX || sync_expired())
+		return sync_flush();
+	return 0;
+}
+
+static int
+sync_expired(void)
+{
+	struct timespec now;
+	long long ms;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		return 1;
+	ms = (now.tv_sec - first.tv_sec) * 1000LL +
+	    (now.tv_nsec - first.tv_nsec) / 1000000LL;
+	return ms >= SYNC_BATCH_INTERVAL;
+}
+
+#ifdef HAVE_SYNCFS
+
+/*
+ * Sync the file system associated with the given file descriptor, unless
+ * already synced as one sync per file system covers all pending files and
+ * directories.
+ */
+static int
+sync_fd(int fd, dev_t *devs, size_t *ndevs)
+{
+	struct stat sb;
+	size_t i;
+
+	if (fstat(fd, &sb) == -1) {
+		warn("fstat");
+		return 1;
+	}
+	for (i = 0; i < *ndevs; i++) {
+		if (devs[i] == sb.st_dev)
+			return 0;
+	}
+	devs[(*ndevs)++] = sb.st_dev;
+
+	if (syncfs(fd) == -1) {
+		warn("syncfs");
+		return 1;
+	}
+	return 0;
+}
+
+#else
+
+static int
+sync_fd(int fd, dev_t *UNUSED(devs), size_t *UNUSED(ndevs))
+{
+	if (fsync(fd) == -1) {
+		warn("fsync");
+		return 1;
+	}
+	return 0;
+}
+
+#endif
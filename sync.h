@@ -0,0 +1,12 @@
+/* Durability policies, see sync_init(). */
+enum sync_policy {
+	SYNC_ALWAYS,
+	SYNC_BATCH,
+	SYNC_NONE,
+};
+
+void	sync_init(enum sync_policy);
+int	sync_file(int);
+int	sync_unlink(const char *);
+int	sync_dir(const char *);
+int	sync_flush(void);
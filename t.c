@@ -1,10 +1,13 @@
 #include "config.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "libks/arena.h"
 #include "decode.h"
+#include "dfa.h"
+#include "literal.h"
 
 struct test_context {
 	struct {
@@ -26,6 +29,34 @@ static int	test_rfc2047_decode0(struct test_context *, const char *,
     const char *, const char *,
     int);
 
+#define test_dfa_match(pattern, icase, str, exp)			\
+	error |= test_dfa_match0(&c, (pattern), (icase), (str), (exp),	\
+	    "dfa_match", __LINE__);					\
+	if (xflag && error) goto out
+static int	test_dfa_match0(struct test_context *, const char *, int,
+    const char *, int, const char *, int);
+
+#define test_literal_required(pattern, icase, exp)			\
+	error |= test_literal_required0(&c, (pattern), (icase), (exp),	\
+	    "literal_required", __LINE__);				\
+	if (xflag && error) goto out
+static int	test_literal_required0(struct test_context *, const char *, int,
+    const char *, const char *, int);
+
+#define test_literal_find(str, literal, icase, exp)			\
+	error |= test_literal_find0((str), (literal), (icase), (exp),	\
+	    "literal_find", __LINE__);					\
+	if (xflag && error) goto out
+static int	test_literal_find0(const char *, const char *, int, int,
+    const char *, int);
+
+#define test_literal_set_search(literals, str, exp)			\
+	error |= test_literal_set_search0(&c, (literals), (str), (exp),	\
+	    "literal_set_search", __LINE__);				\
+	if (xflag && error) goto out
+static int	test_literal_set_search0(struct test_context *, const char *,
+    const char *, uint64_t, const char *, int);
+
 static void	usage(void) __attribute__((noreturn));
 
 int
@@ -76,6 +107,67 @@ main(int argc, char *argv[])
 	test_rfc2047_decode("=?UTF-8?", "=?UTF-8?");
 	test_rfc2047_decode("=?UTF-8?Q", "=?UTF-8?Q");
 
+	test_dfa_match("abc", 0, "xabcx", DFA_MATCH);
+	test_dfa_match("abc", 0, "xabx", DFA_NOMATCH);
+	test_dfa_match("abc", 0, "xABCx", DFA_NOMATCH);
+	test_dfa_match("abc", 1, "xABCx", DFA_MATCH);
+	test_dfa_match("^a(b|c)+d$", 0, "abcbd", DFA_MATCH);
+	test_dfa_match("^a(b|c)+d$", 0, "ad", DFA_NOMATCH);
+	test_dfa_match("^b", 0, "a\nb", DFA_MATCH);
+	test_dfa_match("a$", 0, "a\nb", DFA_MATCH);
+	test_dfa_match("a.b", 0, "a\nb", DFA_NOMATCH);
+	test_dfa_match("a[^x]b", 0, "a\nb", DFA_NOMATCH);
+	test_dfa_match("x{2,3}y", 0, "xxy", DFA_MATCH);
+	test_dfa_match("^x{2,3}y", 0, "xxxxy", DFA_NOMATCH);
+	test_dfa_match("[[:digit:]]+-[a-f]", 0, "12-e", DFA_MATCH);
+	test_dfa_match("[[:upper:]]", 1, "a", DFA_MATCH);
+	test_dfa_match("^$", 0, "", DFA_MATCH);
+	test_dfa_match("^$", 0, "a\n\nb", DFA_MATCH);
+	test_dfa_match("a.b", 0, "a\xc3\xa5" "b", DFA_UNKNOWN);
+	test_dfa_match("a\\1", 0, "a", DFA_UNKNOWN);
+	test_dfa_match("a|", 0, "a", DFA_UNKNOWN);
+	test_dfa_match("[[=a=]]", 0, "a", DFA_UNKNOWN);
+	test_dfa_match("[a-Z]", 0, "a", DFA_UNKNOWN);
+
+	test_literal_required("", 0, NULL);
+	test_literal_required("foo", 0, "foo");
+	test_literal_required("^foo$", 0, "foo");
+	test_literal_required("user@example\\.com", 0, "user@example.com");
+	test_literal_required("foo|bar", 0, NULL);
+	test_literal_required("(foo|bar)baz", 0, "baz");
+	test_literal_required("[a-z]+@example", 0, "@example");
+	test_literal_required("[]a]bc", 0, "bc");
+	test_literal_required("[[:alpha:]]bc", 0, "bc");
+	test_literal_required("fooo*bar", 0, "foo");
+	test_literal_required("fo?obar", 0, "obar");
+	test_literal_required("ab+cd", 0, "ab");
+	test_literal_required("abc{0,2}de", 0, "ab");
+	test_literal_required("abc{1,2}de", 0, "abc");
+	test_literal_required("a{", 0, NULL);
+	test_literal_required("a.b.cd", 0, "cd");
+	test_literal_required("\\(a\\)", 0, "(a)");
+	test_literal_required("foo\\wbar", 0, "foo");
+	test_literal_required("\xc3\xa5\xc3\xa4*", 0, "\xc3\xa5");
+	test_literal_required("list", 1, "l");
+	test_literal_required("kelvin", 1, "elv");
+	test_literal_required("\xc3\xa5" "ab", 1, "ab");
+
+	test_literal_find("", "foo", 0, 0);
+	test_literal_find("foo", "foo", 0, 1);
+	test_literal_find("xfoox", "foo", 0, 1);
+	test_literal_find("xFoOx", "foo", 0, 0);
+	test_literal_find("xFoOx", "foo", 1, 1);
+	test_literal_find("ffofoo", "FOO", 1, 1);
+	test_literal_find("ffofo", "FOO", 1, 0);
+	test_literal_find("@example.com", "@EXAMPLE.COM", 1, 1);
+
+	test_literal_set_search("foo", "", 0x0);
+	test_literal_set_search("foo", "FoO", 0x1);
+	test_literal_set_search("foo bar", "bar", 0x2);
+	test_literal_set_search("he she his hers", "ahishers", 0xf);
+	test_literal_set_search("abcd bc c", "abce", 0x6);
+	test_literal_set_search("a a", "a", 0x3);
+
 out:
 	arena_free(c.arena.scratch);
 	return error;
@@ -115,7 +207,7 @@ test_base64_decode0(struct test_context *c, const char *str, const char *exp,
 
 	arena_scope(c->arena.scratch, s);
 
-	act = base64_decode(str, &s);
+	act = base64_decode(str, strlen(str), &s);
 	if (strcmp(exp, act) != 0) {
 		fprintf(stderr, "%s:%d:\n\texp %s\n\tgot %s\n",
 		    fun, lno, exp, act);
@@ -123,3 +215,88 @@ test_base64_decode0(struct test_context *c, const char *str, const char *exp,
 	}
 	return error;
 }
+
+static int
+test_dfa_match0(struct test_context *c, const char *pattern, int icase,
+    const char *str, int exp, const char *fun, int lno)
+{
+	struct dfa *df;
+	int act;
+
+	arena_scope(c->arena.scratch, s);
+
+	/* Unsupported patterns are expected to be equivalent to unknown. */
+	df = dfa_compile(pattern, icase, &s);
+	act = df == NULL ? DFA_UNKNOWN : dfa_match(df, str);
+	if (act != exp) {
+		fprintf(stderr, "%s:%d:\n\texp %d\n\tgot %d\n",
+		    fun, lno, exp, act);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+test_literal_required0(struct test_context *c, const char *pattern, int icase,
+    const char *exp, const char *fun, int lno)
+{
+	const char *act;
+	int error = 0;
+
+	arena_scope(c->arena.scratch, s);
+
+	act = literal_required(pattern, icase, &s);
+	if (exp == NULL && act != NULL) {
+		fprintf(stderr, "%s:%d:\n\texp NULL\n\tgot %s\n",
+		    fun, lno, act);
+		error = 1;
+	} else if (exp != NULL && (act == NULL || strcmp(exp, act) != 0)) {
+		fprintf(stderr, "%s:%d:\n\texp %s\n\tgot %s\n",
+		    fun, lno, exp, act != NULL ? act : "NULL");
+		error = 1;
+	}
+	return error;
+}
+
+static int
+test_literal_find0(const char *str, const char *literal, int icase, int exp,
+    const char *fun, int lno)
+{
+	int act;
+
+	act = literal_find(str, literal, icase);
+	if (act != exp) {
+		fprintf(stderr, "%s:%d:\n\texp %d\n\tgot %d\n",
+		    fun, lno, exp, act);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+test_literal_set_search0(struct test_context *c, const char *literals,
+    const char *str, uint64_t exp, const char *fun, int lno)
+{
+	const char *argv[64];
+	struct literal_set *ls;
+	char *buf, *lit;
+	uint64_t act = 0;
+	size_t argc = 0;
+	int error = 0;
+
+	arena_scope(c->arena.scratch, s);
+
+	/* Literals are separated by space. */
+	buf = arena_strdup(&s, literals);
+	while ((lit = strsep(&buf, " ")) != NULL)
+		argv[argc++] = lit;
+	ls = literal_set_alloc(argv, argc, &s);
+	literal_set_search(ls, str, &act);
+	if (act != exp) {
+		fprintf(stderr, "%s:%d:\n\texp %#llx\n\tgot %#llx\n",
+		    fun, lno, (unsigned long long)exp,
+		    (unsigned long long)act);
+		error = 1;
+	}
+	return error;
+}
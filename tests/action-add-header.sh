@@ -37,3 +37,69 @@ if testcase "dry run"; then
 $(findmsg "src/new") -> <add-header "Subject" "Hello">
 EOF
 fi
+
+if testcase "label and add header"; then
+	mkmd "src"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all label "label" add-header "Subject" "Hello"
+	}
+	EOF
+	mdsort
+	assert_label label "$(findmsg "src/new")"
+	assert_header "Subject" "Hello" "$(findmsg "src/new")"
+fi
+
+if testcase "add header and discard"; then
+	mkmd "src"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all add-header "Subject" "Hello" pass
+		match all discard
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+fi
+
+if testcase "add header and exec"; then
+	mkmd "src"
+	echo body | mkmsg -b "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all add-header "Subject" "Hello" exec stdin "cat"
+	}
+	EOF
+	mdsort - <<-EOF
+	Content-Type: text/plain
+	Subject: Hello
+
+	body
+	EOF
+fi
+
+if testcase "add header preserves order"; then
+	mkmd "src"
+	echo body | mkmsg -b -H "src/new" -- \
+		"To" "user@example.com" \
+		"Subject" "Hello" \
+		"Received" "one" \
+		"SUBJECT" "Hi" \
+		"received" "two"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Received" /two/
+			add-header "subject" "Bye" exec stdin "cat"
+	}
+	EOF
+	mdsort - <<-EOF
+	To: user@example.com
+	Subject: Bye
+	Received: one
+	received: two
+
+	body
+	EOF
+fi
@@ -27,6 +27,24 @@ if testcase "discard"; then
 	assert_empty "src/new"
 fi
 
+if testcase "many messages"; then
+	mkmd "src"
+	_i=0
+	while [ "${_i}" -lt 40 ]; do
+		mkmsg "src/new" -- "To" "discard"
+		_i=$((_i + 1))
+	done
+	mkmsg "src/new" -- "To" "keep"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "To" /discard/ discard
+	}
+	EOF
+	mdsort
+	assert_eq "1" "$(find "${TSHDIR}/src/new" -type f | wc -l | xargs)"
+	findmsg -g "keep" "src/new" >/dev/null
+fi
+
 if testcase "dry run"; then
 	mkmd "src"
 	mkmsg "src/new" -- "To" "user@example.com"
@@ -41,3 +59,21 @@ mdsort.conf:2: To: user@example.com
                    ^  $
 EOF
 fi
+
+# Pending header modifications must not be written as the message is about to
+# be removed, writing the message would require its body to be read.
+if testcase "discard after header modification"; then
+	mkmd "src"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all add-header "Subject" "Hello" pass
+		match all discard
+	}
+	EOF
+	mdsort -- -vv >"${TMP1}"
+	if grep -q '^message_read_body:' "${TMP1}"; then
+		fail "message written before discard"
+	fi
+	assert_empty "src/new"
+fi
@@ -238,6 +238,24 @@ if testcase -t fault "unlink failure"; then
 	findmsg "src/new" | assert_file "${TMP1}" -
 fi
 
+# Ensure the message written to the destination maildir is removed if removing
+# the old message failed.
+if testcase -t fault "label and move unlink failure"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	findmsg "src/new" >"${TMP1}"
+	cat >"${CONF}" <<-EOF
+	maildir "src" {
+		match all label "foo" move "dst"
+	}
+	EOF
+	mdsort -e -f "name=maildir_unlink,errno=ENOENT" - <<-EOF
+	mdsort: fault: maildir_unlink
+	EOF
+	findmsg "src/new" | assert_file "${TMP1}" -
+	assert_empty "dst/new"
+fi
+
 if testcase -t fault "message path too long"; then
 	mkmd "src"
 	mkmsg "src/new"
@@ -267,3 +285,74 @@ $(findmsg "src/new") -> <label "label">
 $(findmsg "src/new") -> <move "dst/new">
 EOF
 fi
+
+if testcase "large headers and body"; then
+	mkmd "src"
+	_subject="$(genstr 8192)"
+	genstr 8192 | mkmsg -H -b "src/new" -- "Subject" "${_subject}"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /x/ label "label"
+	}
+	EOF
+	{
+		echo "Subject: ${_subject}"
+		echo "X-Label: label"
+		echo
+		genstr 8192
+	} >"${TMP1}"
+	mdsort
+	assert_file "$(findmsg -p "src/new")" "${TMP1}"
+fi
+
+if testcase "sync policies"; then
+	for _policy in batch none; do
+		mkmd "src-${_policy}" "dst-${_policy}"
+		mkmsg "src-${_policy}/new"
+		cat <<-EOF >"${CONF}"
+		sync ${_policy}
+		maildir "src-${_policy}" {
+			match all label "label" move "dst-${_policy}"
+		}
+		EOF
+		mdsort
+		assert_empty "src-${_policy}/new"
+		assert_label label "$(findmsg "dst-${_policy}/new")"
+	done
+fi
+
+# Under the batch policy, the old messages must only be removed once the new
+# messages are synced.
+if testcase "sync batch removal"; then
+	mkmd "src"
+	mkmsg "src/new"
+	mkmsg "src/new"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	sync batch
+	maildir "src" {
+		match all label "label"
+	}
+	EOF
+	mdsort -- -vv >"${TMP1}"
+	assert_eq "unlinks=3" \
+		"$(sed -n -e 's/^sync_flush: .*\(unlinks=[0-9]*\)$/\1/p' "${TMP1}")"
+	assert_eq "3" "$(find "${TSHDIR}/src/new" -type f | wc -l | xargs)"
+fi
+
+# Under the batch policy, the old message must be kept if syncing the new
+# message failed.
+if testcase -t fault "sync batch failure"; then
+	mkmd "src"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	sync batch
+	maildir "src" {
+		match all label "label"
+	}
+	EOF
+	mdsort -e -f "name=sync_flush" - <<-EOF
+	mdsort: fault: sync_flush
+	EOF
+	assert_eq "2" "$(find "${TSHDIR}/src/new" -type f | wc -l | xargs)"
+fi
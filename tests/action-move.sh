@@ -11,6 +11,38 @@ if testcase "many move actions"; then
 	refute_empty "dst3/new"
 fi
 
+if testcase "many messages same destination"; then
+	mkmd "src" "dst"
+	for _i in 1 2 3; do
+		mkmsg "src/new"
+	done
+	cat <<-EOF >"${CONF}"
+	maildir "src" { match all move "dst" }
+	EOF
+	mdsort
+	assert_empty "src/new"
+	assert_eq "3" "$(find "${TSHDIR}/dst/new" -type f | wc -l | xargs)"
+fi
+
+# Exceed the number of destination maildirs kept open.
+if testcase "many destinations"; then
+	mkmd "src"
+	_i=0
+	while [ "${_i}" -lt 70 ]; do
+		mkmd "dst${_i}"
+		mkmsg "src/new" -- "To" "dst${_i}"
+		mkmsg "src/new" -- "To" "dst${_i}"
+		_i=$((_i + 1))
+	done
+	cat <<-'EOF' >"${CONF}"
+	maildir "src" { match header "To" /(.+)/ move "\1" }
+	EOF
+	mdsort
+	assert_empty "src/new"
+	assert_eq "2" "$(find "${TSHDIR}/dst0/new" -type f | wc -l | xargs)"
+	assert_eq "2" "$(find "${TSHDIR}/dst69/new" -type f | wc -l | xargs)"
+fi
+
 if testcase "destination missing"; then
 	mkmd "src"
 	mkmsg "src/new"
@@ -64,6 +96,35 @@ if testcase -t fault "exdev"; then
 	assert_file "${TMP1}" - <"$(findmsg -p "dst/new")"
 fi
 
+# The fallback logic must observe modifications made by preceding actions.
+if testcase -t fault "exdev modified"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" { match all label "label" exec "true" move "dst" }
+	EOF
+	mdsort -f "name=maildir_rename,errno=EXDEV" - <<-EOF
+	mdsort: fault: maildir_rename
+	EOF
+	assert_empty "src/new"
+	assert_label label "$(findmsg "dst/new")"
+fi
+
+if testcase -t fault "exdev modification time"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	touch -t 202001010000 "$(findmsg -p "src/new")"
+	touch -t 202001010001 "${TMP1}"
+	cat <<-EOF >"${CONF}"
+	maildir "src" { match all move "dst" }
+	EOF
+	mdsort -f "name=maildir_rename,errno=EXDEV" - <<-EOF
+	mdsort: fault: maildir_rename
+	EOF
+	refute_empty "dst/new"
+	find "${TSHDIR}/dst/new" -type f -newer "${TMP1}" | assert_file - /dev/null
+fi
+
 # Ensure that a failure in the message write fallback logic does not leave any
 # broken message behind.
 if testcase -t fault "exdev write failure"; then
@@ -109,6 +170,19 @@ if testcase -t fault "message path too long"; then
 	refute_empty "dst/new"
 fi
 
+if testcase "modification time"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	touch -t 202001010000 "$(findmsg -p "src/new")"
+	touch -t 202001010001 "${TMP1}"
+	cat <<-EOF >"${CONF}"
+	maildir "src" { match all move "dst" exec "true" }
+	EOF
+	mdsort
+	refute_empty "dst/new"
+	find "${TSHDIR}/dst/new" -type f -newer "${TMP1}" | assert_file - /dev/null
+fi
+
 if testcase -t fault "rename failure"; then
 	mkmd "src" "dst"
 	mkmsg "src/new"
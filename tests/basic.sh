@@ -405,3 +405,20 @@ if testcase -t fault "readdir unknown file type"; then
 	assert_empty "src/new"
 	refute_empty "dst/new"
 fi
+
+# The file status resolved while reading the directory must be reused.
+if testcase -t fault "readdir unknown file type status"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match date modified < 1 minute move "dst"
+	}
+	EOF
+	mdsort -f "name=readdir_type" -- -vv >"${TMP1}"
+	if grep -q '^message_stat:' "${TMP1}"; then
+		fail "file status resolved twice"
+	fi
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
@@ -0,0 +1,85 @@
+if testcase "cache unchanged message"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "Subject" "aaa"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /bbb/ move "dst"
+	}
+	EOF
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	refute_empty "src/new"
+	assert_find "cache/mdsort" "verdicts"
+
+	# Change the message while preserving inode, size and mtime.
+	_path="$(findmsg -p "src/new")"
+	cp -p "${_path}" "${TMP1}"
+	sed -e 's/aaa/bbb/' "${TMP1}" >"${_path}"
+	touch -r "${TMP1}" "${_path}"
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	refute_empty "src/new"
+	assert_empty "dst/new"
+
+	# Without the cache, the message must be moved.
+	mdsort
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
+if testcase "cache changed message"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "Subject" "aaa"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /bbb/ move "dst"
+	}
+	EOF
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	refute_empty "src/new"
+
+	_path="$(findmsg -p "src/new")"
+	echo "Subject: bbbb" >"${_path}"
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
+if testcase "cache changed rule"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "Subject" "aaa"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /bbb/ move "dst"
+	}
+	EOF
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	refute_empty "src/new"
+
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /aaa/ move "dst"
+	}
+	EOF
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
+if testcase "cache date is never cached"; then
+	mkmd "src" "dst"
+	mkmsg -m 201901010000 "src/new" -- "Subject" "aaa"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /bbb/ and date modified > 1 second \
+			move "dst"
+	}
+	EOF
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+
+	_path="$(findmsg -p "src/new")"
+	cp -p "${_path}" "${TMP1}"
+	sed -e 's/aaa/bbb/' "${TMP1}" >"${_path}"
+	touch -r "${TMP1}" "${_path}"
+	XDG_CACHE_HOME="${TSHDIR}/cache" mdsort -- -c
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
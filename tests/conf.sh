@@ -54,6 +54,25 @@ if testcase "sanity"; then
 	mdsort - -- -n </dev/null
 fi
 
+if testcase "sync"; then
+	for _policy in always batch none; do
+		cat <<-EOF >"${CONF}"
+		sync ${_policy}
+		EOF
+		mdsort - -- -n </dev/null
+	done
+fi
+
+if testcase "sync already defined"; then
+	cat <<-EOF >"${CONF}"
+	sync batch
+	sync none
+	EOF
+	mdsort -e - -- -n <<-EOF
+	mdsort.conf:2: sync already defined
+	EOF
+fi
+
 if testcase "empty"; then
 	: >"${CONF}"
 	mdsort - -- -n </dev/null
@@ -12,3 +12,45 @@ if testcase "many maildirs"; then
 	assert_empty "src2/new"
 	refute_empty "dst/new"
 fi
+
+if testcase "many messages with jobs"; then
+	mkmd "src" "dst"
+	_i=0
+	while [ "${_i}" -lt 32 ]; do
+		mkmsg "src/new" -- "Subject" "${_i}"
+		_i=$((_i + 1))
+	done
+	mkmsg "src/cur" -- "Subject" "keep"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /^[0-9]+$/ move "dst"
+	}
+	EOF
+	mdsort -- -j 4
+	assert_empty "src/new"
+	refute_empty "src/cur"
+	if [ "$(find "${TSHDIR}/dst/new" -type f | wc -l)" -ne 32 ]; then
+		fail "expected 32 messages in dst/new"
+	fi
+fi
+
+if testcase "many maildirs with jobs"; then
+	_dirs=""
+	_i=0
+	while [ "${_i}" -lt 100 ]; do
+		mkmd "src${_i}"
+		mkmsg "src${_i}/new"
+		_dirs="${_dirs} \"src${_i}\""
+		_i=$((_i + 1))
+	done
+	mkmd "dst"
+	cat <<-EOF >"${CONF}"
+	maildir { ${_dirs} } {
+		match all move "dst"
+	}
+	EOF
+	mdsort -- -j 2
+	if [ "$(find "${TSHDIR}/dst/new" -type f | wc -l)" -ne 100 ]; then
+		fail "expected 100 messages in dst/new"
+	fi
+fi
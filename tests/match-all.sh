@@ -14,3 +14,50 @@ if testcase "basic"; then
 	assert_empty "src/new"
 	refute_empty "dst/new"
 fi
+
+if testcase "negate"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match ! all move "nein"
+		match ! all or ! ! all move "dst"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
+if testcase "and or"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "To" "user@example.com"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "To" /admin/ and all move "nein"
+		match all and ! all or header "To" /user/ label "\0" move "dst"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	assert_label user "$(findmsg "dst/new")"
+fi
+
+# Any subsequent match is unreachable, except for break.
+if testcase "unreachable"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all {
+			match all break
+			match all move "nein"
+		}
+		match all move "dst"
+		match all move "nein"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
@@ -256,6 +256,46 @@ if testcase "nested"; then
 	refute_empty "dst/new"
 fi
 
+# The body of an attachment is only a view of the parent message, decoding must
+# therefore not read beyond the attachment.
+if testcase "nested with siblings"; then
+	mkmd "src" "dst"
+	mkmsg -b -H "src/new" <<-EOF -- \
+		"Content-Type" "multipart/mixed; boundary=\"one\""
+	--one
+	Content-Type: multipart/mixed; boundary="two"
+
+	--two
+	Content-Type: text/plain
+
+	First.
+	--two
+	Content-Type: text/plain
+	Content-Transfer-Encoding: base64
+
+	U2Vjb25kLg==
+	--two
+	Content-Type: text/plain
+
+	Third.
+	--two--
+	--one
+	Content-Type: text/plain
+
+	Fourth.
+	--one--
+	EOF
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match attachment body /^Second\.$/ and \
+			attachment body /^Fourth\.$/ move "dst"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
 if testcase "nested too deep"; then
 	mkmd "src"
 
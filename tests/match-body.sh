@@ -145,3 +145,22 @@ mdsort.conf:2: Body: src/tests/modules: t_kcov.c
                                           ^  $
 EOF
 fi
+
+if testcase "large body"; then
+	mkmd "src"
+	{ genstr 100000; echo " Bob"; } | mkmsg -H -b "src/new" -- "To" "user@example.com"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match body /x Bob$/ label "label"
+	}
+	EOF
+	{
+		echo "To: user@example.com"
+		echo "X-Label: label"
+		echo
+		genstr 100000
+		echo " Bob"
+	} >"${TMP1}"
+	mdsort
+	assert_file "$(findmsg -p "src/new")" "${TMP1}"
+fi
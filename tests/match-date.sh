@@ -202,3 +202,67 @@ if testcase "modified"; then
 	assert_empty "src/new"
 	refute_empty "dst/new"
 fi
+
+if testcase "multiple fields"; then
+	mkmd "src" "dst"
+	mkmsg -m "$(now -f "%Y%m%d%H%M.%S" -60)" "src/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match date modified > 30 seconds and
+		      ! date modified > 90 seconds and
+		      date created < 30 seconds move "dst"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	refute_empty "dst/new"
+fi
+
+if testcase "filename"; then
+	mkmd "src" "dst"
+	mkmsg "src/new"
+	echo "Subject: recent" >"${TSHDIR}/src/new/$(now -f %s).1_1.hostname"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match date filename > 1 week move "dst"
+	}
+	EOF
+	mdsort
+	findmsg -g "recent" "src/new" >/dev/null
+	refute_empty "dst/new"
+fi
+
+if testcase "filename invalid"; then
+	mkmd "src" "dst"
+	echo "Subject: invalid" >"${TSHDIR}/src/new/hostname.1553633333"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match date filename > 1 week move "dst"
+	}
+	EOF
+	mdsort
+	refute_empty "src/new"
+	assert_empty "dst/new"
+fi
+
+# The file name is sufficient, the message must not be read. Reading a message
+# which requires its content ensures the fault is eventually hit.
+if testcase -t fault "filename without reading message"; then
+	mkmd "src" "dst" "other"
+	mkmsg "src/new"
+	mkmsg "other/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match date filename > 1 week move "dst"
+	}
+	maildir "other" {
+		match header "Subject" /x/ move "dst"
+	}
+	EOF
+	mdsort -e -f "name=message_load" - <<-EOF
+	mdsort: fault: message_load
+	EOF
+	assert_empty "src/new"
+	refute_empty "dst/new"
+	refute_empty "other/new"
+fi
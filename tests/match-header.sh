@@ -78,6 +78,119 @@ if testcase "duplicate headers"; then
 	refute_empty "root/new"
 fi
 
+if testcase "many patterns on same headers"; then
+	mkmd "src" "admin" "list-foo" "user" "other"
+	mkmsg "src/new" -- "Cc" "ADMIN@example.com"
+	mkmsg "src/new" -- "To" "list@example.com" "List-Id" "<foo.example.com>"
+	mkmsg "src/new" -- "To" "foo@example.com" "Cc" "user@example.com"
+	mkmsg "src/new" -- "To" "foo@example.com"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header { "To" "Cc" } /root@example\.com/ move "root"
+		match header { "To" "Cc" } /admin@example\.com/i move "admin"
+		match header "List-Id" /<(foo)\.example\.com>/ move "list-\1"
+		match header { "To" "Cc" } /user@example\.com/ move "user"
+		match ! header { "To" "Cc" } /example\.org/ move "other"
+	}
+	EOF
+	mdsort
+	assert_empty "src/new"
+	refute_empty "admin/new"
+	refute_empty "list-foo/new"
+	refute_empty "user/new"
+	refute_empty "other/new"
+fi
+
+if testcase "literal statistics"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "To" "user@example.com"
+	mkmsg "src/new" -- "To" "admin@example.com"
+	mkmsg "src/new" -- "To" "USER@EXAMPLE.ORG"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "To" /^user@example\.com$/ move "dst"
+		match header "To" /user/i move "dst"
+		match header "To" /(root|admin)/ move "dst"
+	}
+	EOF
+	cat <<-EOF >"${TMP1}"
+	expr_log_stats: line 2: literal "user@example.com": hit=1, miss=2
+	expr_log_stats: line 2: memo: hit=0, miss=1
+	expr_log_stats: line 3: literal "er": hit=1, miss=1
+	expr_log_stats: line 3: memo: hit=0, miss=1
+	expr_log_stats: line 4: memo: hit=0, miss=1
+	EOF
+	mdsort -- -vv | grep '^expr_log_stats' | assert_file "${TMP1}" -
+	assert_empty "src/new"
+fi
+
+if testcase "memoized results"; then
+	mkmd "src" "user-example" "dst"
+	mkmsg "src/new" -- "To" "user@example.com"
+	mkmsg "src/new" -- "To" "user@example.com"
+	mkmsg "src/new" -- "To" "admin@example.com"
+	mkmsg "src/new" -- "To" "admin@example.com"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "To" /^(user)@([^\.]+)\.com$/ move "\1-\2"
+		match all move "dst"
+	}
+	EOF
+	cat <<-EOF >"${TMP1}"
+	expr_log_stats: line 2: literal ".com": hit=4, miss=0
+	expr_log_stats: line 2: memo: hit=2, miss=2
+	expr_log_stats: line 2: regexec=1
+	EOF
+	mdsort -- -vv -j 1 | grep '^expr_log_stats' | assert_file "${TMP1}" -
+	assert_empty "src/new"
+	assert_eq "2" "$(find "${TSHDIR}/user-example/new" -type f | wc -l | xargs)"
+	assert_eq "2" "$(find "${TSHDIR}/dst/new" -type f | wc -l | xargs)"
+fi
+
+# Long values are never memoized.
+if testcase "memoized results long value"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "Subject" "$(genstr 129)"
+	mkmsg "src/new" -- "Subject" "$(genstr 129)"
+	mkmsg "src/new" -- "Subject" "$(genstr 128)"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /^x+$/ move "dst"
+	}
+	EOF
+	cat <<-EOF >"${TMP1}"
+	expr_log_stats: line 2: literal "x": hit=3, miss=0
+	expr_log_stats: line 2: memo: hit=0, miss=1
+	EOF
+	mdsort -- -vv -j 1 | grep '^expr_log_stats' | assert_file "${TMP1}" -
+	assert_empty "src/new"
+fi
+
+# The subexpressions are only extracted if used by back-references within the
+# same rule, the DFA is otherwise sufficient.
+if testcase "subexpressions"; then
+	mkmd "src" "dst" "user"
+	mkmsg "src/new" -- "To" "user@example.com" "Cc" "user@example.com"
+	mkmsg "src/new" -- "To" "admin@example.com" "Cc" "admin@example.com"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "To" /^(admin)@/ move "dst"
+		match header "Cc" /^(user)@/ move "\1"
+	}
+	EOF
+	cat <<-EOF >"${TMP1}"
+	expr_log_stats: line 2: literal "@": hit=2, miss=0
+	expr_log_stats: line 2: memo: hit=0, miss=2
+	expr_log_stats: line 3: literal "@": hit=1, miss=0
+	expr_log_stats: line 3: memo: hit=0, miss=1
+	expr_log_stats: line 3: regexec=1
+	EOF
+	mdsort -- -vv | grep '^expr_log_stats' | assert_file "${TMP1}" -
+	assert_empty "src/new"
+	refute_empty "dst/new"
+	refute_empty "user/new"
+fi
+
 if testcase "key comparison is case insensitive"; then
 	mkmd "src" "dst"
 	mkmsg "src/new" -- "to" "user@example.com"
@@ -29,3 +29,27 @@ if testcase "negate"; then
 	assert_empty "dst/new"
 	refute_empty "dst/cur"
 fi
+
+# The path is sufficient, the message must not be read. Reading a message which
+# requires its content ensures the fault is eventually hit.
+if testcase -t fault "without reading message"; then
+	mkmd "src" "dst" "other"
+	mkmsg "src/new"
+	mkmsg "src/cur"
+	mkmsg "other/new"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match ! new move "dst"
+	}
+	maildir "other" {
+		match new and header "Subject" /x/ move "dst"
+	}
+	EOF
+	mdsort -e -f "name=message_load" - <<-EOF
+	mdsort: fault: message_load
+	EOF
+	refute_empty "src/new"
+	assert_empty "src/cur"
+	refute_empty "dst/cur"
+	refute_empty "other/new"
+fi
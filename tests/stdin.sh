@@ -103,3 +103,47 @@ if testcase "dry run"; then
 	<stdin> -> <move "dst/new">
 	EOF
 fi
+
+if testcase "move preserves message"; then
+	mkmd "dst"
+	cat <<-EOF >"${TMP1}"
+	From user@localhost Wed Dec 13 00:00:01 2020
+	To: to
+
+	body
+	EOF
+	cat <<-EOF >"${CONF}"
+	stdin { match all move "dst" }
+	EOF
+	mdsort -- - <"${TMP1}"
+	assert_file "${TMP1}" "$(findmsg -p "dst/new")"
+fi
+
+if testcase "label and move"; then
+	mkmd "dst"
+	cat <<-EOF >"${CONF}"
+	stdin { match all label "label" move "dst" }
+	EOF
+	mdsort -- - <<-EOF
+	To: to
+
+	body
+	EOF
+	assert_label label "$(findmsg "dst/new")"
+fi
+
+if testcase "exec"; then
+	cat <<-EOF >"${CONF}"
+	stdin { match all exec stdin "cat" }
+	EOF
+	mdsort -- - >"${TMP2}" <<-EOF
+	To: to
+
+	body
+	EOF
+	assert_file - "${TMP2}" <<-EOF
+	To: to
+
+	body
+	EOF
+fi
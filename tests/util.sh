@@ -169,7 +169,7 @@ mdsort() {
 	done
 
 	_tmpdir="${TSHDIR}/_tmpdir"
-	mkdir "${_tmpdir}"
+	mkdir -p "${_tmpdir}"
 
 	# shellcheck disable=SC2086
 	(cd "${TSHDIR}" && env LC_ALL=en_US.UTF-8 "TMPDIR=${_tmpdir}" \
@@ -0,0 +1,100 @@
+# watch_start
+#
+# Start mdsort in watch mode in the background.
+watch_start() {
+	(cd "${TSHDIR}" && exec env "TMPDIR=${TSHDIR}" ${EXEC:-} "${MDSORT}" \
+		-f mdsort.conf -w) >"${TSHDIR}/watch" 2>&1 &
+	WATCHPID=$!
+}
+
+# watch_stop
+#
+# Stop mdsort running in watch mode.
+watch_stop() {
+	kill "${WATCHPID}"
+	wait "${WATCHPID}" ||
+		fail - "want exit 0, got $?" <"${TSHDIR}/watch"
+}
+
+# watch_wait dir count
+#
+# Wait until the given directory contains the given number of messages.
+watch_wait() {
+	local _i=0
+
+	while [ "${_i}" -lt 50 ]; do
+		if [ "$(find "${TSHDIR}/${1}" -type f | wc -l)" -eq "$2" ]; then
+			return 0
+		fi
+		sleep 0.1
+		_i=$((_i + 1))
+	done
+	fail - "expected ${2} message(s) in ${1}" <"${TSHDIR}/watch"
+}
+
+if testcase "watch new messages"; then
+	mkmd "src" "dst"
+	mkmsg "src/new" -- "Subject" "old"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match header "Subject" /old|new/ move "dst"
+	}
+	EOF
+	watch_start
+	watch_wait "dst/new" 1
+	mkmsg "src/new" -- "Subject" "new"
+	mkmsg "src/cur" -- "Subject" "new"
+	mkmsg "src/new" -- "Subject" "keep"
+	watch_wait "dst" 3
+	watch_stop
+	assert_empty "src/cur"
+	refute_empty "src/new"
+fi
+
+if testcase "watch reload"; then
+	mkmd "src" "dst1" "dst2"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all move "dst1"
+	}
+	EOF
+	watch_start
+	mkmsg "src/new"
+	watch_wait "dst1/new" 1
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all move "dst2"
+	}
+	EOF
+	kill -HUP "${WATCHPID}"
+	sleep 0.2
+	mkmsg "src/new"
+	watch_wait "dst2/new" 1
+	watch_stop
+	assert_empty "src/new"
+fi
+
+if testcase "watch reload invalid configuration"; then
+	mkmd "src" "dst"
+	cat <<-EOF >"${CONF}"
+	maildir "src" {
+		match all move "dst"
+	}
+	EOF
+	watch_start
+	mkmsg "src/new"
+	watch_wait "dst/new" 1
+	echo "invalid" >"${CONF}"
+	kill -HUP "${WATCHPID}"
+	sleep 0.2
+	mkmsg "src/new"
+	watch_wait "dst/new" 2
+	watch_stop
+	grep -q 'syntax error' "${TSHDIR}/watch" ||
+		fail - "expected syntax error" <"${TSHDIR}/watch"
+fi
+
+if testcase "watch from stdin"; then
+	mdsort -e -- -w - </dev/null >"${TMP1}"
+	grep -q 'usage' "${TMP1}" || fail - "expected usage output" <"${TMP1}"
+fi
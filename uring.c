@@ -0,0 +1,338 @@
+#include "uring.h"
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/fs.h>	/* RENAME_NOREPLACE */
+#include <linux/io_uring.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libks/arena.h"
+#include "log.h"
+
+struct uring {
+	struct {
+		unsigned int		*head;
+		unsigned int		*tail;
+		unsigned int		*mask;
+		unsigned int		*array;
+		struct io_uring_sqe	*sqes;
+	} u_sq;
+
+	struct {
+		unsigned int		*head;
+		unsigned int		*tail;
+		unsigned int		*mask;
+		struct io_uring_cqe	*cqes;
+	} u_cq;
+
+	void		*u_sqmap;
+	size_t		 u_sqmapsiz;
+	void		*u_cqmap;
+	size_t		 u_cqmapsiz;
+	size_t		 u_sqessiz;
+
+	unsigned int	 u_entries;
+	unsigned int	 u_pending;	/* number of prepared entries */
+	int		 u_fd;
+};
+
+static struct io_uring_sqe	*uring_prep(struct uring *, int);
+static int			 uring_probe(int);
+static int			 uring_reap(struct uring *, int *);
+
+/*
+ * Allocate a ring used to submit file system operations in batches, capable of
+ * holding the given number of operations. Returns NULL if io_uring is
+ * unavailable, in which case the caller is expected to fallback to carrying
+ * out the operations synchronously.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * uring_free().
+ */
+struct uring *
+uring_alloc(unsigned int entries, struct arena_scope *s)
+{
+	struct io_uring_params params;
+	struct uring *u;
+	char *cq, *sq;
+	int fd;
+
+	memset(&params, 0, sizeof(params));
+	fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+	if (fd == -1) {
+		log_debug("%s: io_uring_setup: %s\n", __func__,
+		    strerror(errno));
+		return NULL;
+	}
+	if (!uring_probe(fd)) {
+		log_debug("%s: operations not supported\n", __func__);
+		close(fd);
+		return NULL;
+	}
+
+	u = arena_calloc(s, 1, sizeof(*u));
+	u->u_fd = fd;
+	u->u_entries = params.sq_entries;
+	u->u_sqmapsiz = params.sq_off.array +
+	    params.sq_entries * sizeof(unsigned int);
+	u->u_cqmapsiz = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->u_cqmapsiz > u->u_sqmapsiz)
+			u->u_sqmapsiz = u->u_cqmapsiz;
+		u->u_cqmapsiz = 0;
+	}
+
+	u->u_sqmap = mmap(NULL, u->u_sqmapsiz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->u_sqmap == MAP_FAILED) {
+		warn("mmap");
+		u->u_sqmap = NULL;
+		goto err;
+	}
+	if (u->u_cqmapsiz > 0) {
+		u->u_cqmap = mmap(NULL, u->u_cqmapsiz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (u->u_cqmap == MAP_FAILED) {
+			warn("mmap");
+			u->u_cqmap = NULL;
+			goto err;
+		}
+	}
+	u->u_sqessiz = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->u_sq.sqes = mmap(NULL, u->u_sqessiz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->u_sq.sqes == MAP_FAILED) {
+		warn("mmap");
+		u->u_sq.sqes = NULL;
+		goto err;
+	}
+
+	sq = u->u_sqmap;
+	u->u_sq.head = (unsigned int *)(sq + params.sq_off.head);
+	u->u_sq.tail = (unsigned int *)(sq + params.sq_off.tail);
+	u->u_sq.mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	u->u_sq.array = (unsigned int *)(sq + params.sq_off.array);
+	cq = u->u_cqmap != NULL ? u->u_cqmap : u->u_sqmap;
+	u->u_cq.head = (unsigned int *)(cq + params.cq_off.head);
+	u->u_cq.tail = (unsigned int *)(cq + params.cq_off.tail);
+	u->u_cq.mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	u->u_cq.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return u;
+
+err:
+	uring_free(u);
+	return NULL;
+}
+
+void
+uring_free(struct uring *u)
+{
+	if (u == NULL)
+		return;
+
+	if (u->u_sq.sqes != NULL)
+		munmap(u->u_sq.sqes, u->u_sqessiz);
+	if (u->u_cqmap != NULL)
+		munmap(u->u_cqmap, u->u_cqmapsiz);
+	if (u->u_sqmap != NULL)
+		munmap(u->u_sqmap, u->u_sqmapsiz);
+	close(u->u_fd);
+}
+
+/*
+ * Prepare a renameat2(2) operation, failing with EEXIST as opposed of replacing
+ * an existing file. The paths must remain valid until the ring is submitted.
+ * Returns the index of the operation, see uring_submit(), or -1 if the ring is
+ * full.
+ */
+int
+uring_renameat(struct uring *u, const char *oldpath, const char *newpath)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_prep(u, IORING_OP_RENAMEAT);
+	if (sqe == NULL)
+		return -1;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)oldpath;
+	sqe->len = (unsigned int)AT_FDCWD;
+	sqe->addr2 = (uintptr_t)newpath;
+	sqe->rename_flags = RENAME_NOREPLACE;
+	return (int)sqe->user_data;
+}
+
+/*
+ * Prepare an unlinkat(2) operation, see uring_renameat().
+ */
+int
+uring_unlinkat(struct uring *u, const char *path)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_prep(u, IORING_OP_UNLINKAT);
+	if (sqe == NULL)
+		return -1;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	return (int)sqe->user_data;
+}
+
+/*
+ * Submit all prepared operations and wait for them to complete. The result of
+ * each operation is stored in the given results array, indexed by the value
+ * returned while preparing the operation. A negative result represents an
+ * errno. Returns zero on success, non-zero otherwise.
+ */
+int
+uring_submit(struct uring *u, int *results)
+{
+	unsigned int ncompleted = 0;
+	unsigned int nsubmitted = 0;
+	unsigned int npending = u->u_pending;
+
+	if (npending == 0)
+		return 0;
+	u->u_pending = 0;
+
+	/* Make the prepared entries visible to the kernel. */
+	__atomic_store_n(u->u_sq.tail, *u->u_sq.tail + npending,
+	    __ATOMIC_RELEASE);
+
+	while (ncompleted < npending) {
+		long n;
+
+		n = syscall(SYS_io_uring_enter, u->u_fd,
+		    npending - nsubmitted, npending - ncompleted,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("io_uring_enter");
+			return 1;
+		}
+		nsubmitted += (unsigned int)n;
+		ncompleted += (unsigned int)uring_reap(u, results);
+	}
+	log_debug("%s: operations=%u\n", __func__, npending);
+
+	return 0;
+}
+
+static struct io_uring_sqe *
+uring_prep(struct uring *u, int opcode)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (u->u_pending == u->u_entries)
+		return NULL;
+
+	idx = (*u->u_sq.tail + u->u_pending) & *u->u_sq.mask;
+	sqe = &u->u_sq.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (unsigned char)opcode;
+	sqe->user_data = u->u_pending++;
+	u->u_sq.array[idx] = idx;
+	return sqe;
+}
+
+/*
+ * Returns non-zero if all operations used are supported by the kernel.
+ */
+static int
+uring_probe(int fd)
+{
+	static const int ops[] = {
+		IORING_OP_RENAMEAT,
+		IORING_OP_UNLINKAT,
+	};
+	struct io_uring_probe *probe;
+	size_t i, siz;
+	int supported = 1;
+
+	siz = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, siz);
+	if (probe == NULL)
+		err(1, NULL);
+	if (syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+	    256) == -1) {
+		free(probe);
+		return 0;
+	}
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+		    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+			supported = 0;
+	}
+	free(probe);
+	return supported;
+}
+
+static int
+uring_reap(struct uring *u, int *results)
+{
+	unsigned int head, tail;
+	int n = 0;
+
+	head = *u->u_cq.head;
+	tail = __atomic_load_n(u->u_cq.tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe;
+
+		cqe = &u->u_cq.cqes[head & *u->u_cq.mask];
+		results[cqe->user_data] = cqe->res;
+		n++;
+	}
+	__atomic_store_n(u->u_cq.head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+#else
+
+#include <stddef.h>	/* NULL */
+#include "libks/compiler.h"
+
+struct uring *
+uring_alloc(unsigned int UNUSED(entries), struct arena_scope *UNUSED(s))
+{
+	return NULL;
+}
+
+void
+uring_free(struct uring *UNUSED(u))
+{
+}
+
+int
+uring_renameat(struct uring *UNUSED(u), const char *UNUSED(oldpath),
+    const char *UNUSED(newpath))
+{
+	return -1;
+}
+
+int
+uring_unlinkat(struct uring *UNUSED(u), const char *UNUSED(path))
+{
+	return -1;
+}
+
+int
+uring_submit(struct uring *UNUSED(u), int *UNUSED(results))
+{
+	return 1;
+}
+
+#endif
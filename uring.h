@@ -0,0 +1,8 @@
+struct arena_scope;
+
+struct uring	*uring_alloc(unsigned int, struct arena_scope *);
+void		 uring_free(struct uring *);
+
+int	uring_renameat(struct uring *, const char *, const char *);
+int	uring_unlinkat(struct uring *, const char *);
+int	uring_submit(struct uring *, int *);
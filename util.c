@@ -163,3 +163,21 @@ isstdin(const char *str)
 {
 	return strcmp(str, "/dev/stdin") == 0;
 }
+
+/*
+ * Compute the 64-bit FNV-1a hash of the given buffer. The hash can be computed
+ * incrementally by passing the previously returned hash, the first invocation
+ * must use FNV1A_INIT.
+ */
+uint64_t
+fnv1a(uint64_t h, const void *buf, size_t siz)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < siz; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
@@ -1,4 +1,8 @@
 #include <stddef.h>	/* size_t */
+#include <stdint.h>
+
+/* Initial value for fnv1a(). */
+#define FNV1A_INIT	0xcbf29ce484222325ULL
 
 int	exec(const char **, int);
 
@@ -8,3 +12,5 @@ char	*pathslice(const char *, char *, size_t, int, int);
 size_t	nspaces(const char *);
 
 int	isstdin(const char *);
+
+uint64_t	fnv1a(uint64_t, const void *, size_t);
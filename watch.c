@@ -0,0 +1,216 @@
+#include "watch.h"
+#include "config.h"
+
+#ifdef HAVE_INOTIFY
+
+#include <sys/inotify.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>	/* NAME_MAX */
+#include <poll.h>
+#include <unistd.h>
+#include "libks/arena-vector.h"
+#include "libks/arena.h"
+#include "libks/vector.h"
+#include "log.h"
+
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_descriptor {
+	void	*arg;
+	int	 wd;
+};
+
+struct watch {
+	struct watch_descriptor	*w_descriptors;	/* VECTOR(struct watch_descriptor) */
+	int			 w_fd;
+};
+
+static void	*watch_find(const struct watch *, int);
+
+/*
+ * Allocate a watch used to get notified about files being added to
+ * directories.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * watch_free().
+ */
+struct watch *
+watch_alloc(struct arena_scope *s)
+{
+	struct watch *w;
+	int fd;
+
+	fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd == -1) {
+		warn("inotify_init1");
+		return NULL;
+	}
+
+	w = arena_calloc(s, 1, sizeof(*w));
+	ARENA_VECTOR_INIT(s, w->w_descriptors, 4);
+	w->w_fd = fd;
+	return w;
+}
+
+void
+watch_free(struct watch *w)
+{
+	if (w == NULL)
+		return;
+	close(w->w_fd);
+}
+
+/*
+ * Watch the given directory. The argument is associated with all events
+ * originating from the directory. Returns zero on success, non-zero otherwise.
+ */
+int
+watch_add(struct watch *w, const char *path, void *arg)
+{
+	struct watch_descriptor *wd;
+	int fd;
+
+	fd = inotify_add_watch(w->w_fd, path, WATCH_MASK);
+	if (fd == -1) {
+		warn("inotify_add_watch: %s", path);
+		return 1;
+	}
+	log_debug("%s: %s\n", __func__, path);
+
+	wd = ARENA_VECTOR_ALLOC(w->w_descriptors);
+	wd->arg = arg;
+	wd->wd = fd;
+	return 0;
+}
+
+/*
+ * Wait for events for at most the given number of milliseconds. Returns 1 if
+ * events are available, 0 on timeout or if interrupted by a signal and -1 on
+ * error.
+ */
+int
+watch_wait(struct watch *w, int timeout)
+{
+	struct pollfd pfd = {
+		.fd	= w->w_fd,
+		.events	= POLLIN,
+	};
+
+	switch (poll(&pfd, 1, timeout)) {
+	case -1:
+		if (errno == EINTR)
+			return 0;
+		warn("poll");
+		return -1;
+	case 0:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Read all pending events and append them to the given arena vector. If the
+ * kernel event queue overflowed, an event with an absent argument is appended
+ * signalling that events were lost. Returns zero on success, non-zero
+ * otherwise.
+ */
+int
+watch_read(struct watch *w, struct watch_event **events, struct arena_scope *s)
+{
+	char buf[4 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t i, nr;
+
+		nr = read(w->w_fd, buf, sizeof(buf));
+		if (nr == -1) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == EINTR)
+				continue;
+			warn("read");
+			return 1;
+		}
+
+		for (i = 0; i < nr;) {
+			const struct inotify_event *ev =
+			    (const struct inotify_event *)&buf[i];
+			struct watch_event *we;
+			void *arg;
+
+			i += (ssize_t)(sizeof(*ev) + ev->len);
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				log_debug("%s: queue overflow\n", __func__);
+				(void)ARENA_VECTOR_CALLOC(*events);
+				continue;
+			}
+			if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) == 0 ||
+			    (ev->mask & IN_ISDIR) || ev->len == 0)
+				continue;
+
+			arg = watch_find(w, ev->wd);
+			if (arg == NULL)
+				continue;
+			we = ARENA_VECTOR_ALLOC(*events);
+			we->arg = arg;
+			we->name = arena_strdup(s, ev->name);
+		}
+	}
+
+	return 0;
+}
+
+static void *
+watch_find(const struct watch *w, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < VECTOR_LENGTH(w->w_descriptors); i++) {
+		if (w->w_descriptors[i].wd == fd)
+			return w->w_descriptors[i].arg;
+	}
+	return NULL;
+}
+
+#else
+
+#include <err.h>
+#include <stddef.h>	/* NULL */
+#include "libks/compiler.h"
+
+struct watch *
+watch_alloc(struct arena_scope *UNUSED(s))
+{
+	warnx("watching maildirs is not supported on this platform");
+	return NULL;
+}
+
+void
+watch_free(struct watch *UNUSED(w))
+{
+}
+
+int
+watch_add(struct watch *UNUSED(w), const char *UNUSED(path),
+    void *UNUSED(arg))
+{
+	return 1;
+}
+
+int
+watch_wait(struct watch *UNUSED(w), int UNUSED(timeout))
+{
+	return -1;
+}
+
+int
+watch_read(struct watch *UNUSED(w), struct watch_event **UNUSED(events),
+    struct arena_scope *UNUSED(s))
+{
+	return 1;
+}
+
+#endif
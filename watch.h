@@ -0,0 +1,14 @@
+struct arena_scope;
+
+struct watch_event {
+	void		*arg;	/* NULL if events were lost */
+	const char	*name;
+};
+
+struct watch	*watch_alloc(struct arena_scope *);
+void		 watch_free(struct watch *);
+
+int			 watch_add(struct watch *, const char *, void *);
+int			 watch_wait(struct watch *, int);
+int			 watch_read(struct watch *, struct watch_event **,
+    struct arena_scope *);
@@ -0,0 +1,242 @@
+#include "worker.h"
+#include "config.h"
+#include <err.h>
+#include <pthread.h>
+#include "libks/arena.h"
+#include "log.h"
+
+struct worker {
+	struct worker_pool	*wk_pool;
+	struct arena		*wk_eternal;
+	struct arena		*wk_scratch;
+	struct arena_scope	 wk_scope;	/* active during a batch */
+	pthread_t		 wk_thread;
+};
+
+struct worker_pool {
+	struct worker	*wp_workers;
+	unsigned int	 wp_nworkers;
+	worker_fn	*wp_fn;
+
+	pthread_mutex_t	 wp_lock;
+	pthread_cond_t	 wp_cv;
+
+	/* Current batch of jobs. */
+	char		*wp_jobs;
+	size_t		 wp_njobs;
+	size_t		 wp_stride;
+	size_t		 wp_next;	/* next job to claim */
+
+	unsigned int	 wp_run;	/* generation of last started batch */
+	unsigned int	 wp_release;	/* generation of last released batch */
+	unsigned int	 wp_nrunning;	/* workers evaluating the batch */
+	unsigned int	 wp_nholding;	/* workers inside the batch scope */
+	int		 wp_shutdown;
+};
+
+static void	*worker_main(void *);
+static void	 worker_run(struct worker *);
+
+/*
+ * Allocate a pool of workers used to evaluate jobs concurrently. Each worker
+ * has its own eternal and scratch arena passed to the given function. If the
+ * number of workers is equal to 1, all jobs are evaluated by the calling
+ * thread.
+ *
+ * The caller is responsible for freeing the returned memory using
+ * worker_pool_free().
+ */
+struct worker_pool *
+worker_pool_alloc(unsigned int nworkers, worker_fn *fn, struct arena_scope *s)
+{
+	struct worker_pool *wp;
+	unsigned int i;
+	int error;
+
+	wp = arena_calloc(s, 1, sizeof(*wp));
+	wp->wp_workers = arena_calloc(s, nworkers, sizeof(*wp->wp_workers));
+	wp->wp_nworkers = nworkers;
+	wp->wp_fn = fn;
+	if ((error = pthread_mutex_init(&wp->wp_lock, NULL)) != 0)
+		errc(1, error, "pthread_mutex_init");
+	if ((error = pthread_cond_init(&wp->wp_cv, NULL)) != 0)
+		errc(1, error, "pthread_cond_init");
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *wk = &wp->wp_workers[i];
+
+		wk->wk_pool = wp;
+		wk->wk_eternal = arena_alloc("eternal");
+		wk->wk_scratch = arena_alloc("scratch");
+	}
+
+	if (nworkers == 1)
+		return wp;
+
+	for (i = 0; i < nworkers; i++) {
+		struct worker *wk = &wp->wp_workers[i];
+
+		error = pthread_create(&wk->wk_thread, NULL, worker_main, wk);
+		if (error)
+			errc(1, error, "pthread_create");
+	}
+	log_debug("%s: workers=%u\n", __func__, nworkers);
+
+	return wp;
+}
+
+void
+worker_pool_free(struct worker_pool *wp)
+{
+	unsigned int i;
+
+	if (wp == NULL)
+		return;
+
+	if (wp->wp_nworkers > 1) {
+		pthread_mutex_lock(&wp->wp_lock);
+		wp->wp_shutdown = 1;
+		pthread_cond_broadcast(&wp->wp_cv);
+		pthread_mutex_unlock(&wp->wp_lock);
+
+		for (i = 0; i < wp->wp_nworkers; i++) {
+			int error;
+
+			error = pthread_join(wp->wp_workers[i].wk_thread, NULL);
+			if (error)
+				errc(1, error, "pthread_join");
+		}
+	}
+
+	for (i = 0; i < wp->wp_nworkers; i++) {
+		arena_free(wp->wp_workers[i].wk_scratch);
+		arena_free(wp->wp_workers[i].wk_eternal);
+	}
+	pthread_cond_destroy(&wp->wp_cv);
+	pthread_mutex_destroy(&wp->wp_lock);
+}
+
+/*
+ * Evaluate the given batch of jobs, returns once all jobs are evaluated.
+ * Any memory allocated by the workers remain valid until the batch is released
+ * using worker_pool_release(). In between, the workers are idle and the caller
+ * is therefore allowed to operate on the result of all jobs, including
+ * allocations in the arenas associated with the jobs.
+ */
+void
+worker_pool_run(struct worker_pool *wp, void *jobs, size_t njobs,
+    size_t stride)
+{
+	wp->wp_njobs = njobs;
+	if (njobs == 0)
+		return;
+
+	if (wp->wp_nworkers == 1) {
+		struct worker *wk = &wp->wp_workers[0];
+
+		wp->wp_jobs = jobs;
+		wp->wp_stride = stride;
+		wp->wp_next = 0;
+		wk->wk_scope = arena_scope_enter(wk->wk_eternal);
+		worker_run(wk);
+		return;
+	}
+
+	/*
+	 * Wait until all workers are done with the batch, not only until all
+	 * jobs are evaluated. Otherwise, a worker lagging behind could observe
+	 * the next batch before entering the current one.
+	 */
+	pthread_mutex_lock(&wp->wp_lock);
+	wp->wp_jobs = jobs;
+	wp->wp_stride = stride;
+	wp->wp_next = 0;
+	wp->wp_nrunning = wp->wp_nworkers;
+	wp->wp_nholding = wp->wp_nworkers;
+	wp->wp_run++;
+	pthread_cond_broadcast(&wp->wp_cv);
+	while (wp->wp_nrunning > 0)
+		pthread_cond_wait(&wp->wp_cv, &wp->wp_lock);
+	pthread_mutex_unlock(&wp->wp_lock);
+}
+
+/*
+ * Release all memory allocated during the evaluation of the current batch,
+ * returns once all workers have left the batch.
+ */
+void
+worker_pool_release(struct worker_pool *wp)
+{
+	if (wp->wp_njobs == 0)
+		return;
+
+	if (wp->wp_nworkers == 1) {
+		arena_scope_leave(&wp->wp_workers[0].wk_scope);
+		return;
+	}
+
+	pthread_mutex_lock(&wp->wp_lock);
+	wp->wp_release = wp->wp_run;
+	pthread_cond_broadcast(&wp->wp_cv);
+	while (wp->wp_nholding > 0)
+		pthread_cond_wait(&wp->wp_cv, &wp->wp_lock);
+	pthread_mutex_unlock(&wp->wp_lock);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *wk = arg;
+	struct worker_pool *wp = wk->wk_pool;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&wp->wp_lock);
+	for (;;) {
+		while (wp->wp_run == gen && !wp->wp_shutdown)
+			pthread_cond_wait(&wp->wp_cv, &wp->wp_lock);
+		if (wp->wp_shutdown)
+			break;
+		gen = wp->wp_run;
+		pthread_mutex_unlock(&wp->wp_lock);
+
+		wk->wk_scope = arena_scope_enter(wk->wk_eternal);
+		worker_run(wk);
+
+		/* Allocations must remain valid until the batch is released. */
+		pthread_mutex_lock(&wp->wp_lock);
+		if (--wp->wp_nrunning == 0)
+			pthread_cond_broadcast(&wp->wp_cv);
+		while (wp->wp_release != gen && !wp->wp_shutdown)
+			pthread_cond_wait(&wp->wp_cv, &wp->wp_lock);
+		pthread_mutex_unlock(&wp->wp_lock);
+
+		arena_scope_leave(&wk->wk_scope);
+		pthread_mutex_lock(&wp->wp_lock);
+		if (--wp->wp_nholding == 0)
+			pthread_cond_broadcast(&wp->wp_cv);
+	}
+	pthread_mutex_unlock(&wp->wp_lock);
+
+	return NULL;
+}
+
+static void
+worker_run(struct worker *wk)
+{
+	struct worker_pool *wp = wk->wk_pool;
+
+	for (;;) {
+		size_t i;
+
+		pthread_mutex_lock(&wp->wp_lock);
+		if (wp->wp_next == wp->wp_njobs) {
+			pthread_mutex_unlock(&wp->wp_lock);
+			break;
+		}
+		i = wp->wp_next++;
+		pthread_mutex_unlock(&wp->wp_lock);
+
+		wp->wp_fn(&wp->wp_jobs[i * wp->wp_stride], &wk->wk_scope,
+		    wk->wk_scratch);
+	}
+}
@@ -0,0 +1,16 @@
+#include <stddef.h>	/* size_t */
+
+struct arena;
+struct arena_scope;
+
+/* Upper bound for the number of workers. */
+#define WORKER_MAX	64
+
+typedef void worker_fn(void *, struct arena_scope *, struct arena *);
+
+struct worker_pool	*worker_pool_alloc(unsigned int, worker_fn *,
+    struct arena_scope *);
+void			 worker_pool_free(struct worker_pool *);
+
+void	worker_pool_run(struct worker_pool *, void *, size_t, size_t);
+void	worker_pool_release(struct worker_pool *);